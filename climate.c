@@ -11,6 +11,10 @@
  *
  * Example Run:      ./climate data_tn.tdv data_wa.tdv
  *
+ * A file name of - reads standard input, so the data can come from a pipe:
+ * `some_feed | ./climate -`. Files ending in .gz are decompressed through
+ * gzip.
+ *
  *
  * Opening file: data_tn.tdv
  * Opening file: data_wa.tdv
@@ -61,15 +65,336 @@
  *      lightning strikes (1 = lightning strike, 0 = no lightning),
  *      pressure (Pa),
  *      surface temperature (Kelvin)
+ *
+ * Options:
+ *
+ *      --profile   Also print a data-quality profile of the input: rows
+ *                  with missing fields, out-of-range values, duplicate
+ *                  timestamps and unknown state codes.
+ *      --time-weighted
+ *                  Also report humidity and temperature averages in which
+ *                  each observation is weighted by the time to its
+ *                  neighbours at the same location, so frequently
+ *                  reporting sites do not dominate.
+ *      --gaps DURATION
+ *                  Also report how completely each location reported:
+ *                  every reading sets its hour in a 24-bit bitset per
+ *                  geohash and day, and silences longer than DURATION
+ *                  count as outages. Prints coverage per state and the
+ *                  longest silences.
+ *      --outages FILE
+ *                  With --gaps, write every outage to FILE as TDV.
+ *      --stations FILE
+ *                  Join every record with station metadata: FILE has lines
+ *                  of geohash, elevation (m) and land-use class separated
+ *                  by tabs, the geohashes all of one length and matched
+ *                  against that prefix of each record's. Prints records,
+ *                  elevation and temperature per land-use class, the
+ *                  temperature also corrected to sea level.
+ *      --lapse-rate RATE
+ *                  Lapse rate for --stations in degrees C per km (6.5).
+ *      --snapshot FILE
+ *                  Also save the per-state accumulators to FILE so that
+ *                  runs can be compared with `climate diff`.
+ *      --trace FILE
+ *                  Record when every chunk of input was read, tokenized,
+ *                  parsed and aggregated, per thread, and write it as a
+ *                  Chrome trace (chrome://tracing or ui.perfetto.dev).
+ *      --explain-analyze
+ *                  Also print, on stderr, the operators the scan ran (read,
+ *                  tokenize, parse, the options above and the aggregate)
+ *                  with rows in and out, selectivity, bytes and time, in
+ *                  total and per thread. `climate query` takes it too.
+ *      -j N        Scan with N threads. Large files are split into ranges.
+ *
+ * Subcommands:
+ *
+ *      ./climate window [--size 1d] [--slide 1d] [--lateness 6h]
+ *                       [--by state|cell] [--precision 4] tdv_file...
+ *          Streams records in arrival order into event-time windows and
+ *          prints each window once the watermark has passed its end.
+ *          Records that only fall into windows already closed are counted
+ *          as late.
+ *
+ *      ./climate sample --n 100000 [--by state|none] [--seed 1] [-j 8]
+ *                       tdv_file...
+ *          Prints a uniform random sample of the input lines, unchanged,
+ *          allocated to each state in proportion to its record count.
+ *
+ *      ./climate diff [--threshold 10] old.snap new.snap
+ *          Compares two snapshots per state and metric, flagging changes
+ *          of at least the threshold percentage. Exits with 0 if nothing
+ *          was flagged, 1 if any change was and 2 on errors (bad
+ *          arguments, a missing or corrupt snapshot).
+ *
+ *      ./climate follow [--metrics PORT|SOCKET_PATH] [--report-every 1m]
+ *                       [--idle-exit 30s] [--wal DIR [--wal-sync 1]]
+ *                       tdv_file...
+ *          Keeps reading the inputs as they grow (like tail -f) and prints
+ *          the report every interval and on exit (Ctrl-C). --metrics serves
+ *          live counters in the Prometheus text format over HTTP on a
+ *          localhost port or a Unix socket. --wal logs what was read to
+ *          DIR so that a restart after a crash resumes where it stopped;
+ *          the log is fsynced every --wal-sync polls (0: never).
+ *
+ *      ./climate serve --listen PORT|SOCKET_PATH [--metrics ADDRESS]
+ *                      tdv_file... | --store DIR [--fanout 4]
+ *          Loads the inputs (or a store directory) into memory and answers
+ *          one command per line:
+ *              report STATE
+ *              lookup GEOHASH
+ *              query [select AGG, ...] [where PRED and ...] [group by KEY]
+ *              cancel ID
+ *              stats
+ *          AGG is count, sum/avg/min/max(COLUMN) or * for the matching
+ *          records; PRED is COLUMN op VALUE with op one of = != < <= > >=;
+ *          bbox(LAT1, LON1, LAT2, LON2) is short for bounds on lat and lon.
+ *          Wherever a numeric column can go, lag(COLUMN[, N]) and
+ *          lead(COLUMN[, N]) give its value N readings (default 1) before
+ *          or after at the same geohash, delta(COLUMN) the change since the
+ *          previous reading and delta(COLUMN, 3h) the change since the
+ *          earliest reading of the last 3 hours. Rows without such a
+ *          reading fail conditions on it and are left out of aggregates
+ *          of it. Over several segments these merge them first.
+ *          KEY is state, cell (cellN for N geohash characters), hour, day
+ *          or month. Columns: time, humidity, snow, cloud, lightning,
+ *          pressure, temp, lat, lon, state, geohash. Commands may start with
+ *          deadline=MS and priority=high|low. Every command is answered
+ *          with "ACCEPTED id", its output and "END id status micros".
+ *          Queries run a chunk at a time, short ones first, so a large
+ *          scan never holds up a small query for more than one chunk.
+ *          With --store, segments added by `climate ingest` are picked up
+ *          and compacted in the background while queries keep running.
+ *
+ *      ./climate ingest --store DIR [--layout state|hilbert] [-j N] tdv_file...
+ *          Adds the inputs to a store directory as a new sorted segment
+ *          with zone maps, without rewriting the existing ones. The hilbert
+ *          layout orders rows along a Hilbert curve over the cell centers
+ *          so that bounding-box queries read a few contiguous zones.
+ *          Geohashes are stored as ids into DIR/DICTIONARY, which every
+ *          segment of the store shares.
+ *
+ *      ./climate compact --store DIR [--fanout 4] [--layout state|hilbert]
+ *          Merges every fanout segments of a level into one of the next
+ *          level. A larger fanout means less write amplification but more
+ *          segments per query. --layout first rewrites every segment in
+ *          that row order.
+ *
+ *      ./climate query --store DIR [--compile CACHE_DIR] [--explain-analyze] "QUERY"
+ *          Runs one query (the language of `climate serve`) over a store
+ *          and reports the zones and pages it read. With --compile (also
+ *          taken by serve) the query's filter and aggregates are written
+ *          out as a C loop over just the columns it uses, built by $CC
+ *          into a shared object in CACHE_DIR named by the hash of the code
+ *          and loaded with dlopen, so a recurring query is compiled once.
+ *          Queries with window functions, or without a compiler, are
+ *          interpreted as usual. serve never waits for the compiler: a
+ *          query is interpreted until its kernel has been built.
+ *          --explain-analyze runs the query an operator at a time per
+ *          chunk and prints each operator with rows in and out,
+ *          selectivity, bytes and time.
+ *
+ *      ./climate generate --rows N [--cells 5000] [--seed 1]
+ *          Writes synthetic records in the TDV format, for testing with
+ *          more data than the samples.
+ *
+ *      ./climate partition --by state|month [--gzip LEVEL] [-j N] OUTDIR tdv_file...
+ *          Reads the inputs once and appends each line, unchanged, to
+ *          OUTDIR/KEY.tdv (KEY.tdv.gz with --gzip), so that later runs on
+ *          one state or month read only its own file. Lines are gathered
+ *          in 4 MiB buffers per partition and written by N threads; with
+ *          --gzip every partition is compressed by its own gzip process.
+ *
+ *      ./climate rolling [--size 24h] [--output FILE] [-j N] tdv_file...
+ *          Trailing-window high and low temperature of every location at
+ *          each of its readings, kept with monotonic deques in O(1) per
+ *          record. Prints per state the average high, low and the largest
+ *          range; --output writes the value at every record as TDV.
+ *
+ *      ./climate join [--sorted] [--partitions 64] [--cells FILE [--precision N]]
+ *                     observed.tdv forecast.tdv
+ *          Pairs every observation with the forecast (in the same TDV
+ *          format) for its geohash and time, and prints the bias, MAE and
+ *          RMSE of temperature and humidity per state. --cells also writes
+ *          them per geohash cell of N characters as TDV. With --sorted both
+ *          inputs are ordered by geohash, then time (as from
+ *          `LC_ALL=C sort -t$'\t' -k3,3 -k2,2n`) and are merge-joined as
+ *          they stream; otherwise both are hash-partitioned by geohash into
+ *          temporary files and each partition is joined in memory.
+ *
+ *      ./climate extremes [--precision 4] [--block year|month] [--fit gev|gumbel]
+ *                         [--min-blocks 5] [-j N] tdv_file...
+ *          Collects the highest and lowest temperature of every geohash
+ *          cell in each year (or month) in one scan, fits a GEV or Gumbel
+ *          distribution to them with L-moments and prints the 10, 50 and
+ *          100 year return levels of heat and cold per cell as TDV. Cells
+ *          with fewer blocks than --min-blocks are left out. Month blocks
+ *          give enough of them from a single year of data, at the cost of
+ *          treating the months as alike.
+ *
+ *      ./climate replay [--rate ROWS_PER_S | --speedup X] [--output FILE|FIFO|-]
+ *                       [--connect PORT|SOCKET_PATH] [--lag METRICS_ADDRESS]
+ *                       [--report-every 10s] tdv_file...
+ *          Writes the input lines in timestamp order, paced at a fixed
+ *          number of rows per second or at X times the speed of their
+ *          event times (as fast as possible with neither), to a file, a
+ *          named pipe, standard output or a connected socket, for
+ *          load-testing `climate follow`. Reports the achieved rate and
+ *          the jitter: how long after its scheduled time each row was
+ *          written. --lag scrapes the --metrics endpoint of the follow
+ *          reading the output and reports how long the written rows took
+ *          to be ingested.
+ *
+ *      ./climate loadgen --connect PORT|SOCKET_PATH [--mix report=1,lookup=8,query=1]
+ *                        [--connections 1,4,16] [--rate PER_S] [--duration 10s]
+ *                        [--queries FILE] [--seed 1] tdv_file...
+ *          Sends a random mix of state reports, lookups of geohashes and
+ *          group-by queries (on the states and geohashes of the inputs,
+ *          or the queries in FILE) to `climate serve`, for --duration at
+ *          each number of connections. Closed loop by default: every
+ *          connection sends its next command when the last one is
+ *          answered. With --rate, commands arrive at that fixed rate over
+ *          the connections whether or not earlier ones were answered, and
+ *          latency counts from when each was due, so a stalled server is
+ *          not hidden by the client waiting on it. Prints throughput and
+ *          p50/p99/p99.9 latency per kind and number of connections as TDV.
+ *
+ *      ./climate shuffle [--workers 4] [--precision 5] [--bucket 1h] [--port N]
+ *                        OUTDIR tdv_file...
+ *          Aggregates records per geohash cell and time bucket with worker
+ *          processes. Each worker scans its share of the inputs, then sends
+ *          every partial aggregate to the worker that owns its key (by
+ *          hash) and merges what it receives, so no single process merges
+ *          the whole table. Worker N writes the keys it owns, sorted, to
+ *          OUTDIR/part-N.tdv. The workers talk over Unix sockets in OUTDIR,
+ *          or over localhost TCP ports N, N + 1, ... with --port. If a
+ *          worker fails, the others are stopped and the command fails.
  */
 
+/* POSIX threads and file APIs are hidden by -std=c99 otherwise */
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #define NUM_STATES 50
+#define NUM_FIELDS 9
+#define KEY_SZ 16
+#define BATCH_SZ 1024
+#define INPUT_BUFFER_SZ (1 << 20)
+#define LINE_SZ 256
+#define TRACE_EVENTS (1 << 16)
+#define NUM_STAGES 3
+#define LATENCY_BUCKETS 10
+#define MAX_AGGREGATES 8
+#define MAX_PREDICATES 8
+#define CHUNK_ROWS 8192
+#define SHORT_ROWS 50000
+#define HDR_SUB_BITS 6
+#define HDR_MAGNITUDES 40
+#define NUM_LOAD_KINDS 3
+#define ZONE_ROWS 4096
+#define DEFAULT_FANOUT 4
+#define WAL_MAGIC 0x4c415743u       /* "CWAL" */
+#define WAL_CHECKPOINT_SZ (64L << 20)
+#define PARTITION_BUFFER_SZ (4 << 20)
+#define PARTITION_QUEUE 4           /* full buffers waiting per writer */
+#define DIFF_ERROR 2                /* exit status of diff when it cannot compare */
+#define SHUFFLE_IDLE_MS 120000      /* an exchange with no progress for this long fails */
+
+/* Numeric columns of the record store and the query language. Times are in
+ * seconds, temperatures in Fahrenheit, lat/lon the center of the geohash
+ * cell. The two string columns follow. */
+#define COL_TIME 0
+#define COL_HUMIDITY 1
+#define COL_SNOW 2
+#define COL_CLOUD 3
+#define COL_LIGHTNING 4
+#define COL_PRESSURE 5
+#define COL_TEMP 6
+#define COL_LAT 7
+#define COL_LON 8
+#define NUM_COLUMNS 9
+#define COL_STATE 9
+#define COL_GEOHASH 10
+#define COL_WINDOW 11               /* first window function of a query */
+
+/* Operators of the report scan counted by --explain-analyze */
+#define SCAN_READ 0
+#define SCAN_TOKENIZE 1
+#define SCAN_PARSE 2
+#define SCAN_PROFILE 3
+#define SCAN_WEIGHTS 4
+#define SCAN_COVERAGE 5
+#define SCAN_STATIONS 6
+#define SCAN_AGGREGATE 7
+#define NUM_SCAN_OPERATORS 8
+
+/* Operators of a query counted by --explain-analyze, one filter per
+ * condition following the others */
+#define QUERY_LOAD 0
+#define QUERY_ZONES 1
+#define QUERY_WINDOWS 2
+#define QUERY_OUTPUT 3
+#define QUERY_FILTERS 4
+#define NUM_QUERY_OPERATORS (QUERY_FILTERS + MAX_PREDICATES)
+
+/* Window functions over the readings of one geohash in time order */
+#define WIN_LAG 0
+#define WIN_LEAD 1
+#define WIN_DELTA 2
+#define MAX_WINDOWS 4
+
+/* Row orders of a store */
+#define LAYOUT_STATE 0              /* state, geohash, time */
+#define LAYOUT_HILBERT 1            /* Hilbert index of the cell, geohash, time */
+#define PAGE_SZ 4096
+
+#define OP_EQ 0
+#define OP_NE 1
+#define OP_LT 2
+#define OP_LE 3
+#define OP_GT 4
+#define OP_GE 5
+
+#define AGG_COUNT 0
+#define AGG_SUM 1
+#define AGG_AVG 2
+#define AGG_MIN 3
+#define AGG_MAX 4
+
+#define GROUP_NONE 0
+#define GROUP_STATE 1
+#define GROUP_CELL 2
+#define GROUP_HOUR 3
+#define GROUP_DAY 4
+#define GROUP_MONTH 5
+
+#define TASK_REPORT 0
+#define TASK_QUERY 1
 
 /* Creating the contents of a struct */
 struct climate_info {
@@ -86,135 +411,9978 @@ struct climate_info {
     double sum_of_cloud_cover;
 };
 
-void analyze_file(FILE *file, struct climate_info *states[], int num_states);
-void print_report(struct climate_info *states[], int num_states);
+/* A batch of parsed records, stored column by column so that checks over a
+ * single field run as tight loops */
+struct record_batch {
+    int count;
+    char text[BATCH_SZ][LINE_SZ];       /* lines as read */
+    char *fields[BATCH_SZ][NUM_FIELDS]; /* fields inside text */
+    unsigned short missing[BATCH_SZ];   /* bit f set when field f is empty */
+    char code[BATCH_SZ][3];
+    long timestamp[BATCH_SZ];           /* milliseconds */
+    char geohash[BATCH_SZ][13];
+    double humidity[BATCH_SZ];
+    double snow[BATCH_SZ];
+    double cloud_cover[BATCH_SZ];
+    double lightning[BATCH_SZ];
+    double pressure[BATCH_SZ];
+    double temperature[BATCH_SZ];       /* Kelvin */
+};
 
-int main(int argc, char *argv[]) {
+/* Set of 64-bit fingerprints, 0 marks an empty slot */
+struct fingerprint_set {
+    size_t count;
+    size_t capacity;
+    unsigned long long *slots;
+};
 
-    /* Checking if commands are less than 1 file */
-    if (argc < 2) {
-        printf("Usage: %s tdv_file1 tdv_file2 ... tdv_fileN \n", argv[0]);
-        return EXIT_FAILURE;
-    }
+/* Data-quality counters collected by --profile during the normal scan */
+struct profile {
+    unsigned long num_rows;
+    unsigned long rows_with_missing;
+    unsigned long rows_out_of_range;
+    unsigned long duplicate_timestamps;
+    unsigned long missing[NUM_FIELDS];
+    unsigned long out_of_range[NUM_FIELDS];
+    struct fingerprint_set seen;        /* (geohash, timestamp) pairs */
+};
 
-    /* Let's create an array to store our state data in. As we know, there are
-     * 50 US states. */
-    struct climate_info *states[NUM_STATES] = { NULL };
+/* One finished stage of one chunk, in microseconds since the trace began */
+struct trace_event {
+    const char *name;
+    long begin;
+    long duration;
+    long chunk;
+};
 
-    int i;
-    for (i = 1; i < argc; ++i) {
-        /* Opening file */
-        FILE *file;
-        file = fopen(argv[i], "r");   
+/* Counters of one operator for --explain-analyze, added to a batch or a
+ * chunk at a time so the rows themselves pay nothing */
+struct operator_stats {
+    unsigned long rows_in;
+    unsigned long rows_out;
+    unsigned long bytes;
+    long micros;
+};
 
-        /* Error if file does not exist */
-        if (file == NULL) {
-            printf("File does not exist. Moving on to next file...");
-            return EXIT_FAILURE;
-        }
+/* Ring of the most recent events of one thread. Only its own thread writes
+ * to it, so recording takes no lock; when it is full the oldest events are
+ * overwritten. */
+struct trace_buffer {
+    int tid;
+    size_t count;                       /* events recorded, ever */
+    struct trace_event *events;         /* TRACE_EVENTS slots */
+};
 
-        /* Analyze the file */
-        analyze_file(file, states, NUM_STATES);
-        
-        fclose(file);
-    }
-    
-    /* Now that we have recorded data for each file, we'll summarize them: */
-    print_report(states, NUM_STATES);
+/* Everything one scan worker feeds */
+struct scan_context {
+    struct climate_info **states;
+    int num_states;
+    struct state_origin *origins;       /* where each state was first seen */
+    struct record_batch *batch;
+    long num_batches;
+    struct profile *profile;            /* NULL unless --profile */
+    struct time_weights *weights;       /* NULL unless --time-weighted */
+    struct coverage *coverage;          /* NULL unless --gaps */
+    const struct station_table *stations;   /* NULL unless --stations */
+    struct landuse_acc *landuse;        /* one per class, then no station */
+    struct trace_buffer *trace;         /* NULL unless --trace */
+    struct operator_stats *explain;     /* NUM_SCAN_OPERATORS, or NULL */
+};
 
-    return 0;
-}
+/* Where a worker first saw a state: the range, the position of the batch
+ * in it and the slot it got. Sorting by these gives input order. */
+struct state_origin {
+    size_t range;
+    long pos;
+    int slot;
+    struct climate_info *info;          /* filled in when merging */
+};
 
-/* This function dynamically allocates the climate data */
-void analyze_file(FILE *file, struct climate_info **states, int num_states) {
-    const int line_sz = 100;                       
-    char line[line_sz]; 
-    
-    while (fgets(line, line_sz, file) != NULL) {           
-        
-        /* tokenize line and split it at every tab */
-        char* token = strtok(line, "\t");
+/* Open-addressing hash table handing out dense ids for short string keys
+ * (state codes, geohashes). Callers keep their values in arrays indexed by
+ * the id. */
+struct key_table {
+    size_t count;
+    size_t capacity;                /* number of buckets, a power of two */
+    int *buckets;                   /* id + 1, or 0 when empty */
+    char (*keys)[KEY_SZ];           /* key of each id */
+};
 
-        /* create array to store line data */
-        char* data[9];                                                                                        
-        int index = 0;
-        while (token != NULL) {
-            data[index] = token;
-            token = strtok(NULL, "\t");
-            index++;
-        }
+/* One observation kept for time weighting */
+struct observation {
+    long time;                      /* seconds */
+    float temperature;              /* Fahrenheit */
+    float humidity;
+};
 
-        int val = 0;
-        while (val < num_states && states[val] != NULL ){
-            if(strcmp(data[0],states[val]->code) == 0){
-                break;
-            }
-            val++;
-        }
+/* Observations of one location and, once finished, their weighted sums */
+struct location_series {
+    char code[3];
+    int in_order;                   /* arrived sorted, no sort needed */
+    size_t count;
+    size_t cap;
+    struct observation *obs;
+    double sum_of_weights;
+    double weighted_temperature;
+    double weighted_humidity;
+};
 
-        /* Initialize struct in memory */
-        if (states[val] == NULL) {
-            states[val] = (struct climate_info*) malloc (sizeof(struct climate_info));
-            strcpy((states[val])->code, data[0]);                      
-            (states[val])->num_records = 1;
-            (states[val])->max_temp = (atof(data[8]) * 1.8 - 459.67);                  
-            (states[val])->max_temp_time = atol(data[1]) / 1000;
-            (states[val])->min_temp = (atof(data[8]) * 1.8 - 459.67);
-            (states[val])->min_temp_time = atol(data[1]) / 1000;
-            (states[val])->num_lightning_strikes = atol(data[6]);     
-            (states[val])->num_snow = atol(data[4]);                  
-            (states[val])->sum_of_temperature = (atof(data[8]) * 1.8 - 459.67);        
-            (states[val])->sum_of_humidity = atof(data[3]);           
-            (states[val])->sum_of_cloud_cover = atof(data[5]);
-        } else {                                                            //else we update the struct
-            (states[val])->num_records +=1;                                       
-            if ((states[val])->max_temp < (atof(data[8]) * 1.8 - 459.67)){             
-                (states[val])->max_temp = (atof(data[8]) * 1.8 - 459.67);
-                (states[val])->max_temp_time = atol(data[1]) / 1000;        
-            }                                                       
-            if ((states[val])->min_temp > (atof(data[8]) * 1.8 - 459.67)) {
-                (states[val])->min_temp = (atof(data[8]) * 1.8 - 459.67);
-                (states[val])->min_temp_time = atol(data[1]) / 1000;
-            }
-            (states[val])->num_lightning_strikes += atol(data[6]);         
-            (states[val])->num_snow += atol(data[4]);                      
-            (states[val])->sum_of_temperature += (atof(data[8]) * 1.8 - 459.67);            
-            (states[val])->sum_of_humidity += atof(data[3]);               
-            (states[val])->sum_of_cloud_cover += atof(data[5]);
-        }
+/* Per-location series collected by --time-weighted */
+struct time_weights {
+    struct key_table cells;
+    struct location_series *series;
+    size_t series_cap;
+};
+
+/* Hours of each day in which a location reported, one bit per hour */
+struct presence {
+    char code[3];
+    long first_day;                 /* of hours[0], days since the epoch */
+    size_t num_days;
+    unsigned int *hours;
+};
+
+/* Presence bitsets of every location, collected by --gaps */
+struct coverage {
+    struct key_table cells;
+    struct presence *cells_presence;
+    size_t cap;
+};
+
+/* Station metadata of --stations, a table from geohash prefixes of one
+ * length to elevation and land use that the whole scan probes */
+struct station_table {
+    int precision;                  /* geohash characters of every key */
+    double lapse_rate;              /* Fahrenheit per meter */
+    size_t count;
+    size_t mask;                    /* number of buckets - 1 */
+    unsigned int *buckets;          /* station + 1, or 0 when empty */
+    char (*geohash)[13];
+    float *elevation;               /* meters */
+    int *landuse;                   /* id in classes */
+    struct key_table classes;
+};
+
+/* Records of one land-use class; the last one is for records without a
+ * station */
+struct landuse_acc {
+    unsigned long records;
+    double sum_elevation;
+    double sum_temperature;         /* Fahrenheit */
+    double sum_sea_level;           /* corrected by the lapse rate */
+};
+
+/* A piece of input one scan worker reads: a byte range of a file that is
+ * widened to whole lines, a line belonging to the range its first byte is
+ * in. end is -1 for "to the end of the file". */
+struct scan_range {
+    const char *path;
+    long begin;
+    long end;
+};
+
+/* An open input: a file, standard input or the output of a decompressor,
+ * read through a large page-aligned stdio buffer */
+struct input {
+    const char *path;
+    FILE *file;
+    void *buffer;
+    pid_t child;                    /* decompressor, or 0 */
+};
+
+/* Reads the lines of one scan_range */
+struct range_reader {
+    struct input input;
+    FILE *file;
+    size_t range;                   /* index in the plan, in input order */
+    long pos;
+    long end;
+    int at_line_start;
+};
+
+/* Ranges shared by the worker threads of a scan. Each worker takes the next
+ * range under the lock and calls scan with its own private state. */
+struct parallel_scan {
+    struct scan_range *ranges;
+    size_t num_ranges;
+    size_t next;
+    pthread_mutex_t lock;
+    int failed;
+    void (*scan)(void *state, struct range_reader *reader);
+};
+
+struct scan_worker {
+    pthread_t thread;
+    struct parallel_scan *scan;
+    void *state;
+};
+
+/* Small xorshift64* generator, one per thread */
+struct rng {
+    unsigned long long state;
+};
+
+/* Algorithm L reservoir: after it fills up, it computes how many lines to
+ * skip before the next replacement, so most lines cost a comparison */
+struct reservoir {
+    size_t size;                    /* lines held */
+    unsigned long long seen;        /* lines offered */
+    unsigned long long next;        /* index of the next line to take */
+    double w;
+    char **lines;
+};
+
+/* One reservoir per stratum (state), for one worker */
+struct sampler {
+    size_t n;
+    int by_state;
+    struct rng rng;
+    struct key_table strata;
+    struct reservoir *reservoirs;
+    size_t reservoirs_cap;
+};
+
+/* Latency histogram of one pipeline stage, in microseconds. buckets[i]
+ * counts samples up to LATENCY_BOUNDS[i]; the last bucket is +Inf. */
+struct stage_histogram {
+    unsigned long buckets[LATENCY_BUCKETS + 1];
+    unsigned long count;
+    unsigned long sum;
+};
+
+/* Counters of one ingesting thread. Only that thread writes them, with
+ * relaxed atomic stores, and the metrics thread reads every block when it
+ * is scraped, so neither side ever waits for the other. */
+struct ingest_metrics {
+    unsigned long rows;
+    unsigned long bytes;
+    unsigned long parse_errors;
+    unsigned long queue_depth;              /* bytes waiting, not yet parsed */
+    struct stage_histogram stages[NUM_STAGES];
+};
+
+/* The metrics endpoint and the counter blocks it reports */
+struct metrics_server {
+    const char *mode;
+    int listen_fd;
+    struct ingest_metrics **blocks;
+    int num_blocks;
+    long started;
+    pthread_t thread;
+};
+
+/* One input of `climate follow`: the offset read so far and the partial
+ * line at its end */
+struct follower {
+    const char *path;
+    int fd;
+    int is_pipe;                    /* ends at EOF instead of waiting */
+    int done;
+    long offset;
+    char pending[LINE_SZ];
+    size_t pending_len;
+};
+
+/* Write-ahead log of `climate follow --wal`: the lines ingested since the
+ * last checkpoint, each group of them with the input offsets it brings us
+ * to. Lines go to memory first and reach the log once per poll round. */
+struct wal {
+    const char *dir;
+    int fd;
+    long long seq;                  /* last record written */
+    long size;                      /* bytes in the log */
+    char *lines;                    /* lines not committed yet */
+    size_t lines_len;
+    size_t lines_cap;
+    int sync_every;                 /* fsync every N commits, 0 = never */
+    int unsynced;
+};
+
+/* Header of every log record. The payload is one offset per input, then
+ * the lines. */
+struct wal_header {
+    unsigned int magic;
+    unsigned int length;            /* payload bytes */
+    long long seq;
+    unsigned long long checksum;    /* of the payload */
+};
+
+/* Dense ids for geohashes, shared by all segments of a store and by the
+ * threads that load them. The lock is only taken for a geohash that the
+ * thread has not looked up before, see dict_cache. */
+struct geohash_dict {
+    pthread_mutex_t lock;
+    struct key_table ids;           /* geohash -> id, and id -> geohash */
+    size_t saved;                   /* ids already in DIR/DICTIONARY */
+};
+
+/* The ids one thread has already got from a geohash_dict */
+struct dict_cache {
+    struct geohash_dict *dict;
+    struct key_table seen;
+    unsigned int *ids;              /* seen id -> dictionary id */
+};
+
+/* Min and max of every numeric column over ZONE_ROWS rows of a sorted
+ * store, and the states at both ends */
+struct zone {
+    double min[NUM_COLUMNS];
+    double max[NUM_COLUMNS];
+    char first_code[3];
+    char last_code[3];
+};
+
+/* Complete records held in memory column by column. Once sorted by state,
+ * geohash and time, each state and each geohash is one run of rows. The
+ * Hilbert layout keeps only the geohash runs but puts nearby cells in
+ * nearby rows, so the zone maps of lat/lon become tight bounding boxes. */
+struct record_store {
+    size_t count;
+    size_t cap;
+    int layout;
+    char (*code)[3];
+    char (*geohash)[13];
+    unsigned int *cell;             /* dictionary id of the geohash */
+    double *columns[NUM_COLUMNS];
+    int sorted;
+    struct key_table state_index;   /* state -> rows [begin, end) */
+    size_t *state_begin;
+    size_t *state_end;
+    struct key_table cell_index;    /* geohash -> rows [begin, end) */
+    size_t *cell_begin;
+    size_t *cell_end;
+    struct zone *zones;             /* one per ZONE_ROWS rows once sorted */
+    size_t num_zones;
+};
+
+/* A row of a store as store_sort orders it. The sort key is copied out of
+ * the columns so the comparator needs nothing else: serve and the
+ * compaction thread sort stores at the same time. */
+struct sort_row {
+    unsigned long long key;         /* Hilbert index, or 0 */
+    char code[3];                   /* empty in the Hilbert layout */
+    char geohash[13];
+    double time;
+    size_t row;
+};
+
+/* An immutable, sorted segment of a store directory. Level 0 segments come
+ * straight from `climate ingest`; compaction merges DEFAULT_FANOUT (or
+ * --fanout) segments of a level into one of the next. */
+struct segment {
+    long id;
+    int level;
+    unsigned long bytes;
+    int refs;                       /* views holding it */
+    struct record_store store;
+};
+
+/* The segments one query sees. Compaction publishes a new view rather than
+ * changing one that may be in use. */
+struct store_view {
+    int refs;
+    int num_segments;
+    struct segment **segments;
+    struct record_store **stores;
+};
+
+/* The segments of a store directory and the view queries start from */
+struct segment_set {
+    const char *dir;                /* NULL when serving plain files */
+    int fanout;
+    pthread_mutex_t lock;           /* guards current and all refs */
+    struct store_view *current;
+    struct geohash_dict dict;       /* only changed under the directory lock */
+};
+
+struct manifest_entry {
+    long id;
+    int level;
+    unsigned long rows;
+    unsigned long bytes;
+};
+
+/* The MANIFEST of a store directory, replaced atomically on every change */
+struct manifest {
+    long next_id;
+    int layout;
+    unsigned long bytes_ingested;   /* level 0 segments */
+    unsigned long bytes_written;    /* all segments, compactions included */
+    int num_entries;
+    struct manifest_entry *entries;
+};
+
+/* Scan state of the loaders that fill a store from TDV files */
+struct store_loader {
+    struct record_store store;
+    struct dict_cache cache;
+    struct ingest_metrics *metrics;
+};
+
+struct predicate {
+    int column;
+    int op;
+    double value;
+    char text[KEY_SZ];
+};
+
+struct aggregate {
+    int fn;
+    int column;
+};
+
+/* lag/lead(column, offset) or delta(column, span) */
+struct window_fn {
+    int fn;
+    int column;
+    long offset;                    /* readings back or ahead */
+    long span;                      /* delta: seconds back, 0 = previous reading */
+    char text[32];                  /* as written, for headers */
+};
+
+/* A parsed query. With list set, matching records are printed instead of
+ * being aggregated. */
+struct query {
+    int list;
+    long limit;
+    int num_select;
+    struct aggregate select[MAX_AGGREGATES];
+    int num_where;
+    struct predicate where[MAX_PREDICATES];
+    int num_windows;
+    struct window_fn windows[MAX_WINDOWS];
+    int group_by;
+    int precision;                  /* geohash characters of a cell */
+};
+
+/* Running aggregates of one group */
+struct group_acc {
+    unsigned long count;
+    unsigned long counts[MAX_AGGREGATES];  /* rows with a value */
+    double values[MAX_AGGREGATES];
+};
+
+/* A query compiled by compile_query. Scans rows [begin, end) of a store
+ * and adds the matching ones to acc when the query has no group by, or
+ * lists them in matches otherwise. Returns the number of matches. */
+typedef size_t (*query_kernel)(size_t begin, size_t end, double *const *columns,
+        char (*code)[3], char (*geohash)[13], size_t *matches,
+        struct group_acc *acc);
+
+/* Compiled queries loaded by this process, NULL kernel if compiling failed
+ * or still going on */
+struct loaded_kernel {
+    unsigned long long hash;
+    query_kernel kernel;
+    pid_t child;                    /* the compiler, or 0 */
+    char path[PATH_MAX];            /* the shared object */
+    char source[PATH_MAX + 32];     /* its C file while it builds */
+    char object[PATH_MAX + 32];     /* where it builds */
+    struct loaded_kernel *next;
+};
+
+/* A query being executed over one or more stores, a chunk at a time */
+struct query_run {
+    const struct query *query;
+    struct record_store **stores;
+    int num_stores;
+    int store;                      /* store being scanned */
+    size_t next_row;
+    size_t end_row;
+    struct key_table groups;
+    struct group_acc *accs;
+    size_t accs_cap;
+    int *cell_groups;               /* group by cell: dictionary id -> group + 1 */
+    size_t cell_groups_cap;
+    unsigned long rows_scanned;
+    unsigned long rows_skipped;     /* ruled out by zone maps */
+    unsigned long zones_read;
+    unsigned long zones_skipped;
+    long last_zone;                 /* last zone counted in zones_read */
+    unsigned long rows_matched;
+    FILE *list_out;                 /* where list queries print rows */
+    size_t part_begin;              /* rows of the geohash being scanned */
+    size_t part_end;
+    size_t window_first[MAX_WINDOWS];   /* delta: earliest row in its span */
+    double window_values[MAX_WINDOWS];  /* at the current row, NAN if none */
+    struct record_store *merged;    /* segments merged for window functions */
+    query_kernel kernel;            /* compiled scan loop, NULL to interpret */
+    size_t *matches;                /* rows the kernel found in a chunk */
+    size_t matches_cap;
+    struct operator_stats *explain; /* NUM_QUERY_OPERATORS, or NULL */
+    double *window_rows;            /* explain: window values of each row */
+};
+
+/* Log-linear latency histogram in microseconds, in the style of HDR
+ * histograms: 2^HDR_SUB_BITS linear sub-buckets per power of two keep
+ * every value within about 3% */
+struct hdr_histogram {
+    unsigned long counts[HDR_MAGNITUDES][1 << HDR_SUB_BITS];
+    unsigned long total;
+    long max;
+};
+
+/* Checked by a running task at every chunk boundary */
+struct cancel_token {
+    int cancelled;
+    const char *reason;
+};
+
+/* One command waiting for or in execution */
+struct task {
+    long id;
+    int kind;
+    int priority;                   /* 0 runs before 1 */
+    long deadline;                  /* trace_now() microseconds, 0 = none */
+    long submitted;
+    int client;
+    long connection;                /* of the client, in case the slot is reused */
+    struct cancel_token token;
+    char arg[KEY_SZ];
+    struct query query;
+    struct query_run run;
+    struct store_view *view;
+    int started;
+    FILE *out;
+    char *output;
+    size_t output_sz;
+    struct task *next;
+};
+
+struct client {
+    int fd;                         /* -1 when the slot is free */
+    long connection;                /* changes every time the slot is reused */
+    char in[LINE_SZ * 4];
+    size_t in_len;
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+};
+
+struct server {
+    struct segment_set set;
+    int listen_fd;
+    struct client *clients;
+    int num_clients;
+    struct task *tasks;
+    long next_id;
+    long next_connection;
+    unsigned long cancelled;
+    struct hdr_histogram latency[2];    /* short and long tasks */
+    struct ingest_metrics metrics;
+    const char *compile_dir;        /* --compile cache, or NULL */
+};
+
+/* One output file of `climate partition` */
+struct partition {
+    char key[KEY_SZ];
+    int fd;                         /* the file, or the pipe into gzip */
+    pid_t child;                    /* gzip, or 0 */
+    char *buffer;
+    size_t len;
+    unsigned long lines;
+    unsigned long bytes;
+    int writer;
+};
+
+/* A full buffer on its way to a partition file */
+struct write_job {
+    int fd;
+    char *data;
+    size_t len;
+    struct write_job *next;
+};
+
+/* A thread doing the writes of the partitions i with i % writers == its
+ * index, in the order their buffers filled up */
+struct partition_writer {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct write_job *head;
+    struct write_job *tail;
+    struct write_job *spare;        /* written buffers, for reuse */
+    int queued;
+    int closing;
+    int failed;
+};
+
+/* Candidates for the extreme of a trailing time window, oldest first, in
+ * a ring. Each value is dominated by none after it: along the deque the
+ * values fall for a max and rise for a min, so the front is the extreme
+ * and every reading goes in and out once. */
+struct extreme_deque {
+    int is_max;
+    long *times;
+    double *values;
+    size_t cap;                     /* a power of two */
+    size_t head;
+    size_t len;
+};
+
+/* What `climate join` keeps of a line of either input */
+struct join_row {
+    char code[3];
+    char geohash[13];
+    long time;                      /* seconds */
+    double values[2];               /* temperature (F) and humidity */
+    int has;                        /* bit v: values[v] was given */
+};
+
+/* Forecast errors of one state or cell; index 0 is temperature, 1 humidity */
+struct join_errors {
+    char code[3];
+    unsigned long pairs;
+    unsigned long n[2];
+    double sum[2];                  /* of forecast - observed */
+    double sum_abs[2];
+    double sum_sq[2];
+};
+
+struct join_context {
+    struct key_table states;
+    struct join_errors *state_errors;
+    size_t states_cap;
+    struct key_table cells;         /* only with --cells */
+    struct join_errors *cell_errors;
+    size_t cells_cap;
+    int by_cell;
+    int precision;
+    unsigned long observations;
+    unsigned long forecasts;
+    unsigned long pairs;
+    unsigned long duplicates;       /* forecasts for a key already seen */
+};
+
+/* Block maxima and minima of temperature in one cell, one slot per year
+ * or month from first_block on; NAN where the cell had no reading */
+struct cell_blocks {
+    char code[3];
+    long first_block;
+    size_t num_blocks;
+    float *highs;
+    float *lows;
+};
+
+/* What one worker of `climate extremes` collects */
+struct block_scan {
+    int precision;
+    int by_month;
+    struct key_table cells;
+    struct cell_blocks *blocks;
+    size_t cap;
+};
+
+/* A Gumbel or GEV distribution fitted to block extremes */
+struct extreme_fit {
+    int n;                          /* blocks; 0 when too few to fit */
+    double location;
+    double scale;
+    double shape;                   /* 0 for Gumbel */
+    double levels[3];               /* 10, 50 and 100 year return levels */
+};
+
+/* Fits the cells index, index + num_workers, ... of a block_scan */
+struct fit_worker {
+    pthread_t thread;
+    const struct block_scan *scan;
+    struct extreme_fit *highs;
+    struct extreme_fit *lows;
+    int gumbel;
+    int min_blocks;
+    int index;
+    int num_workers;
+};
+
+/* One line of `climate replay`: its event time and where it is in the
+ * text read */
+struct replay_row {
+    long time;                      /* milliseconds */
+    size_t offset;
+    size_t length;                  /* including the newline */
+};
+
+/* Scrapes the rows ingested by the follow reading the replay, to time how
+ * long each written row took to be ingested */
+struct lag_watch {
+    pthread_t thread;
+    const char *address;
+    const long *written_at;         /* when each row was written */
+    unsigned long written;          /* rows written so far, atomic */
+    int done;                       /* every row written, atomic */
+    unsigned long total;
+    unsigned long baseline;         /* rows ingested before the replay */
+    unsigned long ingested;
+    int failed;
+    struct hdr_histogram lag;
+};
+
+/* A command sent by `climate loadgen` and not answered yet */
+struct load_request {
+    long id;                        /* -1 until ACCEPTED */
+    int kind;
+    long start;                     /* when it was sent, or due */
+};
+
+/* One connection of `climate loadgen` to the server */
+struct load_connection {
+    int fd;
+    char *in;
+    size_t in_len;
+    size_t in_cap;
+    struct load_request *pending;   /* in the order they were sent */
+    int num_pending;
+    int pending_cap;
+};
+
+/* What `climate loadgen` sends: the weights of the kinds and the keys and
+ * queries to pick from */
+struct load_plan {
+    double weights[NUM_LOAD_KINDS];
+    struct key_table states;
+    struct key_table geohashes;
+    char **queries;                 /* whole lines, or NULL for QUERY_TEMPLATES */
+    size_t num_queries;
+    struct rng rng;
+};
+
+/* Latencies of one number of connections, per kind and in total */
+struct load_result {
+    struct hdr_histogram latency[NUM_LOAD_KINDS + 1];
+    unsigned long errors[NUM_LOAD_KINDS + 1];
+    unsigned long unanswered;
+    long elapsed;
+};
+
+/* Partial aggregate of one cell and time bucket. Workers of `climate
+ * shuffle` send these, as they are, to the worker owning the key. */
+struct shuffle_partial {
+    char geohash[13];
+    char code[3];
+    long bucket;                    /* start, in seconds */
+    unsigned long records;
+    unsigned long humidity_records;
+    unsigned long lightning;
+    double sum_temp;                /* Fahrenheit */
+    double min_temp;
+    double max_temp;
+    double sum_humidity;
+};
+
+/* Partials by cell and bucket; slots hold index + 1, or 0 */
+struct shuffle_table {
+    int precision;
+    long bucket;                    /* seconds */
+    unsigned long rows;             /* records scanned into it */
+    struct shuffle_partial *partials;
+    size_t count;
+    size_t cap;
+    size_t *slots;
+    size_t mask;
+};
+
+/* An incoming connection of a shuffle worker, with the start of a partial
+ * whose rest has not arrived yet */
+struct shuffle_peer {
+    int fd;
+    char pending[sizeof(struct shuffle_partial)];
+    size_t pending_len;
+};
+
+/* What a shuffle worker reports back to the coordinator through a pipe */
+struct shuffle_stats {
+    int worker;
+    int failed;
+    unsigned long rows;
+    unsigned long local_keys;       /* keys after its own scan */
+    unsigned long sent;             /* partials sent to the other workers */
+    unsigned long received;
+    unsigned long owned_keys;
+    long scan_micros;
+    long exchange_micros;
+    long finalize_micros;
+};
+
+/* Running aggregate of one key inside one event-time window */
+struct window_agg {
+    unsigned long num_records;
+    double sum_of_temperature;
+    double max_temp;
+    double min_temp;
+    double sum_of_humidity;
+    unsigned long num_lightning_strikes;
+};
+
+/* All aggregates of windows starting at the same time */
+struct window_pane {
+    long start;
+    struct key_table keys;
+    struct window_agg *aggs;
+    size_t aggs_cap;
+    struct window_pane *next;
+};
+
+struct window_stream {
+    long size;                      /* window length, seconds */
+    long slide;                     /* distance between window starts */
+    long lateness;                  /* how far the watermark trails */
+    int by_cell;                    /* key on geohash prefix, not state */
+    int precision;                  /* geohash prefix length */
+    long max_event_time;
+    long watermark;
+    struct window_pane *panes;      /* open panes, sorted by start */
+    size_t open_panes;
+    size_t max_open_panes;
+    unsigned long num_records;
+    unsigned long num_late;
+    unsigned long num_windows;
+    FILE *out;
+};
+
+void analyze_batch(struct record_batch *batch, struct climate_info **states, int num_states);
+void print_report(struct climate_info *states[], int num_states,
+        const struct time_weights *weights);
+void print_state(FILE *out, struct climate_info *info, const struct time_weights *weights);
+
+void tokenize_batch(struct record_batch *batch);
+void parse_batch(struct record_batch *batch);
+
+void profile_batch(struct profile *profile, const struct record_batch *batch);
+void print_profile(const struct profile *profile);
+int fingerprint_set_add(struct fingerprint_set *set, unsigned long long fingerprint);
+
+void time_weights_batch(struct time_weights *weights, const struct record_batch *batch);
+void presence_mark(struct presence *presence, long day, unsigned int bits);
+struct presence *coverage_cell(struct coverage *coverage, const char *geohash,
+        const char *code);
+void coverage_batch(struct coverage *coverage, const struct record_batch *batch);
+void merge_coverage(struct coverage *into, struct coverage *from);
+int print_coverage(const struct coverage *coverage, long gap, const char *outages);
+unsigned long station_hash(const char *geohash, int precision);
+int load_stations(const char *path, struct station_table *stations);
+void stations_batch(const struct station_table *stations, struct landuse_acc *landuse,
+        const struct record_batch *batch);
+void print_landuse(const struct station_table *stations, const struct landuse_acc *landuse);
+void time_weights_finish(struct time_weights *weights);
+int time_weighted_means(const struct time_weights *weights, const char *code,
+        double *temperature, double *humidity);
+
+void *xrealloc(void *ptr, size_t size);
+int input_is_stream(const char *path);
+int open_input(struct input *input, const char *path);
+int close_input(struct input *input);
+int split_fields(char *line, char *data[], int max);
+long parse_duration(const char *text);
+
+void key_table_init(struct key_table *table);
+int key_table_lookup(const struct key_table *table, const char *key);
+int key_table_intern(struct key_table *table, const char *key);
+void key_table_free(struct key_table *table);
+
+double math_log(double x);
+double math_exp(double x);
+double math_sqrt(double x);
+
+void rng_seed(struct rng *rng, unsigned long long seed);
+unsigned long long rng_next(struct rng *rng);
+double rng_uniform(struct rng *rng);
+
+int online_cpus(void);
+int plan_ranges(struct parallel_scan *scan, char *paths[], int num_paths, int num_threads);
+int run_parallel_scan(struct parallel_scan *scan, void **states, int num_threads);
+char *range_gets(char *line, int size, struct range_reader *reader);
+
+int sample_main(int argc, char *argv[]);
+
+void scan_context_init(struct scan_context *ctx, int use_profile, int use_weights,
+        int use_coverage, int tid);
+void analyze_range(void *state, struct range_reader *reader);
+int read_lines(struct range_reader *reader, struct record_batch *batch);
+void merge_scan_context(struct scan_context *into, struct scan_context *from);
+int compare_origins(const void *a, const void *b);
+void merge_states_in_order(struct scan_context *contexts, int num_threads);
+
+void trace_init(struct trace_buffer *trace, int tid);
+long trace_now(void);
+void trace_record(struct trace_buffer *trace, const char *name, long begin, long chunk);
+long explain_batch(struct operator_stats *stats, long begin, unsigned long rows_in,
+        unsigned long rows_out, unsigned long bytes);
+void print_operator(const char *name, int depth, const char *thread,
+        const struct operator_stats *stats);
+void print_scan_explain(struct scan_context *contexts, int num_threads);
+void write_trace(FILE *file, struct trace_buffer **buffers, int num_buffers);
+
+void write_snapshot(FILE *file, struct climate_info *states[], int num_states);
+int read_snapshot(FILE *file, struct climate_info *states[], int num_states);
+int diff_main(int argc, char *argv[]);
+
+int open_listener(const char *address);
+int open_connection(const char *address);
+void metrics_add(unsigned long *counter, unsigned long amount);
+void metrics_set(unsigned long *gauge, unsigned long value);
+void metrics_observe(struct stage_histogram *histogram, long micros);
+int start_metrics_server(struct metrics_server *server, const char *address,
+        const char *mode, struct ingest_metrics **blocks, int num_blocks);
+void process_batch(struct record_batch *batch, struct climate_info **states,
+        struct ingest_metrics *metrics);
+void ingest_batch(struct record_batch *batch, struct climate_info **states,
+        struct ingest_metrics *metrics, struct wal *wal);
+int wal_open(struct wal *wal, struct follower *followers, int num_followers,
+        struct climate_info **states, struct record_batch *batch,
+        struct ingest_metrics *metrics);
+int wal_commit(struct wal *wal, const struct follower *followers, int num_followers);
+int wal_checkpoint(struct wal *wal, const struct follower *followers, int num_followers,
+        struct climate_info **states);
+int follow_main(int argc, char *argv[]);
+
+void dict_init(struct geohash_dict *dict);
+unsigned int dict_intern(struct geohash_dict *dict, const char *geohash);
+void dict_cache_init(struct dict_cache *cache, struct geohash_dict *dict);
+unsigned int dict_cache_id(struct dict_cache *cache, const char *geohash);
+void dict_cache_free(struct dict_cache *cache);
+int dict_load(const char *dir, struct geohash_dict *dict);
+int dict_save(const char *dir, struct geohash_dict *dict);
+
+void store_init(struct record_store *store);
+void store_append_batch(struct record_store *store, const struct record_batch *batch,
+        struct dict_cache *cache);
+void store_sort(struct record_store *store);
+void store_build_zones(struct record_store *store);
+void store_free(struct record_store *store);
+void store_append_store(struct record_store *store, const struct record_store *from);
+int zone_excludes(const struct query *query, const struct zone *zone, int layout);
+void geohash_decode(const char *geohash, double *lat, double *lon);
+void geohash_encode(double lat, double lon, int precision, char *geohash);
+unsigned long long hilbert_index(unsigned int x, unsigned int y, int order);
+int parse_query(const char *text, struct query *query, char *error, size_t error_sz);
+void query_run_init(struct query_run *run, const struct query *query,
+        struct record_store **stores, int num_stores, FILE *list_out);
+int query_run_step(struct query_run *run, size_t max_rows);
+void query_run_output(struct query_run *run, FILE *out);
+void query_run_free(struct query_run *run);
+void group_acc_init(const struct query *query, struct group_acc *acc);
+size_t query_run_compiled(struct query_run *run, const struct record_store *store,
+        size_t begin, size_t end);
+char *kernel_source(const struct query *query);
+const char *start_kernel_build(struct loaded_kernel *entry, const char *source);
+void finish_kernel_build(struct loaded_kernel *entry, int wait);
+void load_kernel(struct loaded_kernel *entry);
+query_kernel compile_query(const struct query *query, const char *dir, int wait);
+int predicate_matches(const struct predicate *pred, const struct record_store *store,
+        size_t row, const double *windows);
+size_t query_run_explained(struct query_run *run, const struct record_store *store,
+        size_t begin, size_t end);
+void print_query_explain(const struct query_run *run);
+unsigned long query_row_bytes(const struct query *query);
+void hdr_record(struct hdr_histogram *histogram, long micros);
+long hdr_percentile(const struct hdr_histogram *histogram, double percent);
+int serve_main(int argc, char *argv[]);
+
+int write_segment(const char *path, const struct record_store *store, unsigned long *bytes);
+int read_segment(const char *path, struct record_store *store,
+        const struct geohash_dict *dict);
+int read_manifest(const char *dir, struct manifest *manifest);
+int write_manifest(const char *dir, const struct manifest *manifest);
+int lock_store(const char *dir);
+struct store_view *acquire_view(struct segment_set *set);
+void release_view(struct segment_set *set, struct store_view *view);
+int refresh_view(struct segment_set *set, struct segment *fresh);
+int compact_store(struct segment_set *set);
+void *compaction_thread(void *arg);
+void load_range(void *state, struct range_reader *reader);
+int ingest_main(int argc, char *argv[]);
+int query_main(int argc, char *argv[]);
+int compact_main(int argc, char *argv[]);
+int generate_main(int argc, char *argv[]);
+int partition_main(int argc, char *argv[]);
+int rolling_main(int argc, char *argv[]);
+void deque_push(struct extreme_deque *deque, long time, double value);
+void deque_expire(struct extreme_deque *deque, long cutoff);
+int join_main(int argc, char *argv[]);
+int read_join_row(struct input *input, struct join_row *row, unsigned long *count);
+int join_compare(const struct join_row *a, const struct join_row *b);
+struct join_errors *join_errors_of(struct key_table *table, struct join_errors **errors,
+        size_t *cap, const char *key, const char *code);
+void join_pair(struct join_context *ctx, const struct join_row *observed,
+        const struct join_row *forecast);
+int merge_join(struct join_context *ctx, struct input *observed, struct input *forecast,
+        char *paths[]);
+int hash_join(struct join_context *ctx, struct input *observed, struct input *forecast,
+        int num_partitions);
+void print_join_errors(FILE *out, const struct join_errors *errors, int as_tdv);
+int extremes_main(int argc, char *argv[]);
+void block_range(void *state, struct range_reader *reader);
+void block_add(struct cell_blocks *cell, long block, float high, float low);
+void merge_block_scan(struct block_scan *into, struct block_scan *from);
+double math_gamma(double x);
+int compare_doubles(const void *a, const void *b);
+void fit_extremes(double *values, int n, int gumbel, int blocks_per_year,
+        struct extreme_fit *fit);
+void *fit_thread(void *arg);
+int replay_main(int argc, char *argv[]);
+int compare_replay_rows(const void *a, const void *b);
+long replay_due(const struct replay_row *rows, size_t row, double rate, double speedup);
+long scrape_ingested(const char *address);
+void *lag_thread(void *arg);
+int loadgen_main(int argc, char *argv[]);
+int load_send(struct load_connection *conn, struct load_plan *plan, long start);
+int load_receive(struct load_connection *conn, struct load_result *result);
+int run_load_level(struct load_plan *plan, struct load_connection *conns, int num_conns,
+        double rate, long duration, struct load_result *result);
+void print_load_level(const struct load_result *result, int num_conns, double rate);
+int shuffle_main(int argc, char *argv[]);
+void shuffle_table_init(struct shuffle_table *table, int precision, long bucket);
+void shuffle_table_free(struct shuffle_table *table);
+unsigned long shuffle_hash(const char *geohash, long bucket);
+int shuffle_owner(unsigned long hash, int num_workers);
+struct shuffle_partial *shuffle_find(struct shuffle_table *table, const char *geohash,
+        const char *code, long bucket);
+void shuffle_merge(struct shuffle_table *table, const struct shuffle_partial *from);
+void shuffle_range(void *state, struct range_reader *reader);
+int compare_partials(const void *a, const void *b);
+int shuffle_exchange(struct shuffle_table *local, struct shuffle_table *owned, int self,
+        int num_workers, int listen_fd, char **addresses, struct shuffle_stats *stats);
+int shuffle_worker(const struct parallel_scan *plan, int self, int num_workers,
+        int listen_fd, char **addresses, const char *dir, int precision, long bucket,
+        struct shuffle_stats *stats);
+
+int window_main(int argc, char *argv[]);
+void window_add(struct window_stream *stream, const char *key, long time,
+        double temperature, double humidity, long lightning);
+void window_advance(struct window_stream *stream, long watermark);
+
+int main(int argc, char *argv[]) {
+
+    /* Subcommands take over the whole command line */
+    if (argc >= 2 && strcmp(argv[1], "window") == 0) {
+        return window_main(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "sample") == 0) {
+        return sample_main(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "diff") == 0) {
+        return diff_main(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "follow") == 0) {
+        return follow_main(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "serve") == 0) {
+        return serve_main(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "ingest") == 0) {
+        return ingest_main(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "query") == 0) {
+        return query_main(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "compact") == 0) {
+        return compact_main(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "generate") == 0) {
+        return generate_main(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "partition") == 0) {
+        return partition_main(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "rolling") == 0) {
+        return rolling_main(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "join") == 0) {
+        return join_main(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "extremes") == 0) {
+        return extremes_main(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "replay") == 0) {
+        return replay_main(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "loadgen") == 0) {
+        return loadgen_main(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "shuffle") == 0) {
+        return shuffle_main(argc - 1, argv + 1);
     }
-}    
 
-/* This function prints out the climate data */     
-void print_report(struct climate_info *states[], int num_states) {
-    printf("Welcome. This program erforms analysis on climate data provided by the National Oceanic and Atmospheric Administration (NOAA).\n");
-    
-    printf("States found: ");
-    int i;
-    for (i = 0; i < num_states; ++i) {
-        if (states[i] != NULL) {
-            struct climate_info *info = states[i];
-            printf("%s ", info->code);
+    /* Options come before the file names */
+    int use_profile = 0;
+    int use_weights = 0;
+    int use_explain = 0;
+    const char *snapshot = NULL;
+    const char *trace_path = NULL;
+    const char *outages = NULL;
+    const char *stations_path = NULL;
+    double lapse_rate = 6.5;
+    long gap = 0;
+    int num_threads = 1;
+    int i, t;
+    for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; ++i) {
+        if (strcmp(argv[i], "--profile") == 0) {
+            use_profile = 1;
+        } else if (strcmp(argv[i], "--time-weighted") == 0) {
+            use_weights = 1;
+        } else if (strcmp(argv[i], "--explain-analyze") == 0) {
+            use_explain = 1;
+        } else if (strcmp(argv[i], "--gaps") == 0 && i + 1 < argc
+                && parse_duration(argv[i + 1]) > 0) {
+            gap = parse_duration(argv[++i]);
+        } else if (strcmp(argv[i], "--outages") == 0 && i + 1 < argc) {
+            outages = argv[++i];
+        } else if (strcmp(argv[i], "--stations") == 0 && i + 1 < argc) {
+            stations_path = argv[++i];
+        } else if (strcmp(argv[i], "--lapse-rate") == 0 && i + 1 < argc) {
+            lapse_rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            snapshot = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            num_threads = atoi(argv[++i]);
+        } else {
+            i = argc;
         }
     }
-    printf("\n");
 
-    /* Print out the summary for each state */
-    for (int i = 0; i < num_states; i++) {
-        struct climate_info *info = states[i];
+    /* Checking if commands are less than 1 file */
+    if (i >= argc) {
+        printf("Usage: %s [--profile] [--time-weighted] [--gaps DURATION [--outages FILE]] [--stations FILE [--lapse-rate 6.5]] [--snapshot FILE] [--trace FILE] [--explain-analyze] [-j threads] tdv_file1 tdv_file2 ... tdv_fileN \n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* Each worker thread gets its own array to store state data in, plus
+     * whatever else the options ask for. As we know, there are 50 US
+     * states. */
+    struct scan_context *contexts = xrealloc(NULL, num_threads * sizeof(struct scan_context));
+    void **worker_states = xrealloc(NULL, num_threads * sizeof(void *));
+    struct trace_buffer main_trace;
+    if (trace_path != NULL) {
+        trace_init(&main_trace, 0);
+    }
+    struct station_table stations;
+    if (stations_path != NULL) {
+        stations.lapse_rate = lapse_rate * 1.8 / 1000;
+        if (!load_stations(stations_path, &stations)) {
+            return EXIT_FAILURE;
+        }
+    }
+    for (t = 0; t < num_threads; ++t) {
+        scan_context_init(&contexts[t], use_profile, use_weights, gap > 0,
+                trace_path != NULL ? t + 1 : -1);
+        if (stations_path != NULL) {
+            size_t size = (stations.classes.count + 1) * sizeof(struct landuse_acc);
+            contexts[t].stations = &stations;
+            contexts[t].landuse = xrealloc(NULL, size);
+            memset(contexts[t].landuse, 0, size);
+        }
+        if (use_explain) {
+            contexts[t].explain = xrealloc(NULL, NUM_SCAN_OPERATORS * sizeof(struct operator_stats));
+            memset(contexts[t].explain, 0, NUM_SCAN_OPERATORS * sizeof(struct operator_stats));
+        }
+        worker_states[t] = &contexts[t];
+    }
+
+    struct parallel_scan scan;
+    if (!plan_ranges(&scan, argv + i, argc - i, num_threads)) {
+        printf("File does not exist. Moving on to next file...");
+        return EXIT_FAILURE;
+    }
+    scan.scan = analyze_range;
+    if (!run_parallel_scan(&scan, worker_states, num_threads)) {
+        return EXIT_FAILURE;
+    }
+
+    /* Fold the other workers into the first one */
+    long merge_begin = trace_path != NULL ? trace_now() : 0;
+    struct scan_context *ctx = &contexts[0];
+    merge_states_in_order(contexts, num_threads);
+    for (t = 1; t < num_threads; ++t) {
+        merge_scan_context(ctx, &contexts[t]);
+    }
+    
+    /* Now that we have recorded data for each file, we'll summarize them: */
+    if (ctx->weights != NULL) {
+        time_weights_finish(ctx->weights);
+    }
+    if (trace_path != NULL) {
+        trace_record(&main_trace, "merge", merge_begin, 0);
+    }
+    print_report(ctx->states, NUM_STATES, ctx->weights);
+    if (ctx->profile != NULL) {
+        print_profile(ctx->profile);
+    }
+    if (ctx->coverage != NULL && !print_coverage(ctx->coverage, gap, outages)) {
+        return EXIT_FAILURE;
+    }
+    if (ctx->stations != NULL) {
+        print_landuse(ctx->stations, ctx->landuse);
+    }
+    if (use_explain) {
+        print_scan_explain(contexts, num_threads);
+    }
+
+    if (snapshot != NULL) {
+        FILE *file = fopen(snapshot, "w");
+        if (file == NULL) {
+            printf("Could not write snapshot %s\n", snapshot);
+            return EXIT_FAILURE;
+        }
+        write_snapshot(file, ctx->states, NUM_STATES);
+        fclose(file);
+    }
+
+    if (trace_path != NULL) {
+        FILE *file = fopen(trace_path, "w");
+        if (file == NULL) {
+            printf("Could not write trace %s\n", trace_path);
+            return EXIT_FAILURE;
+        }
+        struct trace_buffer **buffers = xrealloc(NULL, (num_threads + 1) * sizeof(struct trace_buffer *));
+        buffers[0] = &main_trace;
+        for (t = 0; t < num_threads; ++t) {
+            buffers[t + 1] = contexts[t].trace;
+        }
+        write_trace(file, buffers, num_threads + 1);
+        fclose(file);
+        free(buffers);
+    }
+
+    return 0;
+}
+
+/* Sets up the private state of one scan worker. tid is the trace thread id,
+ * or -1 when not tracing. */
+void scan_context_init(struct scan_context *ctx, int use_profile, int use_weights,
+        int use_coverage, int tid) {
+    memset(ctx, 0, sizeof *ctx);
+    ctx->states = xrealloc(NULL, NUM_STATES * sizeof(struct climate_info *));
+    memset(ctx->states, 0, NUM_STATES * sizeof(struct climate_info *));
+    ctx->num_states = NUM_STATES;
+    ctx->origins = xrealloc(NULL, NUM_STATES * sizeof(struct state_origin));
+    ctx->batch = xrealloc(NULL, sizeof(struct record_batch));
+    if (use_profile) {
+        ctx->profile = xrealloc(NULL, sizeof(struct profile));
+        memset(ctx->profile, 0, sizeof(struct profile));
+    }
+    if (use_weights) {
+        ctx->weights = xrealloc(NULL, sizeof(struct time_weights));
+        memset(ctx->weights, 0, sizeof(struct time_weights));
+        key_table_init(&ctx->weights->cells);
+    }
+    if (use_coverage) {
+        ctx->coverage = xrealloc(NULL, sizeof(struct coverage));
+        memset(ctx->coverage, 0, sizeof(struct coverage));
+        key_table_init(&ctx->coverage->cells);
+    }
+    if (tid >= 0) {
+        ctx->trace = xrealloc(NULL, sizeof(struct trace_buffer));
+        trace_init(ctx->trace, tid);
+    }
+}
+
+/* This function dynamically allocates the climate data. It is the scan
+ * callback of the report, run once per input range. */
+void analyze_range(void *state, struct range_reader *reader) {
+    struct scan_context *ctx = state;
+    struct record_batch *batch = ctx->batch;
+    struct operator_stats *explain = ctx->explain;
+    const char *read_stage = reader->input.child > 0 ? "inflate" : "read";
+    int i;
+
+    /* Bytes of the batch each operator reads per row, for --explain-analyze:
+     * the missing mask plus the columns it looks at */
+    const unsigned long value_bytes = sizeof batch->humidity[0];
+    const unsigned long key_bytes = sizeof batch->missing[0] + sizeof batch->code[0]
+        + sizeof batch->timestamp[0] + sizeof batch->geohash[0];
+    const unsigned long profile_bytes = key_bytes + 6 * value_bytes;   /* every column */
+    const unsigned long weights_bytes = key_bytes + 2 * value_bytes;   /* temp, humidity */
+    const unsigned long coverage_bytes = key_bytes;
+    const unsigned long stations_bytes = sizeof batch->missing[0]     /* geohash, temp */
+        + sizeof batch->geohash[0] + value_bytes;
+
+    /* The aggregate skips the geohash and pressure */
+    const unsigned long aggregate_bytes = key_bytes - sizeof batch->geohash[0]
+        + 5 * value_bytes;
+
+    for (;;) {
+        long begin = ctx->trace != NULL ? trace_now() : 0;
+        long mark = explain != NULL ? trace_now() : 0;
+        long pos = reader->pos;
+        if (read_lines(reader, batch) == 0) {
+            break;
+        }
+        ctx->num_batches++;
+
+        /* Lines are bytes read; parsed rows are what the record_batch holds
+         * of them */
+        unsigned long rows = batch->count, bytes = reader->pos - pos;
+        if (explain != NULL) {
+            mark = explain_batch(&explain[SCAN_READ], mark, rows, rows, bytes);
+        }
+        if (ctx->trace != NULL) {
+            trace_record(ctx->trace, read_stage, begin, ctx->num_batches);
+            begin = trace_now();
+        }
+        tokenize_batch(batch);
+        if (explain != NULL) {
+            mark = explain_batch(&explain[SCAN_TOKENIZE], mark, rows, rows, bytes);
+        }
+        if (ctx->trace != NULL) {
+            trace_record(ctx->trace, "tokenize", begin, ctx->num_batches);
+            begin = trace_now();
+        }
+        parse_batch(batch);
+        if (explain != NULL) {
+            mark = explain_batch(&explain[SCAN_PARSE], mark, rows, rows, bytes);
+        }
+        if (ctx->trace != NULL) {
+            trace_record(ctx->trace, "parse", begin, ctx->num_batches);
+            begin = trace_now();
+        }
+
+        if (ctx->profile != NULL) {
+            profile_batch(ctx->profile, batch);
+            if (explain != NULL) {
+                mark = explain_batch(&explain[SCAN_PROFILE], mark, rows, rows, rows * profile_bytes);
+            }
+        }
+        if (ctx->weights != NULL) {
+            time_weights_batch(ctx->weights, batch);
+            if (explain != NULL) {
+                mark = explain_batch(&explain[SCAN_WEIGHTS], mark, rows, rows, rows * weights_bytes);
+            }
+        }
+        if (ctx->coverage != NULL) {
+            coverage_batch(ctx->coverage, batch);
+            if (explain != NULL) {
+                mark = explain_batch(&explain[SCAN_COVERAGE], mark, rows, rows, rows * coverage_bytes);
+            }
+        }
+        if (ctx->stations != NULL) {
+            stations_batch(ctx->stations, ctx->landuse, batch);
+            if (explain != NULL) {
+                mark = explain_batch(&explain[SCAN_STATIONS], mark, rows, rows, rows * stations_bytes);
+            }
+        }
+
+        /* Records aggregated are the rows that were complete and of a state */
+        unsigned long records = 0;
+        int known = 0;
+        for (i = 0; i < ctx->num_states && ctx->states[i] != NULL; ++i) {
+            records -= ctx->states[i]->num_records;
+            known++;
+        }
+        analyze_batch(batch, ctx->states, ctx->num_states);
+        for (i = 0; i < ctx->num_states && ctx->states[i] != NULL; ++i) {
+            records += ctx->states[i]->num_records;
+            if (i >= known) {
+                ctx->origins[i].range = reader->range;
+                ctx->origins[i].pos = pos;
+                ctx->origins[i].slot = i;
+            }
+        }
+        if (explain != NULL) {
+            explain_batch(&explain[SCAN_AGGREGATE], mark, rows, records, rows * aggregate_bytes);
+        }
+        if (ctx->trace != NULL) {
+            trace_record(ctx->trace, "aggregate", begin, ctx->num_batches);
+        }
+    }
+}
+
+/* Reads up to BATCH_SZ lines of the range into the batch. Returns the
+ * number of lines read, 0 at the end of the range. */
+int read_lines(struct range_reader *reader, struct record_batch *batch) {
+    batch->count = 0;
+    while (batch->count < BATCH_SZ
+            && range_gets(batch->text[batch->count], LINE_SZ, reader) != NULL) {
+        batch->count++;
+    }
+    return batch->count;
+}
+
+/* Splits every line of the batch into its fields. Empty or absent fields
+ * set their bit in missing[row] and point at "". */
+void tokenize_batch(struct record_batch *batch) {
+    int row, f;
+    for (row = 0; row < batch->count; ++row) {
+        char **data = batch->fields[row];
+        int num_fields = split_fields(batch->text[row], data, NUM_FIELDS);
+        unsigned int missing = 0;
+
+        for (f = 0; f < NUM_FIELDS; ++f) {
+            if (f >= num_fields || data[f][0] == '\0') {
+                missing |= 1u << f;
+                data[f] = "";
+            }
+        }
+        batch->missing[row] = (unsigned short) missing;
+    }
+}
+
+/* Converts the fields into the batch columns. Missing numbers read as NAN
+ * (or 0 / "" for the non-numeric columns). */
+void parse_batch(struct record_batch *batch) {
+    int row;
+    for (row = 0; row < batch->count; ++row) {
+        char **data = batch->fields[row];
+        unsigned int missing = batch->missing[row];
+
+        snprintf(batch->code[row], sizeof batch->code[row], "%s", data[0]);
+        batch->timestamp[row] = atol(data[1]);
+        snprintf(batch->geohash[row], sizeof batch->geohash[row], "%s", data[2]);
+        batch->humidity[row] = (missing & (1u << 3)) ? NAN : atof(data[3]);
+        batch->snow[row] = (missing & (1u << 4)) ? NAN : atof(data[4]);
+        batch->cloud_cover[row] = (missing & (1u << 5)) ? NAN : atof(data[5]);
+        batch->lightning[row] = (missing & (1u << 6)) ? NAN : atof(data[6]);
+        batch->pressure[row] = (missing & (1u << 7)) ? NAN : atof(data[7]);
+        batch->temperature[row] = (missing & (1u << 8)) ? NAN : atof(data[8]);
+    }
+}
+
+/* Folds a batch into the per-state summaries. Incomplete rows are left out;
+ * --profile reports how many there were. */
+void analyze_batch(struct record_batch *batch, struct climate_info **states, int num_states) {
+    int row;
+    for (row = 0; row < batch->count; ++row) {
+        if (batch->missing[row] != 0) {
+            continue;
+        }
+
+        double temperature = batch->temperature[row] * 1.8 - 459.67;
+        long time = batch->timestamp[row] / 1000;
+
+        int val = 0;
+        while (val < num_states && states[val] != NULL ){
+            if(strcmp(batch->code[row],states[val]->code) == 0){
+                break;
+            }
+            val++;
+        }
+        if (val == num_states) {
+            continue;
+        }
+
+        /* Initialize struct in memory */
+        if (states[val] == NULL) {
+            states[val] = (struct climate_info*) malloc (sizeof(struct climate_info));
+            strcpy((states[val])->code, batch->code[row]);
+            (states[val])->num_records = 1;
+            (states[val])->max_temp = temperature;
+            (states[val])->max_temp_time = time;
+            (states[val])->min_temp = temperature;
+            (states[val])->min_temp_time = time;
+            (states[val])->num_lightning_strikes = (long) batch->lightning[row];
+            (states[val])->num_snow = (long) batch->snow[row];
+            (states[val])->sum_of_temperature = temperature;
+            (states[val])->sum_of_humidity = batch->humidity[row];
+            (states[val])->sum_of_cloud_cover = batch->cloud_cover[row];
+        } else {                                                            //else we update the struct
+            (states[val])->num_records +=1;
+            if ((states[val])->max_temp < temperature){
+                (states[val])->max_temp = temperature;
+                (states[val])->max_temp_time = time;
+            }
+            if ((states[val])->min_temp > temperature) {
+                (states[val])->min_temp = temperature;
+                (states[val])->min_temp_time = time;
+            }
+            (states[val])->num_lightning_strikes += (long) batch->lightning[row];
+            (states[val])->num_snow += (long) batch->snow[row];
+            (states[val])->sum_of_temperature += temperature;
+            (states[val])->sum_of_humidity += batch->humidity[row];
+            (states[val])->sum_of_cloud_cover += batch->cloud_cover[row];
+        }
+    }
+}
+
+/* This function prints out the climate data */     
+void print_report(struct climate_info *states[], int num_states,
+        const struct time_weights *weights) {
+    printf("Welcome. This program erforms analysis on climate data provided by the National Oceanic and Atmospheric Administration (NOAA).\n");
+    
+    printf("States found: ");
+    int i;
+    for (i = 0; i < num_states; ++i) {
+        if (states[i] != NULL) {
+            struct climate_info *info = states[i];
+            printf("%s ", info->code);
+        }
+    }
+    printf("\n");
+
+    /* Print out the summary for each state */
+    for (int i = 0; i < num_states; i++) {
+        struct climate_info *info = states[i];
         if(info!=NULL){
-            printf("-- State: %s --\n", (info->code));
-            printf("Number of Records: %ld\n", (info->num_records));
-            printf("Average humidity: %.1Lf%%\n", (info)->sum_of_humidity / info->num_records);
-            printf("Average temperature: %.1LFF\n", (info)->sum_of_temperature / info->num_records);  
-            printf("Max temperature: %.1fF\n", (info)->max_temp);
-            printf("Max temperature on: %s", ctime(&(info)->max_temp_time));         
-            printf("Min temperature: %.1fF\n", (info)->min_temp);
-            printf("Min Temperature on: %s", ctime(&(info)->min_temp_time));
-            printf("Lightning Strikes: %ld\n", (info)->num_lightning_strikes);     //this # / 50 is correct
-            printf("Records with Snow Cover: %ld\n", (info)->num_snow);             //this # / 50 is correct
-            printf("Average Cloud Cover: %.1f%%\n", (info)->sum_of_cloud_cover / (info)->num_records);
+            print_state(stdout, info, weights);
+        }
+
+    }
+}
+
+/* This function prints out the summary of one state */
+void print_state(FILE *out, struct climate_info *info, const struct time_weights *weights) {
+    fprintf(out, "-- State: %s --\n", (info->code));
+    fprintf(out, "Number of Records: %ld\n", (info->num_records));
+    fprintf(out, "Average humidity: %.1Lf%%\n", (info)->sum_of_humidity / info->num_records);
+    fprintf(out, "Average temperature: %.1LFF\n", (info)->sum_of_temperature / info->num_records);  
+    if (weights != NULL) {
+        double temperature, humidity;
+        if (time_weighted_means(weights, info->code, &temperature, &humidity)) {
+            fprintf(out, "Time-weighted humidity: %.1f%%\n", humidity);
+            fprintf(out, "Time-weighted temperature: %.1fF\n", temperature);
+        } else {
+            fprintf(out, "Time-weighted humidity: n/a\n");
+            fprintf(out, "Time-weighted temperature: n/a\n");
+        }
+    }
+    fprintf(out, "Max temperature: %.1fF\n", (info)->max_temp);
+    fprintf(out, "Max temperature on: %s", ctime(&(info)->max_temp_time));         
+    fprintf(out, "Min temperature: %.1fF\n", (info)->min_temp);
+    fprintf(out, "Min Temperature on: %s", ctime(&(info)->min_temp_time));
+    fprintf(out, "Lightning Strikes: %ld\n", (info)->num_lightning_strikes);     //this # / 50 is correct
+    fprintf(out, "Records with Snow Cover: %ld\n", (info)->num_snow);             //this # / 50 is correct
+    fprintf(out, "Average Cloud Cover: %.1f%%\n", (info)->sum_of_cloud_cover / (info)->num_records);
+}
+
+/* realloc that gives up on the whole run when memory runs out */
+void *xrealloc(void *ptr, size_t size) {
+    void *mem = realloc(ptr, size);
+    if (mem == NULL && size != 0) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return mem;
+}
+
+/* Splits a TDV line at every tab. Unlike strtok, empty fields are kept so a
+ * missing value does not shift the columns after it. Returns the number of
+ * fields found (never more than max). */
+int split_fields(char *line, char *data[], int max) {
+    int index = 0;
+    char *p = line;
+
+    line[strcspn(line, "\r\n")] = '\0';
+    while (index < max) {
+        data[index++] = p;
+        p = strchr(p, '\t');
+        if (p == NULL) {
+            break;
+        }
+        *p++ = '\0';
+    }
+    return index;
+}
+
+/* Parses durations like "90", "15m", "6h" or "1d" into seconds, -1 if the
+ * text is not a duration */
+long parse_duration(const char *text) {
+    char *end;
+    long value = strtol(text, &end, 10);
+
+    if (end == text || value < 0) {
+        return -1;
+    }
+    if (strcmp(end, "") == 0 || strcmp(end, "s") == 0) {
+        return value;
+    } else if (strcmp(end, "m") == 0) {
+        return value * 60;
+    } else if (strcmp(end, "h") == 0) {
+        return value * 3600;
+    } else if (strcmp(end, "d") == 0) {
+        return value * 86400;
+    }
+    return -1;
+}
+
+/* FNV-1a over the part of the key the table keeps */
+unsigned long hash_key(const char *key) {
+    unsigned long hash = 2166136261UL;
+    int i;
+    for (i = 0; i < KEY_SZ - 1 && key[i] != '\0'; ++i) {
+        hash ^= (unsigned char) key[i];
+        hash = (hash * 16777619UL) & 0xffffffffUL;
+    }
+    return hash;
+}
+
+void key_table_init(struct key_table *table) {
+    table->count = 0;
+    table->capacity = 0;
+    table->buckets = NULL;
+    table->keys = NULL;
+}
+
+int key_table_lookup(const struct key_table *table, const char *key) {
+    if (table->capacity == 0) {
+        return -1;
+    }
+    size_t mask = table->capacity - 1;
+    size_t i = hash_key(key) & mask;
+    while (table->buckets[i] != 0) {
+        int id = table->buckets[i] - 1;
+        if (strncmp(table->keys[id], key, KEY_SZ - 1) == 0) {
+            return id;
+        }
+        i = (i + 1) & mask;
+    }
+    return -1;
+}
+
+/* Doubles the bucket array and re-inserts every key */
+void key_table_grow(struct key_table *table) {
+    size_t capacity = table->capacity ? table->capacity * 2 : 64;
+    size_t mask = capacity - 1;
+    size_t id;
+
+    free(table->buckets);
+    table->buckets = xrealloc(NULL, capacity * sizeof(int));
+    memset(table->buckets, 0, capacity * sizeof(int));
+    table->keys = xrealloc(table->keys, capacity / 2 * sizeof(*table->keys));
+    table->capacity = capacity;
+
+    for (id = 0; id < table->count; ++id) {
+        size_t i = hash_key(table->keys[id]) & mask;
+        while (table->buckets[i] != 0) {
+            i = (i + 1) & mask;
+        }
+        table->buckets[i] = (int) id + 1;
+    }
+}
+
+/* Returns the id of key, adding it if this is the first time it is seen */
+int key_table_intern(struct key_table *table, const char *key) {
+    int id = key_table_lookup(table, key);
+    if (id >= 0) {
+        return id;
+    }
+
+    /* Keep the load factor at or below one half */
+    if ((table->count + 1) * 2 > table->capacity) {
+        key_table_grow(table);
+    }
+
+    size_t mask = table->capacity - 1;
+    size_t i = hash_key(key) & mask;
+    while (table->buckets[i] != 0) {
+        i = (i + 1) & mask;
+    }
+    id = (int) table->count++;
+    strncpy(table->keys[id], key, KEY_SZ - 1);
+    table->keys[id][KEY_SZ - 1] = '\0';
+    table->buckets[i] = id + 1;
+    return id;
+}
+
+void key_table_free(struct key_table *table) {
+    free(table->buckets);
+    free(table->keys);
+    key_table_init(table);
+}
+
+/* Floor division, so windows line up on negative timestamps too */
+long floor_div(long a, long b) {
+    long q = a / b;
+    if ((a % b != 0) && ((a < 0) != (b < 0))) {
+        q--;
+    }
+    return q;
+}
+
+void format_utc(long time, char *buf, size_t buf_sz) {
+    time_t t = (time_t) time;
+    strftime(buf, buf_sz, "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+}
+
+/* Finds the pane of windows starting at start, creating it in order */
+struct window_pane *window_pane_get(struct window_stream *stream, long start) {
+    struct window_pane **link = &stream->panes;
+    while (*link != NULL && (*link)->start < start) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL && (*link)->start == start) {
+        return *link;
+    }
+
+    struct window_pane *pane = xrealloc(NULL, sizeof(struct window_pane));
+    pane->start = start;
+    key_table_init(&pane->keys);
+    pane->aggs = NULL;
+    pane->aggs_cap = 0;
+    pane->next = *link;
+    *link = pane;
+
+    stream->open_panes++;
+    if (stream->open_panes > stream->max_open_panes) {
+        stream->max_open_panes = stream->open_panes;
+    }
+    return pane;
+}
+
+/* Adds one record to every window that covers its event time. Windows the
+ * watermark has already closed are skipped; the record counts as late only
+ * when every window it belongs to was closed. */
+void window_add(struct window_stream *stream, const char *key, long time,
+        double temperature, double humidity, long lightning) {
+    int late = 1;
+    long start = floor_div(time, stream->slide) * stream->slide;
+
+    for (; start > time - stream->size; start -= stream->slide) {
+        if (start + stream->size <= stream->watermark) {
+            continue;
         }
+        late = 0;
+
+        struct window_pane *pane = window_pane_get(stream, start);
+        size_t before = pane->keys.count;
+        int id = key_table_intern(&pane->keys, key);
+        if (pane->keys.count > pane->aggs_cap) {
+            pane->aggs_cap = pane->keys.capacity;
+            pane->aggs = xrealloc(pane->aggs,
+                    pane->aggs_cap * sizeof(struct window_agg));
+        }
+
+        struct window_agg *agg = &pane->aggs[id];
+        if (pane->keys.count > before) {
+            agg->num_records = 0;
+            agg->sum_of_temperature = 0;
+            agg->max_temp = -DBL_MAX;
+            agg->min_temp = DBL_MAX;
+            agg->sum_of_humidity = 0;
+            agg->num_lightning_strikes = 0;
+        }
+        agg->num_records++;
+        agg->sum_of_temperature += temperature;
+        if (temperature > agg->max_temp) {
+            agg->max_temp = temperature;
+        }
+        if (temperature < agg->min_temp) {
+            agg->min_temp = temperature;
+        }
+        agg->sum_of_humidity += humidity;
+        agg->num_lightning_strikes += lightning;
+    }
+
+    stream->num_records++;
+    if (late) {
+        stream->num_late++;
+    }
+    if (time > stream->max_event_time) {
+        stream->max_event_time = time;
+        window_advance(stream, time - stream->lateness);
+    }
+}
+
+/* Moves the watermark forward, printing and freeing every window whose end
+ * it has passed */
+void window_advance(struct window_stream *stream, long watermark) {
+    int emitted = 0;
+
+    if (watermark <= stream->watermark) {
+        return;
+    }
+    stream->watermark = watermark;
+
+    while (stream->panes != NULL
+            && stream->panes->start <= watermark - stream->size) {
+        struct window_pane *pane = stream->panes;
+        char start[32], end[32];
+        size_t id;
+
+        format_utc(pane->start, start, sizeof start);
+        format_utc(pane->start + stream->size, end, sizeof end);
+        for (id = 0; id < pane->keys.count; ++id) {
+            struct window_agg *agg = &pane->aggs[id];
+            fprintf(stream->out, "%s\t%s\t%s\t%lu\t%.1f\t%.1f\t%.1f\t%.1f\t%lu\n",
+                    pane->keys.keys[id], start, end, agg->num_records,
+                    agg->sum_of_temperature / agg->num_records,
+                    agg->min_temp, agg->max_temp,
+                    agg->sum_of_humidity / agg->num_records,
+                    agg->num_lightning_strikes);
+            stream->num_windows++;
+        }
+
+        stream->panes = pane->next;
+        stream->open_panes--;
+        key_table_free(&pane->keys);
+        free(pane->aggs);
+        free(pane);
+        emitted = 1;
+    }
+
+    /* Downstream readers of a stream should see windows as they close */
+    if (emitted) {
+        fflush(stream->out);
+    }
+}
+
+void window_usage(const char *name) {
+    printf("Usage: %s window [--size 1d] [--slide 1d] [--lateness 6h] "
+            "[--by state|cell] [--precision 4] tdv_file1 ... tdv_fileN\n", name);
+}
+
+/* Entry point of `climate window` */
+int window_main(int argc, char *argv[]) {
+    struct window_stream stream;
+    memset(&stream, 0, sizeof stream);
+    stream.size = 86400;
+    stream.lateness = 6 * 3600;
+    stream.precision = 4;
+    stream.max_event_time = LONG_MIN;
+    stream.watermark = LONG_MIN;
+    stream.out = stdout;
+
+    int i;
+    for (i = 1; i + 1 < argc && strncmp(argv[i], "--", 2) == 0; i += 2) {
+        if (strcmp(argv[i], "--size") == 0) {
+            stream.size = parse_duration(argv[i + 1]);
+        } else if (strcmp(argv[i], "--slide") == 0) {
+            stream.slide = parse_duration(argv[i + 1]);
+        } else if (strcmp(argv[i], "--lateness") == 0) {
+            stream.lateness = parse_duration(argv[i + 1]);
+        } else if (strcmp(argv[i], "--by") == 0) {
+            if (strcmp(argv[i + 1], "cell") == 0) {
+                stream.by_cell = 1;
+            } else if (strcmp(argv[i + 1], "state") != 0) {
+                window_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--precision") == 0) {
+            stream.precision = atoi(argv[i + 1]);
+        } else {
+            window_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (stream.slide == 0) {
+        stream.slide = stream.size;
+    }
+    if (i >= argc || stream.size <= 0 || stream.slide <= 0
+            || stream.lateness < 0 || stream.precision < 1
+            || stream.precision > 12) {
+        window_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stream.out, "# key\tstart\tend\trecords\tavg_temp\tmin_temp"
+            "\tmax_temp\tavg_humidity\tlightning\n");
+
+    for (; i < argc; ++i) {
+        struct input input;
+        if (!open_input(&input, argv[i])) {
+            fprintf(stderr, "File does not exist: %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+
+        char line[256];
+        while (fgets(line, sizeof line, input.file) != NULL) {
+            char *data[NUM_FIELDS];
+            char key[KEY_SZ];
+            if (split_fields(line, data, NUM_FIELDS) < NUM_FIELDS) {
+                continue;
+            }
+            if (stream.by_cell) {
+                snprintf(key, sizeof key, "%.*s", stream.precision, data[2]);
+            } else {
+                snprintf(key, sizeof key, "%s", data[0]);
+            }
+            window_add(&stream, key, atol(data[1]) / 1000,
+                    atof(data[8]) * 1.8 - 459.67, atof(data[3]),
+                    atol(data[6]));
+        }
+        if (!close_input(&input)) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* End of input: nothing else can arrive, so every window is complete */
+    window_advance(&stream, LONG_MAX);
+
+    fprintf(stderr, "Records: %lu\n", stream.num_records);
+    fprintf(stderr, "Late records: %lu\n", stream.num_late);
+    fprintf(stderr, "Windows emitted: %lu\n", stream.num_windows);
+    fprintf(stderr, "Max open panes: %lu\n", (unsigned long) stream.max_open_panes);
+    return 0;
+}
+
+/* Field names and the range of plausible values, used by --profile */
+const char *FIELD_NAMES[NUM_FIELDS] = {
+    "state", "timestamp", "geohash", "humidity", "snow", "cloud_cover",
+    "lightning", "pressure", "temperature"
+};
+const double FIELD_MIN[NUM_FIELDS] = { 0, 0, 0, 0.0, 0.0, 0.0, 0.0, 30000.0, 150.0 };
+const double FIELD_MAX[NUM_FIELDS] = { 0, 0, 0, 100.0, 1.0, 100.0, 1.0, 110000.0, 350.0 };
+
+/* Timestamps after 2100 are treated as corrupt */
+#define MAX_TIMESTAMP 4102444800000L
+
+const char *STATE_CODES =
+    "AL AK AZ AR CA CO CT DE DC FL GA HI ID IL IN IA KS KY LA ME MD MA MI MN "
+    "MS MO MT NE NV NH NJ NM NY NC ND OH OK OR PA RI SC SD TN TX UT VT VA WA "
+    "WV WI WY";
+
+int is_state_code(const char *code) {
+    return strlen(code) == 2 && strstr(STATE_CODES, code) != NULL
+        && (strstr(STATE_CODES, code) - STATE_CODES) % 3 == 0;
+}
+
+int is_geohash(const char *geohash) {
+    return geohash[strspn(geohash, "0123456789bcdefghjkmnpqrstuvwxyz")] == '\0';
+}
+
+/* Counts the values outside [lo, hi] and marks their rows in bad. Written
+ * without branches over a whole column so the compiler can vectorize it.
+ * NAN (missing) compares false and is not counted. */
+unsigned long count_out_of_range(const double *column, int n, double lo, double hi,
+        unsigned char *bad) {
+    unsigned long count = 0;
+    int i;
+    for (i = 0; i < n; ++i) {
+        int out = (column[i] < lo) | (column[i] > hi);
+        bad[i] |= out;
+        count += out;
+    }
+    return count;
+}
+
+unsigned long long hash64(const void *data, size_t size, unsigned long long hash) {
+    const unsigned char *bytes = data;
+    size_t i;
+    for (i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Adds a fingerprint, returning 1 if it was already in the set */
+int fingerprint_set_add(struct fingerprint_set *set, unsigned long long fingerprint) {
+    size_t mask, i;
+
+    if (fingerprint == 0) {
+        fingerprint = 1;
+    }
+    if ((set->count + 1) * 2 > set->capacity) {
+        size_t old_capacity = set->capacity;
+        unsigned long long *old = set->slots;
+
+        set->capacity = old_capacity ? old_capacity * 2 : 1024;
+        set->slots = xrealloc(NULL, set->capacity * sizeof(unsigned long long));
+        memset(set->slots, 0, set->capacity * sizeof(unsigned long long));
+        mask = set->capacity - 1;
+        for (i = 0; i < old_capacity; ++i) {
+            if (old[i] != 0) {
+                size_t j = (size_t) old[i] & mask;
+                while (set->slots[j] != 0) {
+                    j = (j + 1) & mask;
+                }
+                set->slots[j] = old[i];
+            }
+        }
+        free(old);
+    }
+
+    mask = set->capacity - 1;
+    i = (size_t) fingerprint & mask;
+    while (set->slots[i] != 0) {
+        if (set->slots[i] == fingerprint) {
+            return 1;
+        }
+        i = (i + 1) & mask;
+    }
+    set->slots[i] = fingerprint;
+    set->count++;
+    return 0;
+}
+
+/* Updates the data-quality counters from one batch */
+void profile_batch(struct profile *profile, const struct record_batch *batch) {
+    unsigned char bad[BATCH_SZ];
+    int n = batch->count;
+    int row, f;
+
+    memset(bad, 0, sizeof bad);
+    profile->num_rows += n;
+
+    for (f = 0; f < NUM_FIELDS; ++f) {
+        unsigned long count = 0;
+        for (row = 0; row < n; ++row) {
+            count += (batch->missing[row] >> f) & 1u;
+        }
+        profile->missing[f] += count;
+    }
+    for (row = 0; row < n; ++row) {
+        profile->rows_with_missing += batch->missing[row] != 0;
+    }
+
+    /* The string and integer columns */
+    for (row = 0; row < n; ++row) {
+        int present = (batch->missing[row] & 1u) == 0;
+        int out = present & !is_state_code(batch->code[row]);
+        bad[row] |= out;
+        profile->out_of_range[0] += out;
+
+        present = (batch->missing[row] & (1u << 1)) == 0;
+        out = present & ((batch->timestamp[row] <= 0)
+                | (batch->timestamp[row] > MAX_TIMESTAMP));
+        bad[row] |= out;
+        profile->out_of_range[1] += out;
+
+        present = (batch->missing[row] & (1u << 2)) == 0;
+        out = present & !is_geohash(batch->geohash[row]);
+        bad[row] |= out;
+        profile->out_of_range[2] += out;
+    }
+
+    /* The numeric columns */
+    profile->out_of_range[3] += count_out_of_range(batch->humidity, n,
+            FIELD_MIN[3], FIELD_MAX[3], bad);
+    profile->out_of_range[4] += count_out_of_range(batch->snow, n,
+            FIELD_MIN[4], FIELD_MAX[4], bad);
+    profile->out_of_range[5] += count_out_of_range(batch->cloud_cover, n,
+            FIELD_MIN[5], FIELD_MAX[5], bad);
+    profile->out_of_range[6] += count_out_of_range(batch->lightning, n,
+            FIELD_MIN[6], FIELD_MAX[6], bad);
+    profile->out_of_range[7] += count_out_of_range(batch->pressure, n,
+            FIELD_MIN[7], FIELD_MAX[7], bad);
+    profile->out_of_range[8] += count_out_of_range(batch->temperature, n,
+            FIELD_MIN[8], FIELD_MAX[8], bad);
+
+    for (row = 0; row < n; ++row) {
+        profile->rows_out_of_range += bad[row];
+    }
+
+    /* A location reporting the same timestamp twice is a duplicate */
+    for (row = 0; row < n; ++row) {
+        if ((batch->missing[row] & ((1u << 1) | (1u << 2))) != 0) {
+            continue;
+        }
+        unsigned long long fingerprint = hash64(batch->geohash[row],
+                strlen(batch->geohash[row]), 14695981039346656037ULL);
+        fingerprint = hash64(&batch->timestamp[row], sizeof(long), fingerprint);
+        profile->duplicate_timestamps +=
+            fingerprint_set_add(&profile->seen, fingerprint);
+    }
+}
+
+double percent(unsigned long part, unsigned long whole) {
+    return whole == 0 ? 0.0 : 100.0 * part / whole;
+}
+
+/* Sets bits in the presence of a location on one day. The bitsets grow a
+ * month at a time on the side that is short, so input in no particular
+ * time order does not copy them for every new day. */
+void presence_mark(struct presence *presence, long day, unsigned int bits) {
+    long last = presence->first_day + (long) presence->num_days - 1;
+
+    if (presence->num_days == 0 || day < presence->first_day || day > last) {
+        long first = presence->num_days == 0 ? day : presence->first_day;
+        if (presence->num_days == 0) {
+            last = day + 31;
+        } else if (day < first) {
+            first = day - 31;
+        } else {
+            last = day + 31;
+        }
+        unsigned int *hours = xrealloc(NULL, (last - first + 1) * sizeof(unsigned int));
+        memset(hours, 0, (last - first + 1) * sizeof(unsigned int));
+        if (presence->num_days > 0) {
+            memcpy(hours + (presence->first_day - first), presence->hours,
+                    presence->num_days * sizeof(unsigned int));
+        }
+        free(presence->hours);
+        presence->hours = hours;
+        presence->first_day = first;
+        presence->num_days = (size_t) (last - first + 1);
+    }
+    presence->hours[day - presence->first_day] |= bits;
+}
+
+/* Finds the presence bitsets of a location, creating empty ones */
+struct presence *coverage_cell(struct coverage *coverage, const char *geohash,
+        const char *code) {
+    size_t before = coverage->cells.count;
+    int id = key_table_intern(&coverage->cells, geohash);
+    if (coverage->cells.count > coverage->cap) {
+        coverage->cap = coverage->cells.capacity;
+        coverage->cells_presence = xrealloc(coverage->cells_presence,
+                coverage->cap * sizeof(struct presence));
+    }
+    struct presence *presence = &coverage->cells_presence[id];
+    if (coverage->cells.count > before) {
+        memset(presence, 0, sizeof *presence);
+        memcpy(presence->code, code, sizeof presence->code);
+    }
+    return presence;
+}
+
+void coverage_batch(struct coverage *coverage, const struct record_batch *batch) {
+    int row;
+    for (row = 0; row < batch->count; ++row) {
+        /* Any reading counts, whatever else it is missing */
+        if ((batch->missing[row] & 7) != 0) {
+            continue;
+        }
+        long time = floor_div(batch->timestamp[row], 1000);
+        long day = floor_div(time, 86400);
+        presence_mark(coverage_cell(coverage, batch->geohash[row], batch->code[row]), day,
+                1u << ((time - day * 86400) / 3600));
+    }
+}
+
+void merge_coverage(struct coverage *into, struct coverage *from) {
+    size_t id, d;
+
+    for (id = 0; id < from->cells.count; ++id) {
+        struct presence *source = &from->cells_presence[id];
+        struct presence *presence = coverage_cell(into, from->cells.keys[id], source->code);
+        for (d = 0; d < source->num_days; ++d) {
+            if (source->hours[d] != 0) {
+                presence_mark(presence, source->first_day + (long) d, source->hours[d]);
+            }
+        }
+        free(source->hours);
+    }
+    key_table_free(&from->cells);
+    free(from->cells_presence);
+}
+
+/* Per-state totals of print_coverage */
+struct coverage_state {
+    unsigned long locations;
+    unsigned long readings;
+    unsigned long with_outages;
+    unsigned long outages;
+};
+
+/* A silence at one location: no reading in hours (from, to) */
+struct silence {
+    long from;
+    long to;
+    int cell;
+};
+
+/* Prints coverage per state and the ten longest silences over the period
+ * from the first to the last day anyone reported. The reporting hours
+ * are the hours of the day that appear anywhere in the input, so a site
+ * on a 6-hourly schedule is complete with 4 readings a day. Reading the
+ * bitsets costs one popcount per location and day plus one bit scan per
+ * reading. Returns 0 if the outages file cannot be written. */
+int print_coverage(const struct coverage *coverage, long gap, const char *outages) {
+    struct key_table codes;
+    struct coverage_state *states;
+    struct silence longest[10];
+    int num_longest = 0, k;
+    long first = LONG_MAX, last = LONG_MIN;
+    unsigned int grid = 0;
+    size_t id, d;
+    FILE *out = NULL;
+    char from[32], to[32];
+
+    for (id = 0; id < coverage->cells.count; ++id) {
+        const struct presence *presence = &coverage->cells_presence[id];
+        for (d = 0; d < presence->num_days; ++d) {
+            if (presence->hours[d] != 0) {
+                long day = presence->first_day + (long) d;
+                first = day < first ? day : first;
+                last = day > last ? day : last;
+                grid |= presence->hours[d];
+            }
+        }
+    }
+    if (grid == 0) {
+        return 1;
+    }
+    if (outages != NULL) {
+        out = fopen(outages, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Could not write outages %s\n", outages);
+            return 0;
+        }
+        fprintf(out, "# geohash\tstate\tsilent_from\tsilent_until\thours\n");
+    }
+
+    key_table_init(&codes);
+    states = xrealloc(NULL, (coverage->cells.count + 1) * sizeof(struct coverage_state));
+    for (id = 0; id < coverage->cells.count; ++id) {
+        const struct presence *presence = &coverage->cells_presence[id];
+        size_t before = codes.count;
+        int s = key_table_intern(&codes, presence->code);
+        struct coverage_state *state = &states[s];
+        long previous = first * 24;         /* the period starts as if seen */
+        unsigned long outages_here = 0;
+        long day;
+
+        if (codes.count > before) {
+            memset(state, 0, sizeof *state);
+        }
+        state->locations++;
+
+        /* One past the period end stands for "still silent at the end" */
+        for (day = first; day <= last + 1; ++day) {
+            unsigned int bits = 0;
+            if (day > last) {
+                bits = 1;
+            } else if (day >= presence->first_day
+                    && day < presence->first_day + (long) presence->num_days) {
+                bits = presence->hours[day - presence->first_day];
+                state->readings += __builtin_popcount(bits);
+            }
+            while (bits != 0) {
+                long hour = day * 24 + __builtin_ctz(bits);
+                bits &= bits - 1;
+                if ((hour - previous) * 3600 > gap) {
+                    struct silence silence;
+                    silence.from = previous;
+                    silence.to = hour;
+                    silence.cell = (int) id;
+                    outages_here++;
+                    if (out != NULL) {
+                        format_utc(previous * 3600, from, sizeof from);
+                        format_utc(hour * 3600, to, sizeof to);
+                        fprintf(out, "%s\t%s\t%s\t%s\t%ld\n", coverage->cells.keys[id],
+                                presence->code, from, to, hour - previous);
+                    }
+
+                    /* Keep the ten longest, longest first */
+                    if (num_longest < 10 || longest[9].to - longest[9].from < hour - previous) {
+                        for (k = num_longest < 10 ? num_longest++ : 9; k > 0
+                                && longest[k - 1].to - longest[k - 1].from < hour - previous;
+                                --k) {
+                            longest[k] = longest[k - 1];
+                        }
+                        longest[k] = silence;
+                    }
+                }
+                previous = hour;
+            }
+        }
+        state->outages += outages_here;
+        state->with_outages += outages_here > 0;
+    }
+
+    int per_day = __builtin_popcount(grid);
+    format_utc(first * 86400, from, sizeof from);
+    format_utc(last * 86400, to, sizeof to);
+    printf("-- Coverage --\n");
+    printf("Period: %.10s to %.10s, %ld days; reporting hours (UTC):", from, to,
+            last - first + 1);
+    for (k = 0; k < 24; ++k) {
+        if (grid & (1u << k)) {
+            printf(" %02d", k);
+        }
+    }
+    printf("\n");
+    printf("%-6s %10s %9s %13s %8s\n", "State", "Locations", "Coverage", "With outages",
+            "Outages");
+    for (id = 0; id < codes.count; ++id) {
+        const struct coverage_state *state = &states[id];
+        double expected = (double) state->locations * (last - first + 1) * per_day;
+        printf("%-6s %10lu %8.1f%% %13lu %8lu\n", codes.keys[id], state->locations,
+                100.0 * state->readings / expected, state->with_outages, state->outages);
+    }
+    printf("Longest silences (over %ldh):\n", gap / 3600);
+    for (k = 0; k < num_longest; ++k) {
+        format_utc(longest[k].from * 3600, from, sizeof from);
+        format_utc(longest[k].to * 3600, to, sizeof to);
+        printf("%s (%s): %ldh, %s to %s\n", coverage->cells.keys[longest[k].cell],
+                coverage->cells_presence[longest[k].cell].code,
+                longest[k].to - longest[k].from, from, to);
+    }
+
+    free(states);
+    key_table_free(&codes);
+    if (out != NULL && fclose(out) != 0) {
+        fprintf(stderr, "Could not write outages %s\n", outages);
+        return 0;
+    }
+    return 1;
+}
+
+/* FNV-1a over the first precision characters */
+unsigned long station_hash(const char *geohash, int precision) {
+    unsigned long hash = 2166136261UL;
+    int i;
+    for (i = 0; i < precision && geohash[i] != '\0'; ++i) {
+        hash ^= (unsigned char) geohash[i];
+        hash = (hash * 16777619UL) & 0xffffffffUL;
+    }
+    return hash;
+}
+
+/* Reads the --stations file and builds its hash table. Lines starting
+ * with # are comments. A geohash listed twice keeps its first line. */
+int load_stations(const char *path, struct station_table *stations) {
+    char line[LINE_SZ];
+    char *data[3];
+    size_t cap = 0, i, slot;
+    unsigned long line_number = 0, repeated = 0;
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL) {
+        fprintf(stderr, "File does not exist: %s\n", path);
+        return 0;
+    }
+    stations->precision = 0;
+    stations->count = 0;
+    stations->geohash = NULL;
+    stations->elevation = NULL;
+    stations->landuse = NULL;
+    key_table_init(&stations->classes);
+    while (fgets(line, sizeof line, file) != NULL) {
+        line_number++;
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0') {
+            continue;
+        }
+        int length = (int) strcspn(line, "\t");
+        if (split_fields(line, data, 3) < 3 || length < 1 || length > 12
+                || (stations->precision != 0 && length != stations->precision)
+                || !is_geohash(data[0]) || data[2][0] == '\0') {
+            fprintf(stderr, "%s:%lu: expected a geohash%s, elevation and land use\n", path,
+                    line_number, stations->precision ? " as long as the first" : "");
+            fclose(file);
+            return 0;
+        }
+        stations->precision = length;
+        if (stations->count == cap) {
+            cap = cap ? cap * 2 : 1024;
+            stations->geohash = xrealloc(stations->geohash, cap * sizeof *stations->geohash);
+            stations->elevation = xrealloc(stations->elevation, cap * sizeof(float));
+            stations->landuse = xrealloc(stations->landuse, cap * sizeof(int));
+        }
+        snprintf(stations->geohash[stations->count], 13, "%s", data[0]);
+        stations->elevation[stations->count] = (float) atof(data[1]);
+        stations->landuse[stations->count] = key_table_intern(&stations->classes, data[2]);
+        stations->count++;
+    }
+    fclose(file);
+    if (stations->count == 0) {
+        fprintf(stderr, "No stations in %s\n", path);
+        return 0;
+    }
+
+    /* Load factor at most one half */
+    for (stations->mask = 1; stations->mask < stations->count * 2; stations->mask <<= 1) {
+    }
+    stations->buckets = xrealloc(NULL, stations->mask * sizeof(unsigned int));
+    memset(stations->buckets, 0, stations->mask * sizeof(unsigned int));
+    stations->mask--;
+    for (i = 0; i < stations->count; ++i) {
+        slot = station_hash(stations->geohash[i], stations->precision) & stations->mask;
+        while (stations->buckets[slot] != 0
+                && strcmp(stations->geohash[stations->buckets[slot] - 1], stations->geohash[i]) != 0) {
+            slot = (slot + 1) & stations->mask;
+        }
+        if (stations->buckets[slot] != 0) {
+            repeated++;
+        } else {
+            stations->buckets[slot] = (unsigned int) i + 1;
+        }
+    }
+    if (repeated > 0) {
+        fprintf(stderr, "%s: ignored %lu repeated geohashes\n", path, repeated);
+    }
+    return 1;
+}
+
+/* Probes the station table with every row of a batch. The probes go in
+ * three passes so that the cache misses of a whole batch overlap instead
+ * of stalling one row at a time: hash every row and prefetch its bucket,
+ * then read the buckets and prefetch the stations, then compare. */
+void stations_batch(const struct station_table *stations, struct landuse_acc *landuse,
+        const struct record_batch *batch) {
+    size_t slots[BATCH_SZ];
+    unsigned int ids[BATCH_SZ];
+    int row, precision = stations->precision;
+
+    for (row = 0; row < batch->count; ++row) {
+        slots[row] = station_hash(batch->geohash[row], precision) & stations->mask;
+        __builtin_prefetch(&stations->buckets[slots[row]]);
+    }
+    for (row = 0; row < batch->count; ++row) {
+        ids[row] = stations->buckets[slots[row]];
+        if (ids[row] != 0) {
+            __builtin_prefetch(stations->geohash[ids[row] - 1]);
+            __builtin_prefetch(&stations->elevation[ids[row] - 1]);
+        }
+    }
+    for (row = 0; row < batch->count; ++row) {
+        unsigned int id = ids[row];
+        size_t slot = slots[row];
+
+        if ((batch->missing[row] & (1 << 2 | 1 << 8)) != 0) {
+            continue;
+        }
+        while (id != 0 && strncmp(stations->geohash[id - 1], batch->geohash[row], precision) != 0) {
+            slot = (slot + 1) & stations->mask;
+            id = stations->buckets[slot];
+        }
+        if (id == 0) {
+            landuse[stations->classes.count].records++;
+            continue;
+        }
+
+        struct landuse_acc *acc = &landuse[stations->landuse[id - 1]];
+        double temperature = batch->temperature[row] * 1.8 - 459.67;
+        double elevation = stations->elevation[id - 1];
+        acc->records++;
+        acc->sum_elevation += elevation;
+        acc->sum_temperature += temperature;
+        acc->sum_sea_level += temperature + stations->lapse_rate * elevation;
+    }
+}
+
+void print_landuse(const struct station_table *stations, const struct landuse_acc *landuse) {
+    const struct landuse_acc *none = &landuse[stations->classes.count];
+    unsigned long records = none->records;
+    size_t c;
+
+    for (c = 0; c < stations->classes.count; ++c) {
+        records += landuse[c].records;
+    }
+    printf("-- Land use --\n");
+    printf("Stations: %lu, matched on %d geohash characters; lapse rate %.1fC/km\n",
+            (unsigned long) stations->count, stations->precision,
+            stations->lapse_rate * 1000 / 1.8);
+    printf("Records without a station: %lu (%.1f%%)\n", none->records,
+            records ? 100.0 * none->records / records : 0.0);
+    printf("%-16s %10s %10s %9s %15s\n", "Class", "Records", "Elevation", "Avg temp",
+            "Sea-level temp");
+    for (c = 0; c < stations->classes.count; ++c) {
+        const struct landuse_acc *acc = &landuse[c];
+        if (acc->records == 0) {
+            printf("%-16s %10d %10s %9s %15s\n", stations->classes.keys[c], 0, "-", "-", "-");
+            continue;
+        }
+        printf("%-16s %10lu %9.0fm %8.1fF %14.1fF\n", stations->classes.keys[c],
+                acc->records, acc->sum_elevation / acc->records,
+                acc->sum_temperature / acc->records, acc->sum_sea_level / acc->records);
+    }
+}
+
+/* This function prints out the --profile counters */
+void print_profile(const struct profile *profile) {
+    int f;
+
+    printf("-- Data Quality Profile --\n");
+    printf("Rows scanned: %lu\n", profile->num_rows);
+    printf("Rows with missing fields: %lu (%.1f%%)\n", profile->rows_with_missing,
+            percent(profile->rows_with_missing, profile->num_rows));
+    printf("Rows with out-of-range values: %lu (%.1f%%)\n", profile->rows_out_of_range,
+            percent(profile->rows_out_of_range, profile->num_rows));
+    printf("Duplicate timestamps: %lu\n", profile->duplicate_timestamps);
+    printf("Unknown state codes: %lu\n", profile->out_of_range[0]);
+    printf("%-12s %8s %13s\n", "Field", "Null", "Out of range");
+    for (f = 0; f < NUM_FIELDS; ++f) {
+        printf("%-12s %7.2f%% %12.2f%%\n", FIELD_NAMES[f],
+                percent(profile->missing[f], profile->num_rows),
+                percent(profile->out_of_range[f], profile->num_rows));
+    }
+}
+
+/* Finds the series of a location, creating an empty one */
+struct location_series *time_weights_series(struct time_weights *weights,
+        const char *geohash, const char *code) {
+    size_t before = weights->cells.count;
+    int id = key_table_intern(&weights->cells, geohash);
+    if (weights->cells.count > weights->series_cap) {
+        weights->series_cap = weights->cells.capacity;
+        weights->series = xrealloc(weights->series,
+                weights->series_cap * sizeof(struct location_series));
+    }
+
+    struct location_series *series = &weights->series[id];
+    if (weights->cells.count > before) {
+        memset(series, 0, sizeof *series);
+        snprintf(series->code, sizeof series->code, "%s", code);
+        series->in_order = 1;
+    }
+    return series;
+}
+
+/* Appends the complete rows of a batch to the series of their location */
+void time_weights_batch(struct time_weights *weights, const struct record_batch *batch) {
+    int row;
+    for (row = 0; row < batch->count; ++row) {
+        if (batch->missing[row] != 0) {
+            continue;
+        }
+
+        struct location_series *series = time_weights_series(weights,
+                batch->geohash[row], batch->code[row]);
+        if (series->count == series->cap) {
+            series->cap = series->cap ? series->cap * 2 : 8;
+            series->obs = xrealloc(series->obs, series->cap * sizeof(struct observation));
+        }
+
+        struct observation *obs = &series->obs[series->count];
+        obs->time = batch->timestamp[row] / 1000;
+        obs->temperature = (float) (batch->temperature[row] * 1.8 - 459.67);
+        obs->humidity = (float) batch->humidity[row];
+        if (series->count > 0 && obs->time < obs[-1].time) {
+            series->in_order = 0;
+        }
+        series->count++;
+    }
+}
+
+int compare_observations(const void *a, const void *b) {
+    const struct observation *x = a, *y = b;
+    return (x->time > y->time) - (x->time < y->time);
+}
+
+/* Orders every series by time and folds it into weighted sums. Each
+ * observation stands for half the gap to the previous observation plus half
+ * the gap to the next one, the trapezoid rule over the location's series. A
+ * location seen only once covers no interval and gets no weight. */
+void time_weights_finish(struct time_weights *weights) {
+    size_t id;
+    for (id = 0; id < weights->cells.count; ++id) {
+        struct location_series *series = &weights->series[id];
+        size_t i;
+
+        /* Sorted input needs no sort: the arrival order already is time order */
+        if (!series->in_order) {
+            qsort(series->obs, series->count, sizeof(struct observation),
+                    compare_observations);
+        }
+
+        for (i = 0; i < series->count; ++i) {
+            double weight = 0;
+            if (i > 0) {
+                weight += (series->obs[i].time - series->obs[i - 1].time) / 2.0;
+            }
+            if (i + 1 < series->count) {
+                weight += (series->obs[i + 1].time - series->obs[i].time) / 2.0;
+            }
+            series->sum_of_weights += weight;
+            series->weighted_temperature += weight * series->obs[i].temperature;
+            series->weighted_humidity += weight * series->obs[i].humidity;
+        }
+
+        free(series->obs);
+        series->obs = NULL;
+    }
+}
+
+/* Time-weighted means of a state over all its locations. Returns 0 if none
+ * of them covers any time. */
+int time_weighted_means(const struct time_weights *weights, const char *code,
+        double *temperature, double *humidity) {
+    double sum_of_weights = 0, sum_of_temperature = 0, sum_of_humidity = 0;
+    size_t id;
+
+    for (id = 0; id < weights->cells.count; ++id) {
+        const struct location_series *series = &weights->series[id];
+        if (strcmp(series->code, code) == 0) {
+            sum_of_weights += series->sum_of_weights;
+            sum_of_temperature += series->weighted_temperature;
+            sum_of_humidity += series->weighted_humidity;
+        }
+    }
+    if (sum_of_weights <= 0) {
+        return 0;
+    }
+    *temperature = sum_of_temperature / sum_of_weights;
+    *humidity = sum_of_humidity / sum_of_weights;
+    return 1;
+}
+
+/* The Makefile links without -lm, so the few transcendental functions the
+ * statistics need are computed here. */
+#define LN2 0.69314718055994530942
+
+double math_log(double x) {
+    int exponent = 0;
+    int k;
+
+    if (x <= 0) {
+        return -HUGE_VAL;
+    }
+    while (x >= 2.0) {
+        x /= 2.0;
+        exponent++;
+    }
+    while (x < 1.0) {
+        x *= 2.0;
+        exponent--;
+    }
+
+    /* ln(x) = 2 atanh((x - 1) / (x + 1)), which converges fast on [1, 2) */
+    double y = (x - 1) / (x + 1);
+    double y2 = y * y;
+    double term = y;
+    double sum = 0;
+    for (k = 1; k < 80 && term > 1e-20; k += 2) {
+        sum += term / k;
+        term *= y2;
+    }
+    return 2 * sum + exponent * LN2;
+}
+
+double math_exp(double x) {
+    int k, i;
+
+    if (x < -745) {
+        return 0;
+    }
+    if (x > 709) {
+        return HUGE_VAL;
+    }
+
+    /* e^x = 2^k e^r with |r| <= ln(2) / 2 */
+    k = (int) (x / LN2 + (x < 0 ? -0.5 : 0.5));
+    double r = x - k * LN2;
+    double term = 1, sum = 1;
+    for (i = 1; i < 30; ++i) {
+        term *= r / i;
+        sum += term;
+    }
+    for (; k > 0; --k) {
+        sum *= 2;
+    }
+    for (; k < 0; ++k) {
+        sum /= 2;
+    }
+    return sum;
+}
+
+double math_sqrt(double x) {
+    double scale = 1;
+    int i;
+
+    if (x <= 0) {
+        return 0;
+    }
+    while (x > 4) {
+        x /= 4;
+        scale *= 2;
+    }
+    while (x < 0.25) {
+        x *= 4;
+        scale /= 2;
+    }
+
+    double guess = x;
+    for (i = 0; i < 10; ++i) {
+        guess = 0.5 * (guess + x / guess);
+    }
+    return guess * scale;
+}
+
+void rng_seed(struct rng *rng, unsigned long long seed) {
+    /* splitmix64 spreads nearby seeds apart */
+    seed += 0x9E3779B97F4A7C15ULL;
+    seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBULL;
+    rng->state = (seed ^ (seed >> 31)) | 1;
+}
+
+unsigned long long rng_next(struct rng *rng) {
+    rng->state ^= rng->state >> 12;
+    rng->state ^= rng->state << 25;
+    rng->state ^= rng->state >> 27;
+    return rng->state * 2685821657736338717ULL;
+}
+
+/* Uniform in (0, 1), never exactly 0 so its log is finite */
+double rng_uniform(struct rng *rng) {
+    return ((rng_next(rng) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+unsigned long long rng_below(struct rng *rng, unsigned long long bound) {
+    return bound == 0 ? 0 : rng_next(rng) % bound;
+}
+
+char *copy_string(const char *text) {
+    size_t size = strlen(text) + 1;
+    char *copy = xrealloc(NULL, size);
+    memcpy(copy, text, size);
+    return copy;
+}
+
+int online_cpus(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return 1;
+    }
+    return cpus > 64 ? 64 : (int) cpus;
+}
+
+/* Splits every input into byte ranges of at least 1 MiB, about four per
+ * thread so that uneven files still balance. Returns 0 if a file cannot
+ * be opened. */
+int plan_ranges(struct parallel_scan *scan, char *paths[], int num_paths, int num_threads) {
+    size_t cap = 0;
+    int i;
+
+    scan->ranges = NULL;
+    scan->num_ranges = 0;
+    scan->next = 0;
+    scan->failed = 0;
+
+    for (i = 0; i < num_paths; ++i) {
+        /* Pipes and compressed files can only be read front to back, by a
+         * single worker */
+        long size = -1;
+        if (strcmp(paths[i], "-") != 0) {
+            FILE *file = fopen(paths[i], "r");
+            if (file == NULL) {
+                fprintf(stderr, "File does not exist: %s\n", paths[i]);
+                free(scan->ranges);
+                return 0;
+            }
+            if (!input_is_stream(paths[i]) && fseek(file, 0, SEEK_END) == 0) {
+                size = ftell(file);
+            }
+            fclose(file);
+        }
+
+        long chunk = size / (num_threads * 4);
+        if (chunk < (1L << 20)) {
+            chunk = 1L << 20;
+        }
+        long begin = 0;
+        do {
+            if (scan->num_ranges == cap) {
+                cap = cap ? cap * 2 : 16;
+                scan->ranges = xrealloc(scan->ranges, cap * sizeof(struct scan_range));
+            }
+            struct scan_range *range = &scan->ranges[scan->num_ranges++];
+            range->path = paths[i];
+            range->begin = begin;
+            range->end = (size < 0 || begin + chunk >= size) ? -1 : begin + chunk;
+            begin += chunk;
+        } while (size >= 0 && begin < size);
+    }
+    return 1;
+}
+
+/* Opens a range and skips the partial line at its start, which belongs to
+ * the range before it */
+int range_open(struct range_reader *reader, const struct scan_range *range) {
+    char skip[256];
+
+    if (!open_input(&reader->input, range->path)) {
+        return 0;
+    }
+    reader->file = reader->input.file;
+    reader->pos = range->begin;
+    reader->end = range->end;
+    reader->at_line_start = 1;
+
+    if (range->begin > 0) {
+        if (fseek(reader->file, range->begin - 1, SEEK_SET) != 0) {
+            close_input(&reader->input);
+            return 0;
+        }
+        if (fgetc(reader->file) != '\n') {
+            while (fgets(skip, sizeof skip, reader->file) != NULL) {
+                reader->pos += strlen(skip);
+                if (skip[strlen(skip) - 1] == '\n') {
+                    break;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+/* fgets limited to the lines that start inside the range */
+char *range_gets(char *line, int size, struct range_reader *reader) {
+    if (reader->at_line_start && reader->end >= 0 && reader->pos >= reader->end) {
+        return NULL;
+    }
+    if (fgets(line, size, reader->file) == NULL) {
+        return NULL;
+    }
+    size_t length = strlen(line);
+    reader->pos += length;
+    reader->at_line_start = length > 0 && line[length - 1] == '\n';
+    return line;
+}
+
+void *scan_worker_run(void *arg) {
+    struct scan_worker *worker = arg;
+    struct parallel_scan *scan = worker->scan;
+
+    for (;;) {
+        pthread_mutex_lock(&scan->lock);
+        size_t index = scan->next++;
+        pthread_mutex_unlock(&scan->lock);
+        if (index >= scan->num_ranges) {
+            break;
+        }
+
+        struct range_reader reader;
+        if (!range_open(&reader, &scan->ranges[index])) {
+            fprintf(stderr, "Could not read %s\n", scan->ranges[index].path);
+            scan->failed = 1;
+            break;
+        }
+        reader.range = index;
+        scan->scan(worker->state, &reader);
+        if (!close_input(&reader.input)) {
+            scan->failed = 1;
+        }
+    }
+    return NULL;
+}
+
+/* Runs scan->scan over all planned ranges with num_threads workers, worker
+ * i using states[i]. Returns 0 if any range could not be read. */
+int run_parallel_scan(struct parallel_scan *scan, void **states, int num_threads) {
+    struct scan_worker *workers = xrealloc(NULL, num_threads * sizeof(struct scan_worker));
+    int i;
+
+    pthread_mutex_init(&scan->lock, NULL);
+    for (i = 0; i < num_threads; ++i) {
+        workers[i].scan = scan;
+        workers[i].state = states[i];
+    }
+
+    /* A single worker runs on the calling thread */
+    if (num_threads == 1) {
+        scan_worker_run(&workers[0]);
+    } else {
+        for (i = 0; i < num_threads; ++i) {
+            pthread_create(&workers[i].thread, NULL, scan_worker_run, &workers[i]);
+        }
+        for (i = 0; i < num_threads; ++i) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+
+    pthread_mutex_destroy(&scan->lock);
+    free(workers);
+    return !scan->failed;
+}
+
+/* Number of lines to pass over before the next replacement */
+unsigned long long reservoir_skip(struct reservoir *reservoir, struct rng *rng) {
+    double skip = math_log(rng_uniform(rng)) / math_log(1 - reservoir->w);
+    if (!(skip < 1e18)) {
+        return 1000000000000000000ULL;
+    }
+    return (unsigned long long) skip;
+}
+
+/* Finds the reservoir of a stratum, creating an empty one */
+struct reservoir *sampler_reservoir(struct sampler *sampler, const char *key) {
+    size_t before = sampler->strata.count;
+    int id = key_table_intern(&sampler->strata, key);
+    if (sampler->strata.count > sampler->reservoirs_cap) {
+        sampler->reservoirs_cap = sampler->strata.capacity;
+        sampler->reservoirs = xrealloc(sampler->reservoirs,
+                sampler->reservoirs_cap * sizeof(struct reservoir));
+    }
+
+    struct reservoir *reservoir = &sampler->reservoirs[id];
+    if (sampler->strata.count > before) {
+        memset(reservoir, 0, sizeof *reservoir);
+        reservoir->lines = xrealloc(NULL, sampler->n * sizeof(char *));
+    }
+    return reservoir;
+}
+
+/* Offers one line to the reservoir of its stratum */
+void sampler_offer(struct sampler *sampler, const char *key, const char *line) {
+    struct reservoir *reservoir = sampler_reservoir(sampler, key);
+
+    if (reservoir->seen < sampler->n) {
+        /* Still filling up */
+        reservoir->lines[reservoir->size++] = copy_string(line);
+        if (reservoir->size == sampler->n) {
+            reservoir->w = math_exp(math_log(rng_uniform(&sampler->rng)) / sampler->n);
+            reservoir->next = sampler->n + reservoir_skip(reservoir, &sampler->rng);
+        }
+    } else if (reservoir->seen == reservoir->next) {
+        size_t slot = rng_below(&sampler->rng, sampler->n);
+        free(reservoir->lines[slot]);
+        reservoir->lines[slot] = copy_string(line);
+        reservoir->w *= math_exp(math_log(rng_uniform(&sampler->rng)) / sampler->n);
+        reservoir->next += reservoir_skip(reservoir, &sampler->rng) + 1;
+    }
+    reservoir->seen++;
+}
+
+/* Scan callback of `climate sample` */
+void sample_range(void *state, struct range_reader *reader) {
+    struct sampler *sampler = state;
+    char line[256];
+    char key[KEY_SZ];
+
+    while (range_gets(line, sizeof line, reader) != NULL) {
+        if (line[0] == '\n' || line[0] == '\0') {
+            continue;
+        }
+        if (sampler->by_state) {
+            size_t length = strcspn(line, "\t\n");
+            snprintf(key, sizeof key, "%.*s", (int) (length < KEY_SZ ? length : KEY_SZ - 1), line);
+        } else {
+            strcpy(key, "all");
+        }
+        sampler_offer(sampler, key, line);
+    }
+}
+
+/* Merges reservoir `from` into `into`, keeping at most n lines. Each line is
+ * drawn from one side with probability proportional to the number of input
+ * lines that side still stands for, which makes the result a uniform
+ * sample of both inputs together. */
+void reservoir_merge(struct reservoir *into, struct reservoir *from, size_t n, struct rng *rng) {
+    char **lines = xrealloc(NULL, n * sizeof(char *));
+    unsigned long long left_into = into->seen, left_from = from->seen;
+    size_t size = 0;
+
+    while (size < n && (into->size > 0 || from->size > 0)) {
+        struct reservoir *side;
+        if (from->size == 0 || (into->size > 0
+                    && rng_below(rng, left_into + left_from) < left_into)) {
+            side = into;
+            left_into--;
+        } else {
+            side = from;
+            left_from--;
+        }
+        size_t pick = rng_below(rng, side->size);
+        lines[size++] = side->lines[pick];
+        side->lines[pick] = side->lines[--side->size];
+    }
+
+    while (into->size > 0) {
+        free(into->lines[--into->size]);
+    }
+    while (from->size > 0) {
+        free(from->lines[--from->size]);
+    }
+    free(into->lines);
+    free(from->lines);
+    from->lines = NULL;
+    into->lines = lines;
+    into->size = size;
+    into->seen += from->seen;
+}
+
+void sample_usage(const char *name) {
+    printf("Usage: %s sample --n N [--by state|none] [--seed S] [-j threads] "
+            "tdv_file1 ... tdv_fileN\n", name);
+}
+
+/* Entry point of `climate sample` */
+int sample_main(int argc, char *argv[]) {
+    long n = 0;
+    int by_state = 1;
+    unsigned long long seed = (unsigned long long) time(NULL);
+    int num_threads = online_cpus();
+    int i, t;
+    size_t id;
+
+    for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (strcmp(argv[i], "--n") == 0) {
+            n = atol(argv[i + 1]);
+        } else if (strcmp(argv[i], "--by") == 0) {
+            if (strcmp(argv[i + 1], "none") == 0) {
+                by_state = 0;
+            } else if (strcmp(argv[i + 1], "state") != 0) {
+                sample_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            seed = strtoull(argv[i + 1], NULL, 10);
+        } else if (strcmp(argv[i], "-j") == 0) {
+            num_threads = atoi(argv[i + 1]);
+        } else {
+            sample_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (i >= argc || n <= 0 || num_threads < 1) {
+        sample_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct parallel_scan scan;
+    if (!plan_ranges(&scan, argv + i, argc - i, num_threads)) {
+        return EXIT_FAILURE;
+    }
+    scan.scan = sample_range;
+
+    struct sampler *samplers = xrealloc(NULL, num_threads * sizeof(struct sampler));
+    void **states = xrealloc(NULL, num_threads * sizeof(void *));
+    for (t = 0; t < num_threads; ++t) {
+        memset(&samplers[t], 0, sizeof(struct sampler));
+        samplers[t].n = (size_t) n;
+        samplers[t].by_state = by_state;
+        rng_seed(&samplers[t].rng, seed + t);
+        key_table_init(&samplers[t].strata);
+        states[t] = &samplers[t];
+    }
+    if (!run_parallel_scan(&scan, states, num_threads)) {
+        return EXIT_FAILURE;
+    }
+
+    /* Fold every worker's reservoirs into the first worker's */
+    struct sampler *all = &samplers[0];
+    for (t = 1; t < num_threads; ++t) {
+        for (id = 0; id < samplers[t].strata.count; ++id) {
+            reservoir_merge(sampler_reservoir(all, samplers[t].strata.keys[id]),
+                    &samplers[t].reservoirs[id], all->n, &all->rng);
+        }
+    }
+
+    /* Give each stratum its share of n, largest remainders first */
+    unsigned long long population = 0;
+    size_t *quota = xrealloc(NULL, (all->strata.count + 1) * sizeof(size_t));
+    double *remainder = xrealloc(NULL, (all->strata.count + 1) * sizeof(double));
+    for (id = 0; id < all->strata.count; ++id) {
+        population += all->reservoirs[id].seen;
+    }
+    size_t assigned = 0;
+    for (id = 0; id < all->strata.count; ++id) {
+        double share = population ? (double) n * all->reservoirs[id].seen / population : 0;
+        quota[id] = (size_t) share;
+        remainder[id] = share - quota[id];
+        assigned += quota[id];
+    }
+    while (assigned < (size_t) n && assigned < population) {
+        size_t best = 0;
+        for (id = 1; id < all->strata.count; ++id) {
+            if (remainder[id] > remainder[best]) {
+                best = id;
+            }
+        }
+        quota[best]++;
+        remainder[best] = -1;
+        assigned++;
+    }
+
+    /* A random subset of a uniform sample is still uniform */
+    for (id = 0; id < all->strata.count; ++id) {
+        struct reservoir *reservoir = &all->reservoirs[id];
+        size_t k, take = quota[id] < reservoir->size ? quota[id] : reservoir->size;
+        for (k = 0; k < take; ++k) {
+            size_t pick = k + rng_below(&all->rng, reservoir->size - k);
+            char *line = reservoir->lines[pick];
+            reservoir->lines[pick] = reservoir->lines[k];
+            reservoir->lines[k] = line;
+            fputs(line, stdout);
+        }
+        fprintf(stderr, "%s: %zu of %llu records\n", all->strata.keys[id], take,
+                reservoir->seen);
+    }
+
+    free(quota);
+    free(remainder);
+    free(scan.ranges);
+    return 0;
+}
+
+#define SNAPSHOT_MAGIC "climate-snapshot 1"
+
+/* Saves the per-state accumulators, one tab-separated line per state. The
+ * sums are written with enough digits to read back exactly. */
+void write_snapshot(FILE *file, struct climate_info *states[], int num_states) {
+    int i;
+
+    fprintf(file, "%s\n", SNAPSHOT_MAGIC);
+    for (i = 0; i < num_states; ++i) {
+        struct climate_info *info = states[i];
+        if (info != NULL) {
+            fprintf(file, "%s\t%lu\t%.17g\t%ld\t%.17g\t%ld\t%lu\t%lu\t%.21Lg\t%.21Lg\t%.17g\n",
+                    info->code, info->num_records, info->max_temp,
+                    info->max_temp_time, info->min_temp, info->min_temp_time,
+                    info->num_lightning_strikes, info->num_snow,
+                    info->sum_of_temperature, info->sum_of_humidity,
+                    info->sum_of_cloud_cover);
+        }
+    }
+}
+
+/* Loads a snapshot into an empty states array. Returns the number of
+ * states read, or -1 if the file is not a snapshot. */
+int read_snapshot(FILE *file, struct climate_info *states[], int num_states) {
+    char line[512];
+    int count = 0;
+
+    if (fgets(line, sizeof line, file) == NULL
+            || strncmp(line, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC)) != 0) {
+        return -1;
+    }
+
+    while (count < num_states && fgets(line, sizeof line, file) != NULL) {
+        char *data[11];
+        if (split_fields(line, data, 11) < 11) {
+            return -1;
+        }
+
+        struct climate_info *info = malloc(sizeof(struct climate_info));
+        snprintf(info->code, sizeof info->code, "%s", data[0]);
+        info->num_records = strtoul(data[1], NULL, 10);
+        info->max_temp = strtod(data[2], NULL);
+        info->max_temp_time = atol(data[3]);
+        info->min_temp = strtod(data[4], NULL);
+        info->min_temp_time = atol(data[5]);
+        info->num_lightning_strikes = strtoul(data[6], NULL, 10);
+        info->num_snow = strtoul(data[7], NULL, 10);
+        info->sum_of_temperature = strtold(data[8], NULL);
+        info->sum_of_humidity = strtold(data[9], NULL);
+        info->sum_of_cloud_cover = strtod(data[10], NULL);
+        states[count++] = info;
+    }
+    return count;
+}
+
+struct climate_info *find_state(struct climate_info *states[], int num_states, const char *code) {
+    int i;
+    for (i = 0; i < num_states && states[i] != NULL; ++i) {
+        if (strcmp(states[i]->code, code) == 0) {
+            return states[i];
+        }
+    }
+    return NULL;
+}
+
+/* Prints one metric of a state in both runs. Returns 1 if the relative
+ * change reaches the threshold. Counts pass 0 digits. */
+int diff_metric(const char *label, int digits, double before, double after,
+        double threshold) {
+    double change = after - before;
+    int flagged;
+
+    if (before == 0) {
+        flagged = change != 0;
+        printf("%s: %.*f -> %.*f (%+.*f)%s\n", label, digits, before, digits, after,
+                digits, change,
+                flagged ? " !" : "");
+    } else {
+        double relative = 100.0 * change / (before < 0 ? -before : before);
+        flagged = (relative < 0 ? -relative : relative) >= threshold;
+        printf("%s: %.*f -> %.*f (%+.*f, %+.1f%%)%s\n", label, digits, before,
+                digits, after, digits, change, relative, flagged ? " !" : "");
+    }
+    return flagged;
+}
+
+int load_snapshot(const char *path, struct climate_info *states[]) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        printf("File does not exist: %s\n", path);
+        return 0;
+    }
+    int count = read_snapshot(file, states, NUM_STATES);
+    fclose(file);
+    if (count < 0) {
+        printf("Not a climate snapshot: %s\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+/* Entry point of `climate diff` */
+int diff_main(int argc, char *argv[]) {
+    struct climate_info *before[NUM_STATES] = { NULL };
+    struct climate_info *after[NUM_STATES] = { NULL };
+    double threshold = 10.0;
+    int flagged = 0;
+    int i = 1;
+
+    if (argc == 5 && strcmp(argv[1], "--threshold") == 0) {
+        threshold = atof(argv[2]);
+        i = 3;
+    }
+    if (argc - i != 2) {
+        printf("Usage: %s diff [--threshold PERCENT] old.snap new.snap\n", argv[0]);
+        return DIFF_ERROR;
+    }
+    if (!load_snapshot(argv[i], before) || !load_snapshot(argv[i + 1], after)) {
+        return DIFF_ERROR;
+    }
+
+    /* States of the old run, then states that only the new run has */
+    for (i = 0; i < 2 * NUM_STATES; ++i) {
+        struct climate_info *old_info, *new_info;
+        if (i < NUM_STATES) {
+            old_info = before[i];
+            if (old_info == NULL) {
+                continue;
+            }
+            new_info = find_state(after, NUM_STATES, old_info->code);
+        } else {
+            new_info = after[i - NUM_STATES];
+            if (new_info == NULL || find_state(before, NUM_STATES, new_info->code) != NULL) {
+                continue;
+            }
+            old_info = NULL;
+        }
+
+        printf("-- State: %s --\n", old_info ? old_info->code : new_info->code);
+        if (new_info == NULL) {
+            printf("Missing from new snapshot !\n");
+            flagged++;
+            continue;
+        }
+        if (old_info == NULL) {
+            printf("Missing from old snapshot !\n");
+            flagged++;
+            continue;
+        }
+
+        flagged += diff_metric("Number of Records", 0, old_info->num_records,
+                new_info->num_records, threshold);
+        flagged += diff_metric("Average humidity", 1,
+                (double) (old_info->sum_of_humidity / old_info->num_records),
+                (double) (new_info->sum_of_humidity / new_info->num_records), threshold);
+        flagged += diff_metric("Average temperature", 1,
+                (double) (old_info->sum_of_temperature / old_info->num_records),
+                (double) (new_info->sum_of_temperature / new_info->num_records), threshold);
+        flagged += diff_metric("Max temperature", 1, old_info->max_temp,
+                new_info->max_temp, threshold);
+        flagged += diff_metric("Min temperature", 1, old_info->min_temp,
+                new_info->min_temp, threshold);
+        flagged += diff_metric("Lightning Strikes", 0, old_info->num_lightning_strikes,
+                new_info->num_lightning_strikes, threshold);
+        flagged += diff_metric("Records with Snow Cover", 0, old_info->num_snow,
+                new_info->num_snow, threshold);
+        flagged += diff_metric("Average Cloud Cover", 1,
+                old_info->sum_of_cloud_cover / old_info->num_records,
+                new_info->sum_of_cloud_cover / new_info->num_records, threshold);
+    }
+
+    printf("Changes at or over %.1f%%: %d\n", threshold, flagged);
+    return flagged ? 1 : 0;
+}
+
+/* Inputs that cannot be seeked or split: standard input and .gz files */
+int input_is_stream(const char *path) {
+    size_t length = strlen(path);
+    return strcmp(path, "-") == 0
+        || (length > 3 && strcmp(path + length - 3, ".gz") == 0);
+}
+
+/* Set once standard input has its large buffer */
+int stdin_buffered = 0;
+
+/* Starts `gzip -dc path` and returns the read end of its output */
+FILE *spawn_decompressor(const char *path, pid_t *child) {
+    int fds[2];
+
+    if (pipe(fds) != 0) {
+        return NULL;
+    }
+    *child = fork();
+    if (*child < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return NULL;
+    }
+    if (*child == 0) {
+        /* Some modes ignore SIGPIPE, which exec would pass on */
+        signal(SIGPIPE, SIG_DFL);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execlp("gzip", "gzip", "-dc", "--", path, (char *) NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+
+    /* Otherwise a later decompressor holds this pipe open too, and this
+     * one never sees its reader go away when we stop early */
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    return fdopen(fds[0], "r");
+}
+
+/* Opens a file, - for standard input, or a .gz file through gzip. Reads go
+ * through a 1 MiB page-aligned buffer, so stdio fetches the data in large
+ * read() calls whether it comes from a file or a pipe. */
+int open_input(struct input *input, const char *path) {
+    size_t length = strlen(path);
+
+    input->path = path;
+    input->child = 0;
+    input->buffer = NULL;
+    if (strcmp(path, "-") == 0) {
+        /* stdin can only be given its buffer before the first read */
+        input->file = stdin;
+        if (stdin_buffered) {
+            return 1;
+        }
+        stdin_buffered = 1;
+    } else if (length > 3 && strcmp(path + length - 3, ".gz") == 0) {
+        FILE *probe = fopen(path, "r");
+        if (probe == NULL) {
+            return 0;
+        }
+        fclose(probe);
+        input->file = spawn_decompressor(path, &input->child);
+    } else {
+        input->file = fopen(path, "r");
+    }
+    if (input->file == NULL) {
+        return 0;
+    }
+
+    int fd = fileno(input->file);
+#ifdef F_SETPIPE_SZ
+    /* A larger pipe lets the writer run further ahead between our reads.
+     * This fails harmlessly when the input is not a pipe. */
+    fcntl(fd, F_SETPIPE_SZ, INPUT_BUFFER_SZ);
+#endif
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    if (posix_memalign(&input->buffer, 4096, INPUT_BUFFER_SZ) == 0) {
+        setvbuf(input->file, input->buffer, _IOFBF, INPUT_BUFFER_SZ);
+    } else {
+        input->buffer = NULL;
+    }
+    return 1;
+}
+
+/* Returns 0 when the decompressor failed, so that a truncated or corrupt
+ * .gz file is an error rather than a short report. A decompressor we
+ * stopped reading early dies of SIGPIPE, which is not one. */
+int close_input(struct input *input) {
+    int at_eof, status = 0, ok = 1;
+
+    if (input->file == stdin) {
+        /* stdin keeps pointing at our buffer, so it has to stay */
+        return 1;
+    }
+    at_eof = feof(input->file);
+    fclose(input->file);
+    if (input->child > 0) {
+        if (waitpid(input->child, &status, 0) < 0
+                || (at_eof && (!WIFEXITED(status) || WEXITSTATUS(status) != 0))) {
+            fprintf(stderr, "Could not decompress %s\n", input->path);
+            ok = 0;
+        }
+    }
+    free(input->buffer);
+    return ok;
+}
+
+/* Adds one worker's summary of a state into the states array, taking
+ * ownership of it */
+void merge_climate_info(struct climate_info **states, int num_states, struct climate_info *info) {
+    int val = 0;
+    while (val < num_states && states[val] != NULL
+            && strcmp(states[val]->code, info->code) != 0) {
+        val++;
+    }
+    if (val == num_states) {
+        free(info);
+        return;
+    }
+    if (states[val] == NULL) {
+        states[val] = info;
+        return;
+    }
+
+    struct climate_info *into = states[val];
+    into->num_records += info->num_records;
+    if (into->max_temp < info->max_temp) {
+        into->max_temp = info->max_temp;
+        into->max_temp_time = info->max_temp_time;
+    }
+    if (into->min_temp > info->min_temp) {
+        into->min_temp = info->min_temp;
+        into->min_temp_time = info->min_temp_time;
+    }
+    into->num_lightning_strikes += info->num_lightning_strikes;
+    into->num_snow += info->num_snow;
+    into->sum_of_temperature += info->sum_of_temperature;
+    into->sum_of_humidity += info->sum_of_humidity;
+    into->sum_of_cloud_cover += info->sum_of_cloud_cover;
+    free(info);
+}
+
+void merge_profile(struct profile *into, struct profile *from) {
+    size_t i;
+    int f;
+
+    into->num_rows += from->num_rows;
+    into->rows_with_missing += from->rows_with_missing;
+    into->rows_out_of_range += from->rows_out_of_range;
+    into->duplicate_timestamps += from->duplicate_timestamps;
+    for (f = 0; f < NUM_FIELDS; ++f) {
+        into->missing[f] += from->missing[f];
+        into->out_of_range[f] += from->out_of_range[f];
+    }
+
+    /* A pair both workers saw is a duplicate too */
+    for (i = 0; i < from->seen.capacity; ++i) {
+        if (from->seen.slots[i] != 0) {
+            into->duplicate_timestamps += fingerprint_set_add(&into->seen, from->seen.slots[i]);
+        }
+    }
+    free(from->seen.slots);
+}
+
+void merge_time_weights(struct time_weights *into, struct time_weights *from) {
+    size_t id, i;
+
+    for (id = 0; id < from->cells.count; ++id) {
+        struct location_series *source = &from->series[id];
+        struct location_series *series = time_weights_series(into,
+                from->cells.keys[id], source->code);
+
+        for (i = 0; i < source->count; ++i) {
+            if (series->count == series->cap) {
+                series->cap = series->cap ? series->cap * 2 : 8;
+                series->obs = xrealloc(series->obs, series->cap * sizeof(struct observation));
+            }
+            if (series->count > 0 && source->obs[i].time < series->obs[series->count - 1].time) {
+                series->in_order = 0;
+            }
+            series->obs[series->count++] = source->obs[i];
+        }
+        free(source->obs);
+    }
+    key_table_free(&from->cells);
+    free(from->series);
+}
+
+int compare_origins(const void *a, const void *b) {
+    const struct state_origin *x = a, *y = b;
+    if (x->range != y->range) {
+        return x->range < y->range ? -1 : 1;
+    }
+    if (x->pos != y->pos) {
+        return x->pos < y->pos ? -1 : 1;
+    }
+    return x->slot - y->slot;
+}
+
+/* Moves the states of every worker into the first one, in the order the
+ * input first has them, so that -j N lists them as -j 1 does whichever
+ * worker finished first */
+void merge_states_in_order(struct scan_context *contexts, int num_threads) {
+    struct state_origin *all = xrealloc(NULL, num_threads * NUM_STATES * sizeof(struct state_origin));
+    size_t count = 0, k;
+    int t, i;
+
+    for (t = 0; t < num_threads; ++t) {
+        for (i = 0; i < contexts[t].num_states && contexts[t].states[i] != NULL; ++i) {
+            all[count] = contexts[t].origins[i];
+            all[count++].info = contexts[t].states[i];
+            contexts[t].states[i] = NULL;
+        }
+    }
+    qsort(all, count, sizeof(struct state_origin), compare_origins);
+    for (k = 0; k < count; ++k) {
+        merge_climate_info(contexts[0].states, contexts[0].num_states, all[k].info);
+    }
+    free(all);
+}
+
+/* Folds everything worker `from` collected into worker `into` */
+void merge_scan_context(struct scan_context *into, struct scan_context *from) {
+    int i;
+    for (i = 0; i < from->num_states && from->states[i] != NULL; ++i) {
+        merge_climate_info(into->states, into->num_states, from->states[i]);
+        from->states[i] = NULL;
+    }
+    if (into->profile != NULL) {
+        merge_profile(into->profile, from->profile);
+    }
+    if (into->weights != NULL) {
+        merge_time_weights(into->weights, from->weights);
+    }
+    if (into->coverage != NULL) {
+        merge_coverage(into->coverage, from->coverage);
+    }
+    if (into->stations != NULL) {
+        for (i = 0; i <= (int) into->stations->classes.count; ++i) {
+            into->landuse[i].records += from->landuse[i].records;
+            into->landuse[i].sum_elevation += from->landuse[i].sum_elevation;
+            into->landuse[i].sum_temperature += from->landuse[i].sum_temperature;
+            into->landuse[i].sum_sea_level += from->landuse[i].sum_sea_level;
+        }
+        free(from->landuse);
+    }
+}
+
+void trace_init(struct trace_buffer *trace, int tid) {
+    trace->tid = tid;
+    trace->count = 0;
+    trace->events = xrealloc(NULL, TRACE_EVENTS * sizeof(struct trace_event));
+}
+
+/* Monotonic clock in microseconds */
+long trace_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long) now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+/* Records a stage that began at `begin` and ends now */
+void trace_record(struct trace_buffer *trace, const char *name, long begin, long chunk) {
+    struct trace_event *event = &trace->events[trace->count % TRACE_EVENTS];
+    event->name = name;
+    event->begin = begin;
+    event->duration = trace_now() - begin;
+    event->chunk = chunk;
+    trace->count++;
+}
+
+/* Adds a batch to the counters of an operator. Returns the time, which
+ * is when the next operator starts. */
+long explain_batch(struct operator_stats *stats, long begin, unsigned long rows_in,
+        unsigned long rows_out, unsigned long bytes) {
+    long now = trace_now();
+    stats->rows_in += rows_in;
+    stats->rows_out += rows_out;
+    stats->bytes += bytes;
+    stats->micros += now - begin;
+    return now;
+}
+
+/* One line of an --explain-analyze table, the name indented by depth */
+void print_operator(const char *name, int depth, const char *thread,
+        const struct operator_stats *stats) {
+    char selected[16];
+
+    if (stats->rows_in > 0) {
+        snprintf(selected, sizeof selected, "%.1f%%", 100.0 * stats->rows_out / stats->rows_in);
+    } else {
+        snprintf(selected, sizeof selected, "-");
+    }
+    fprintf(stderr, "%*s%-*s %6s %10lu %10lu %9s %8.1fMB %8.2fms\n", depth * 2, "",
+            36 - depth * 2, name, thread, stats->rows_in, stats->rows_out, selected,
+            stats->bytes / 1e6, stats->micros / 1e3);
+}
+
+/* Prints the operators of the report scan, the last one first, each for
+ * all threads and then for every thread */
+void print_scan_explain(struct scan_context *contexts, int num_threads) {
+    static const char *names[NUM_SCAN_OPERATORS] = {
+        "Read", "Tokenize", "Parse", "Profile", "Time weights", "Coverage",
+        "Station join", "Aggregate by state"
+    };
+    static const int order[NUM_SCAN_OPERATORS] = {
+        SCAN_AGGREGATE, SCAN_STATIONS, SCAN_COVERAGE, SCAN_WEIGHTS, SCAN_PROFILE,
+        SCAN_PARSE, SCAN_TOKENIZE, SCAN_READ
+    };
+    char thread[16];
+    int k, t, depth;
+
+    fprintf(stderr, "-- Explain analyze --\n");
+    fprintf(stderr, "%-36s %6s %10s %10s %9s %10s %10s\n", "Operator", "Thread", "Rows in",
+            "Rows out", "Selected", "Bytes", "Time");
+    for (k = 0; k < NUM_SCAN_OPERATORS; ++k) {
+        struct operator_stats total;
+        int op = order[k];
+
+        memset(&total, 0, sizeof total);
+        for (t = 0; t < num_threads; ++t) {
+            total.rows_in += contexts[t].explain[op].rows_in;
+            total.rows_out += contexts[t].explain[op].rows_out;
+            total.bytes += contexts[t].explain[op].bytes;
+            total.micros += contexts[t].explain[op].micros;
+        }
+        if (op != SCAN_AGGREGATE && total.rows_in == 0) {
+            continue;
+        }
+
+        /* The options all work on the parsed rows beside the aggregate */
+        depth = op <= SCAN_PARSE ? 1 + SCAN_PARSE - op : 0;
+        print_operator(names[op], depth, "all", &total);
+        for (t = 0; num_threads > 1 && t < num_threads; ++t) {
+            snprintf(thread, sizeof thread, "%d", t + 1);
+            print_operator("", depth, thread, &contexts[t].explain[op]);
+        }
+    }
+}
+
+/* Writes the buffers in the Chrome trace event format: one complete ("X")
+ * event per stage and chunk, and a name for every thread */
+void write_trace(FILE *file, struct trace_buffer **buffers, int num_buffers) {
+    long origin = LONG_MAX;
+    unsigned long dropped = 0;
+    int pid = (int) getpid();
+    int b, first = 1;
+    size_t i;
+
+    for (b = 0; b < num_buffers; ++b) {
+        struct trace_buffer *trace = buffers[b];
+        size_t oldest = trace->count > TRACE_EVENTS ? trace->count - TRACE_EVENTS : 0;
+        if (trace->count > oldest && trace->events[oldest % TRACE_EVENTS].begin < origin) {
+            origin = trace->events[oldest % TRACE_EVENTS].begin;
+        }
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (b = 0; b < num_buffers; ++b) {
+        struct trace_buffer *trace = buffers[b];
+        size_t oldest = trace->count > TRACE_EVENTS ? trace->count - TRACE_EVENTS : 0;
+
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s %d\"}}", first ? "" : ",\n", pid, trace->tid,
+                trace->tid == 0 ? "main" : "worker", trace->tid);
+        first = 0;
+
+        for (i = oldest; i < trace->count; ++i) {
+            struct trace_event *event = &trace->events[i % TRACE_EVENTS];
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"scan\",\"ph\":\"X\",\"ts\":%ld,"
+                    "\"dur\":%ld,\"pid\":%d,\"tid\":%d,\"args\":{\"chunk\":%ld}}",
+                    event->name, event->begin - origin, event->duration, pid,
+                    trace->tid, event->chunk);
+        }
+        dropped += oldest;
+    }
+    fprintf(file, "\n]}\n");
+
+    if (dropped > 0) {
+        fprintf(stderr, "Trace: %lu oldest events did not fit the per-thread buffers\n", dropped);
+    }
+}
+
+/* Upper bounds of the latency buckets, in microseconds */
+const long LATENCY_BOUNDS[LATENCY_BUCKETS] = {
+    10, 50, 100, 500, 1000, 5000, 10000, 50000, 100000, 1000000
+};
+const char *STAGE_NAMES[NUM_STAGES] = { "read", "parse", "aggregate" };
+
+/* Listens on a localhost TCP port when the address is a number, or on a
+ * Unix socket at that path otherwise. Returns the socket, -1 on error. */
+int open_listener(const char *address) {
+    int fd;
+
+    if (address[0] != '\0' && address[strspn(address, "0123456789")] == '\0') {
+        struct sockaddr_in addr;
+        int yes = 1;
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+        memset(&addr, 0, sizeof addr);
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((unsigned short) atoi(address));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd, (struct sockaddr *) &addr, sizeof addr) != 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct sockaddr_un addr;
+
+        if (strlen(address) >= sizeof addr.sun_path) {
+            return -1;
+        }
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        memset(&addr, 0, sizeof addr);
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, address);
+        unlink(address);
+        if (bind(fd, (struct sockaddr *) &addr, sizeof addr) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (listen(fd, 64) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Connects to a localhost TCP port or a Unix socket, as open_listener
+ * takes them. Returns the socket, -1 on error. */
+int open_connection(const char *address) {
+    int fd;
+
+    if (address[0] != '\0' && address[strspn(address, "0123456789")] == '\0') {
+        struct sockaddr_in addr;
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        memset(&addr, 0, sizeof addr);
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((unsigned short) atoi(address));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(fd, (struct sockaddr *) &addr, sizeof addr) != 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct sockaddr_un addr;
+
+        if (strlen(address) >= sizeof addr.sun_path) {
+            return -1;
+        }
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        memset(&addr, 0, sizeof addr);
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, address);
+        if (connect(fd, (struct sockaddr *) &addr, sizeof addr) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+/* Single-writer updates: a plain read of our own counter, then a relaxed
+ * atomic store that a concurrent scrape can read without tearing */
+void metrics_add(unsigned long *counter, unsigned long amount) {
+    __atomic_store_n(counter, *counter + amount, __ATOMIC_RELAXED);
+}
+
+void metrics_set(unsigned long *gauge, unsigned long value) {
+    __atomic_store_n(gauge, value, __ATOMIC_RELAXED);
+}
+
+unsigned long metrics_read(const unsigned long *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void metrics_observe(struct stage_histogram *histogram, long micros) {
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS && micros > LATENCY_BOUNDS[bucket]) {
+        bucket++;
+    }
+    metrics_add(&histogram->buckets[bucket], 1);
+    metrics_add(&histogram->sum, (unsigned long) micros);
+    metrics_add(&histogram->count, 1);
+}
+
+/* Resident memory from /proc where there is one, peak RSS elsewhere */
+unsigned long resident_memory(void) {
+    unsigned long pages_total, pages_resident;
+    struct rusage usage;
+    FILE *statm = fopen("/proc/self/statm", "r");
+
+    if (statm != NULL) {
+        int found = fscanf(statm, "%lu %lu", &pages_total, &pages_resident) == 2;
+        fclose(statm);
+        if (found) {
+            return pages_resident * (unsigned long) sysconf(_SC_PAGESIZE);
+        }
+    }
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return (unsigned long) usage.ru_maxrss;
+#else
+    return (unsigned long) usage.ru_maxrss * 1024;
+#endif
+}
+
+/* Sums every thread's block into the Prometheus text exposition format */
+void write_metrics(FILE *out, struct metrics_server *server) {
+    unsigned long rows = 0, bytes = 0, errors = 0, depth = 0;
+    int b, s, k;
+
+    for (b = 0; b < server->num_blocks; ++b) {
+        rows += metrics_read(&server->blocks[b]->rows);
+        bytes += metrics_read(&server->blocks[b]->bytes);
+        errors += metrics_read(&server->blocks[b]->parse_errors);
+        depth += metrics_read(&server->blocks[b]->queue_depth);
+    }
+
+    fprintf(out, "# HELP climate_rows_ingested_total Records read from the inputs.\n");
+    fprintf(out, "# TYPE climate_rows_ingested_total counter\n");
+    fprintf(out, "climate_rows_ingested_total{mode=\"%s\"} %lu\n", server->mode, rows);
+    fprintf(out, "# HELP climate_bytes_read_total Bytes read from the inputs.\n");
+    fprintf(out, "# TYPE climate_bytes_read_total counter\n");
+    fprintf(out, "climate_bytes_read_total{mode=\"%s\"} %lu\n", server->mode, bytes);
+    fprintf(out, "# HELP climate_parse_errors_total Records with missing fields.\n");
+    fprintf(out, "# TYPE climate_parse_errors_total counter\n");
+    fprintf(out, "climate_parse_errors_total{mode=\"%s\"} %lu\n", server->mode, errors);
+    fprintf(out, "# HELP climate_queue_depth_bytes Bytes in the inputs or read but not parsed yet.\n");
+    fprintf(out, "# TYPE climate_queue_depth_bytes gauge\n");
+    fprintf(out, "climate_queue_depth_bytes{mode=\"%s\"} %lu\n", server->mode, depth);
+
+    fprintf(out, "# HELP climate_stage_seconds Time spent per batch in each stage.\n");
+    fprintf(out, "# TYPE climate_stage_seconds histogram\n");
+    for (s = 0; s < NUM_STAGES; ++s) {
+        unsigned long cumulative = 0, count = 0, sum = 0;
+        for (k = 0; k <= LATENCY_BUCKETS; ++k) {
+            for (b = 0; b < server->num_blocks; ++b) {
+                cumulative += metrics_read(&server->blocks[b]->stages[s].buckets[k]);
+            }
+            if (k < LATENCY_BUCKETS) {
+                fprintf(out, "climate_stage_seconds_bucket{mode=\"%s\",stage=\"%s\",le=\"%g\"} %lu\n",
+                        server->mode, STAGE_NAMES[s], LATENCY_BOUNDS[k] / 1e6, cumulative);
+            } else {
+                fprintf(out, "climate_stage_seconds_bucket{mode=\"%s\",stage=\"%s\",le=\"+Inf\"} %lu\n",
+                        server->mode, STAGE_NAMES[s], cumulative);
+            }
+        }
+        for (b = 0; b < server->num_blocks; ++b) {
+            count += metrics_read(&server->blocks[b]->stages[s].count);
+            sum += metrics_read(&server->blocks[b]->stages[s].sum);
+        }
+        fprintf(out, "climate_stage_seconds_sum{mode=\"%s\",stage=\"%s\"} %g\n",
+                server->mode, STAGE_NAMES[s], sum / 1e6);
+        fprintf(out, "climate_stage_seconds_count{mode=\"%s\",stage=\"%s\"} %lu\n",
+                server->mode, STAGE_NAMES[s], count);
+    }
+
+    fprintf(out, "# HELP climate_resident_memory_bytes Resident set size.\n");
+    fprintf(out, "# TYPE climate_resident_memory_bytes gauge\n");
+    fprintf(out, "climate_resident_memory_bytes %lu\n", resident_memory());
+    fprintf(out, "# HELP climate_uptime_seconds Seconds since start.\n");
+    fprintf(out, "# TYPE climate_uptime_seconds gauge\n");
+    fprintf(out, "climate_uptime_seconds %.1f\n", (trace_now() - server->started) / 1e6);
+}
+
+/* Answers every connection with the current metrics over HTTP/1.0 */
+void *metrics_thread(void *arg) {
+    struct metrics_server *server = arg;
+
+    for (;;) {
+        int client = accept(server->listen_fd, NULL, NULL);
+        if (client < 0) {
+            continue;
+        }
+
+        /* Read the request head; a client that sends nothing gets a second */
+        struct timeval timeout = { 1, 0 };
+        char request[1024];
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+        if (recv(client, request, sizeof request, 0) < 0) {
+            close(client);
+            continue;
+        }
+
+        FILE *out = fdopen(client, "w");
+        if (out == NULL) {
+            close(client);
+            continue;
+        }
+        fprintf(out, "HTTP/1.0 200 OK\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n\r\n");
+        write_metrics(out, server);
+        fclose(out);
+    }
+    return NULL;
+}
+
+/* Opens the endpoint and starts the thread that serves it */
+int start_metrics_server(struct metrics_server *server, const char *address,
+        const char *mode, struct ingest_metrics **blocks, int num_blocks) {
+    server->mode = mode;
+    server->blocks = blocks;
+    server->num_blocks = num_blocks;
+    server->started = trace_now();
+    server->listen_fd = open_listener(address);
+    if (server->listen_fd < 0) {
+        fprintf(stderr, "Could not listen on %s\n", address);
+        return 0;
+    }
+    if (pthread_create(&server->thread, NULL, metrics_thread, server) != 0) {
+        close(server->listen_fd);
+        return 0;
+    }
+    pthread_detach(server->thread);
+    return 1;
+}
+
+/* Tokenizes, parses and aggregates a batch of lines, timing each stage */
+void process_batch(struct record_batch *batch, struct climate_info **states,
+        struct ingest_metrics *metrics) {
+    unsigned long errors = 0;
+    int row;
+
+    long begin = trace_now();
+    tokenize_batch(batch);
+    parse_batch(batch);
+    long parsed = trace_now();
+    analyze_batch(batch, states, NUM_STATES);
+    long done = trace_now();
+
+    for (row = 0; row < batch->count; ++row) {
+        errors += batch->missing[row] != 0;
+    }
+    metrics_observe(&metrics->stages[1], parsed - begin);
+    metrics_observe(&metrics->stages[2], done - parsed);
+    metrics_add(&metrics->rows, batch->count);
+    metrics_add(&metrics->parse_errors, errors);
+    batch->count = 0;
+}
+
+/* process_batch for the lines of the inputs, logging them first when
+ * there is a WAL */
+void ingest_batch(struct record_batch *batch, struct climate_info **states,
+        struct ingest_metrics *metrics, struct wal *wal) {
+    int row;
+    if (wal != NULL) {
+        for (row = 0; row < batch->count; ++row) {
+            size_t length = strlen(batch->text[row]);
+            if (wal->lines_len + length + 1 > wal->lines_cap) {
+                wal->lines_cap = (wal->lines_len + length + 1) * 2;
+                wal->lines = xrealloc(wal->lines, wal->lines_cap);
+            }
+            memcpy(wal->lines + wal->lines_len, batch->text[row], length);
+            wal->lines[wal->lines_len + length] = '\n';
+            wal->lines_len += length + 1;
+        }
+    }
+    process_batch(batch, states, metrics);
+}
+
+/* Set from the signal handler to end the long-running modes */
+volatile sig_atomic_t stop_requested = 0;
+
+void handle_stop_signal(int signal_number) {
+    (void) signal_number;
+    stop_requested = 1;
+}
+
+int follower_open(struct follower *follower, const char *path) {
+    struct stat info;
+
+    memset(follower, 0, sizeof *follower);
+    follower->path = path;
+    follower->fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (follower->fd < 0 || fstat(follower->fd, &info) != 0) {
+        return 0;
+    }
+    follower->is_pipe = !S_ISREG(info.st_mode);
+    if (follower->is_pipe) {
+        fcntl(follower->fd, F_SETFL, fcntl(follower->fd, F_GETFL) | O_NONBLOCK);
+    }
+    return 1;
+}
+
+/* Reads what the input has now, up to one buffer, and queues its complete
+ * lines into the batch. Returns the number of bytes read. */
+long follower_poll(struct follower *follower, char *buffer, size_t buffer_sz,
+        struct record_batch *batch, struct climate_info **states,
+        struct ingest_metrics *metrics, struct wal *wal) {
+    struct stat info;
+    long begin = trace_now();
+    ssize_t n = read(follower->fd, buffer, buffer_sz);
+
+    if (n == 0 && follower->is_pipe) {
+        follower->done = 1;
+        return 0;
+    }
+    if (n <= 0) {
+        /* A file that shrank was truncated or replaced: start over */
+        if (!follower->is_pipe && fstat(follower->fd, &info) == 0
+                && info.st_size < follower->offset) {
+            lseek(follower->fd, 0, SEEK_SET);
+            follower->offset = 0;
+            follower->pending_len = 0;
+        }
+        return 0;
+    }
+    metrics_observe(&metrics->stages[0], trace_now() - begin);
+    metrics_add(&metrics->bytes, (unsigned long) n);
+    follower->offset += n;
+
+    char *p = buffer, *end = buffer + n;
+    while (p < end) {
+        char *newline = memchr(p, '\n', end - p);
+        size_t length = (newline ? newline : end) - p;
+
+        /* Lines longer than a batch line are cut, like fgets would */
+        if (follower->pending_len + length >= LINE_SZ) {
+            length = LINE_SZ - 1 - follower->pending_len;
+        }
+        memcpy(follower->pending + follower->pending_len, p, length);
+        follower->pending_len += length;
+        if (newline == NULL) {
+            break;
+        }
+
+        memcpy(batch->text[batch->count], follower->pending, follower->pending_len);
+        batch->text[batch->count][follower->pending_len] = '\0';
+        follower->pending_len = 0;
+        if (++batch->count == BATCH_SZ) {
+            ingest_batch(batch, states, metrics, wal);
+        }
+        p = newline + 1;
+    }
+    return n;
+}
+
+/* Bytes the input holds that have not been read yet */
+unsigned long follower_backlog(const struct follower *follower) {
+    struct stat info;
+    int waiting = 0;
+
+    if (follower->is_pipe) {
+        return ioctl(follower->fd, FIONREAD, &waiting) == 0 && waiting > 0
+            ? (unsigned long) waiting : 0;
+    }
+    return fstat(follower->fd, &info) == 0 && info.st_size > follower->offset
+        ? (unsigned long) (info.st_size - follower->offset) : 0;
+}
+
+void follow_usage(const char *name) {
+    printf("Usage: %s follow [--metrics PORT|SOCKET_PATH] [--report-every 1m] "
+            "[--idle-exit 30s] [--wal DIR [--wal-sync 1]] tdv_file1 ... tdv_fileN\n", name);
+}
+
+/* Entry point of `climate follow` */
+int follow_main(int argc, char *argv[]) {
+    const char *metrics_address = NULL;
+    long report_every = 0, idle_exit = 0;
+    struct wal log;
+    int i;
+
+    memset(&log, 0, sizeof log);
+    log.sync_every = 1;
+    for (i = 1; i + 1 < argc && strncmp(argv[i], "--", 2) == 0; i += 2) {
+        if (strcmp(argv[i], "--metrics") == 0) {
+            metrics_address = argv[i + 1];
+        } else if (strcmp(argv[i], "--wal") == 0) {
+            log.dir = argv[i + 1];
+        } else if (strcmp(argv[i], "--wal-sync") == 0) {
+            log.sync_every = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--report-every") == 0) {
+            report_every = parse_duration(argv[i + 1]);
+        } else if (strcmp(argv[i], "--idle-exit") == 0) {
+            idle_exit = parse_duration(argv[i + 1]);
+        } else {
+            follow_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (i >= argc || report_every < 0 || idle_exit < 0 || log.sync_every < 0) {
+        follow_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int num_followers = argc - i;
+    struct follower *followers = xrealloc(NULL, num_followers * sizeof(struct follower));
+    int f;
+    for (f = 0; f < num_followers; ++f) {
+        if (!follower_open(&followers[f], argv[i + f])) {
+            fprintf(stderr, "File does not exist: %s\n", argv[i + f]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct climate_info *states[NUM_STATES] = { NULL };
+    struct record_batch *batch = xrealloc(NULL, sizeof(struct record_batch));
+    struct ingest_metrics metrics;
+    struct ingest_metrics *blocks[1];
+    struct metrics_server server;
+    char *buffer = xrealloc(NULL, INPUT_BUFFER_SZ);
+
+    memset(&metrics, 0, sizeof metrics);
+    blocks[0] = &metrics;
+    batch->count = 0;
+    if (metrics_address != NULL
+            && !start_metrics_server(&server, metrics_address, "follow", blocks, 1)) {
+        return EXIT_FAILURE;
+    }
+
+    /* Pick up where a previous run stopped, crashed or not */
+    struct wal *wal = log.dir != NULL ? &log : NULL;
+    if (wal != NULL && !wal_open(wal, followers, num_followers, states, batch, &metrics)) {
+        return EXIT_FAILURE;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    long last_report = trace_now(), last_data = trace_now();
+    while (!stop_requested) {
+        long read_now = 0;
+        int open_inputs = 0;
+
+        for (f = 0; f < num_followers; ++f) {
+            if (!followers[f].done) {
+                read_now += follower_poll(&followers[f], buffer, INPUT_BUFFER_SZ,
+                        batch, states, &metrics, wal);
+                open_inputs += !followers[f].done;
+            }
+        }
+
+        /* The queue is at its fullest here, with the round not ingested yet:
+         * what the inputs still hold, partial lines and the batch itself */
+        unsigned long queued = 0;
+        for (f = 0; f < num_followers; ++f) {
+            queued += followers[f].pending_len
+                + (followers[f].done ? 0 : follower_backlog(&followers[f]));
+        }
+        for (i = 0; i < batch->count; ++i) {
+            queued += strlen(batch->text[i]);
+        }
+        metrics_set(&metrics.queue_depth, queued);
+        if (batch->count > 0) {
+            ingest_batch(batch, states, &metrics, wal);
+        }
+
+        /* One log record (and at most one fsync) for the whole round */
+        if (wal != NULL && (!wal_commit(wal, followers, num_followers)
+                    || (wal->size >= WAL_CHECKPOINT_SZ
+                        && !wal_checkpoint(wal, followers, num_followers, states)))) {
+            return EXIT_FAILURE;
+        }
+
+        long now = trace_now();
+        if (read_now > 0) {
+            last_data = now;
+        }
+        if (report_every > 0 && now - last_report >= report_every * 1000000L) {
+            print_report(states, NUM_STATES, NULL);
+            fflush(stdout);
+            last_report = now;
+        }
+        if (open_inputs == 0
+                || (idle_exit > 0 && now - last_data >= idle_exit * 1000000L)) {
+            break;
+        }
+
+        /* Nothing new anywhere: wait a little instead of spinning */
+        if (read_now == 0) {
+            poll(NULL, 0, 100);
+        }
+    }
+
+    if (wal != NULL && !wal_checkpoint(wal, followers, num_followers, states)) {
+        return EXIT_FAILURE;
+    }
+    print_report(states, NUM_STATES, NULL);
+    return 0;
+}
+
+const char *COLUMN_NAMES[NUM_COLUMNS + 2] = {
+    "time", "humidity", "snow", "cloud", "lightning", "pressure", "temp",
+    "lat", "lon", "state", "geohash"
+};
+const char *LAYOUT_NAMES[] = { "state", "hilbert" };
+const char *AGG_NAMES[] = { "count", "sum", "avg", "min", "max" };
+
+void dict_init(struct geohash_dict *dict) {
+    pthread_mutex_init(&dict->lock, NULL);
+    key_table_init(&dict->ids);
+    dict->saved = 0;
+}
+
+unsigned int dict_intern(struct geohash_dict *dict, const char *geohash) {
+    pthread_mutex_lock(&dict->lock);
+    int id = key_table_intern(&dict->ids, geohash);
+    pthread_mutex_unlock(&dict->lock);
+    return (unsigned int) id;
+}
+
+void dict_cache_init(struct dict_cache *cache, struct geohash_dict *dict) {
+    cache->dict = dict;
+    key_table_init(&cache->seen);
+    cache->ids = NULL;
+}
+
+/* Id of a geohash. The few thousand sites repeat over millions of rows, so
+ * almost every call is answered by the thread's own table. */
+unsigned int dict_cache_id(struct dict_cache *cache, const char *geohash) {
+    size_t before = cache->seen.count;
+    int seen = key_table_intern(&cache->seen, geohash);
+    if (cache->seen.count > before) {
+        cache->ids = xrealloc(cache->ids, cache->seen.capacity * sizeof(unsigned int));
+        cache->ids[seen] = dict_intern(cache->dict, geohash);
+    }
+    return cache->ids[seen];
+}
+
+void dict_cache_free(struct dict_cache *cache) {
+    key_table_free(&cache->seen);
+    free(cache->ids);
+    cache->ids = NULL;
+}
+
+const char DICTIONARY_MAGIC[] = "climate-dictionary 1\n";
+
+/* Reads the ids of DIR/DICTIONARY (one geohash per line, the id being the
+ * line number) that dict does not have yet. A missing file is an empty
+ * dictionary. */
+int dict_load(const char *dir, struct geohash_dict *dict) {
+    char path[PATH_MAX], line[LINE_SZ];
+    size_t id = 0;
+    int ok;
+
+    snprintf(path, sizeof path, "%s/DICTIONARY", dir);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return 1;
+    }
+    ok = fgets(line, sizeof line, file) != NULL && strcmp(line, DICTIONARY_MAGIC) == 0;
+    while (ok && fgets(line, sizeof line, file) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        ok = (size_t) dict_intern(dict, line) == id++;
+    }
+    fclose(file);
+    if (!ok) {
+        fprintf(stderr, "Not a dictionary: %s\n", path);
+        return 0;
+    }
+    dict->saved = dict->ids.count;
+    return 1;
+}
+
+/* Rewrites DIR/DICTIONARY if ids were added since it was read, through a
+ * synced temporary file and a rename like the manifest */
+int dict_save(const char *dir, struct geohash_dict *dict) {
+    char path[PATH_MAX], temp[PATH_MAX];
+    size_t id;
+    int ok;
+
+    if (dict->saved == dict->ids.count) {
+        return 1;
+    }
+    snprintf(path, sizeof path, "%s/DICTIONARY", dir);
+    snprintf(temp, sizeof temp, "%s/DICTIONARY.tmp", dir);
+    FILE *file = fopen(temp, "w");
+    if (file == NULL) {
+        return 0;
+    }
+    fputs(DICTIONARY_MAGIC, file);
+    for (id = 0; id < dict->ids.count; ++id) {
+        fprintf(file, "%s\n", dict->ids.keys[id]);
+    }
+    ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temp, path) != 0) {
+        unlink(temp);
+        return 0;
+    }
+    dict->saved = dict->ids.count;
+    return 1;
+}
+
+void store_init(struct record_store *store) {
+    memset(store, 0, sizeof *store);
+    key_table_init(&store->state_index);
+    key_table_init(&store->cell_index);
+}
+
+void store_reserve(struct record_store *store, size_t count) {
+    int c;
+    if (count <= store->cap) {
+        return;
+    }
+    store->cap = store->cap ? store->cap * 2 : 4096;
+    if (store->cap < count) {
+        store->cap = count;
+    }
+    store->code = xrealloc(store->code, store->cap * sizeof(*store->code));
+    store->geohash = xrealloc(store->geohash, store->cap * sizeof(*store->geohash));
+    store->cell = xrealloc(store->cell, store->cap * sizeof(unsigned int));
+    for (c = 0; c < NUM_COLUMNS; ++c) {
+        store->columns[c] = xrealloc(store->columns[c], store->cap * sizeof(double));
+    }
+}
+
+/* Appends the complete rows of a batch, numbering their geohashes through
+ * cache */
+void store_append_batch(struct record_store *store, const struct record_batch *batch,
+        struct dict_cache *cache) {
+    int row;
+
+    store_reserve(store, store->count + batch->count);
+    for (row = 0; row < batch->count; ++row) {
+        if (batch->missing[row] != 0) {
+            continue;
+        }
+        size_t i = store->count++;
+        memcpy(store->code[i], batch->code[row], sizeof store->code[i]);
+        memcpy(store->geohash[i], batch->geohash[row], sizeof store->geohash[i]);
+        store->cell[i] = dict_cache_id(cache, batch->geohash[row]);
+        store->columns[COL_TIME][i] = (double) (batch->timestamp[row] / 1000);
+        store->columns[COL_HUMIDITY][i] = batch->humidity[row];
+        store->columns[COL_SNOW][i] = batch->snow[row];
+        store->columns[COL_CLOUD][i] = batch->cloud_cover[row];
+        store->columns[COL_LIGHTNING][i] = batch->lightning[row];
+        store->columns[COL_PRESSURE][i] = batch->pressure[row];
+        store->columns[COL_TEMP][i] = batch->temperature[row] * 1.8 - 459.67;
+        geohash_decode(batch->geohash[row], &store->columns[COL_LAT][i],
+                &store->columns[COL_LON][i]);
+    }
+    store->sorted = 0;
+}
+
+int compare_rows(const void *a, const void *b) {
+    const struct sort_row *x = a, *y = b;
+    int order = (x->key > y->key) - (x->key < y->key);
+    if (order == 0) {
+        order = strcmp(x->code, y->code);
+    }
+    if (order == 0) {
+        order = strcmp(x->geohash, y->geohash);
+    }
+    if (order == 0) {
+        order = (x->time > y->time) - (x->time < y->time);
+    }
+    return order;
+}
+
+/* Moves row order[i] to position i in every column */
+void store_permute(struct record_store *store, const size_t *order) {
+    size_t i;
+    int c;
+    char (*codes)[3] = xrealloc(NULL, store->count * sizeof(*codes));
+    char (*geohashes)[13] = xrealloc(NULL, store->count * sizeof(*geohashes));
+    unsigned int *cells = xrealloc(NULL, store->count * sizeof(unsigned int));
+    double *column = xrealloc(NULL, store->count * sizeof(double));
+
+    for (i = 0; i < store->count; ++i) {
+        memcpy(codes[i], store->code[order[i]], sizeof codes[i]);
+        memcpy(geohashes[i], store->geohash[order[i]], sizeof geohashes[i]);
+        cells[i] = store->cell[order[i]];
+    }
+    memcpy(store->code, codes, store->count * sizeof(*codes));
+    memcpy(store->geohash, geohashes, store->count * sizeof(*geohashes));
+    memcpy(store->cell, cells, store->count * sizeof(unsigned int));
+    for (c = 0; c < NUM_COLUMNS; ++c) {
+        for (i = 0; i < store->count; ++i) {
+            column[i] = store->columns[c][order[i]];
+        }
+        memcpy(store->columns[c], column, store->count * sizeof(double));
+    }
+    free(codes);
+    free(geohashes);
+    free(cells);
+    free(column);
+}
+
+/* Records the row range of every key of a sorted column. A key that shows
+ * up in two separate runs gets no range (begin == end == 0 and the index
+ * is not used for it). */
+void store_index(struct key_table *index, size_t **begin, size_t **end,
+        const char *keys, size_t key_sz, size_t count) {
+    size_t row = 0;
+
+    key_table_free(index);
+    free(*begin);
+    free(*end);
+    *begin = NULL;
+    *end = NULL;
+    while (row < count) {
+        const char *key = keys + row * key_sz;
+        size_t run_end = row + 1;
+        while (run_end < count && strcmp(keys + run_end * key_sz, key) == 0) {
+            run_end++;
+        }
+
+        size_t before = index->count;
+        int id = key_table_intern(index, key);
+        if (index->count > before) {
+            *begin = xrealloc(*begin, index->capacity * sizeof(size_t));
+            *end = xrealloc(*end, index->capacity * sizeof(size_t));
+            (*begin)[id] = row;
+            (*end)[id] = run_end;
+        } else {
+            (*begin)[id] = 0;
+            (*end)[id] = 0;
+        }
+        row = run_end;
+    }
+}
+
+/* Sorts in the order of the store's layout, then indexes states and
+ * geohashes */
+void store_sort(struct record_store *store) {
+    struct sort_row *rows = xrealloc(NULL, (store->count + 1) * sizeof(struct sort_row));
+    size_t *order = xrealloc(NULL, (store->count + 1) * sizeof(size_t));
+    size_t i;
+
+    for (i = 0; i < store->count; ++i) {
+        rows[i].key = 0;
+        rows[i].code[0] = '\0';
+        if (store->layout == LAYOUT_HILBERT) {
+            /* A 2^16 x 2^16 grid over the globe: cells of about 600 m */
+            unsigned int x = (unsigned int) ((store->columns[COL_LON][i] + 180) / 360 * 65535);
+            unsigned int y = (unsigned int) ((store->columns[COL_LAT][i] + 90) / 180 * 65535);
+            rows[i].key = hilbert_index(x, y, 16);
+        } else {
+            memcpy(rows[i].code, store->code[i], sizeof rows[i].code);
+        }
+        memcpy(rows[i].geohash, store->geohash[i], sizeof rows[i].geohash);
+        rows[i].time = store->columns[COL_TIME][i];
+        rows[i].row = i;
+    }
+    qsort(rows, store->count, sizeof(struct sort_row), compare_rows);
+    for (i = 0; i < store->count; ++i) {
+        order[i] = rows[i].row;
+    }
+    free(rows);
+    store_permute(store, order);
+    free(order);
+
+    store_index(&store->state_index, &store->state_begin, &store->state_end,
+            (const char *) store->code, sizeof(*store->code), store->count);
+    store_index(&store->cell_index, &store->cell_begin, &store->cell_end,
+            (const char *) store->geohash, sizeof(*store->geohash), store->count);
+    store_build_zones(store);
+    store->sorted = 1;
+}
+
+/* Computes the zone map of a sorted store */
+void store_build_zones(struct record_store *store) {
+    size_t z, row;
+    int c;
+
+    store->num_zones = (store->count + ZONE_ROWS - 1) / ZONE_ROWS;
+    store->zones = xrealloc(store->zones, (store->num_zones + 1) * sizeof(struct zone));
+    for (z = 0; z < store->num_zones; ++z) {
+        struct zone *zone = &store->zones[z];
+        size_t begin = z * ZONE_ROWS;
+        size_t end = begin + ZONE_ROWS < store->count ? begin + ZONE_ROWS : store->count;
+
+        for (c = 0; c < NUM_COLUMNS; ++c) {
+            zone->min[c] = DBL_MAX;
+            zone->max[c] = -DBL_MAX;
+            for (row = begin; row < end; ++row) {
+                double value = store->columns[c][row];
+                zone->min[c] = value < zone->min[c] ? value : zone->min[c];
+                zone->max[c] = value > zone->max[c] ? value : zone->max[c];
+            }
+        }
+        memcpy(zone->first_code, store->code[begin], sizeof zone->first_code);
+        memcpy(zone->last_code, store->code[end - 1], sizeof zone->last_code);
+    }
+}
+
+const char GEOHASH_BASE32[] = "0123456789bcdefghjkmnpqrstuvwxyz";
+
+/* Center of a geohash cell. Characters alternate starting with longitude,
+ * five bits each. */
+void geohash_decode(const char *geohash, double *lat, double *lon) {
+    double lat_lo = -90, lat_hi = 90, lon_lo = -180, lon_hi = 180;
+    int is_lon = 1, i, bit;
+
+    for (i = 0; geohash[i] != '\0'; ++i) {
+        const char *digit = strchr(GEOHASH_BASE32, geohash[i]);
+        if (digit == NULL) {
+            break;
+        }
+        int value = (int) (digit - GEOHASH_BASE32);
+        for (bit = 4; bit >= 0; --bit) {
+            double *lo = is_lon ? &lon_lo : &lat_lo, *hi = is_lon ? &lon_hi : &lat_hi;
+            double mid = (*lo + *hi) / 2;
+            if (value & (1 << bit)) {
+                *lo = mid;
+            } else {
+                *hi = mid;
+            }
+            is_lon = !is_lon;
+        }
+    }
+    *lat = (lat_lo + lat_hi) / 2;
+    *lon = (lon_lo + lon_hi) / 2;
+}
+
+void geohash_encode(double lat, double lon, int precision, char *geohash) {
+    double lat_lo = -90, lat_hi = 90, lon_lo = -180, lon_hi = 180;
+    int is_lon = 1, i, bit;
+
+    for (i = 0; i < precision; ++i) {
+        int value = 0;
+        for (bit = 4; bit >= 0; --bit) {
+            double *lo = is_lon ? &lon_lo : &lat_lo, *hi = is_lon ? &lon_hi : &lat_hi;
+            double coordinate = is_lon ? lon : lat;
+            double mid = (*lo + *hi) / 2;
+            if (coordinate >= mid) {
+                value |= 1 << bit;
+                *lo = mid;
+            } else {
+                *hi = mid;
+            }
+            is_lon = !is_lon;
+        }
+        geohash[i] = GEOHASH_BASE32[value];
+    }
+    geohash[precision] = '\0';
+}
+
+/* Distance of (x, y) along the Hilbert curve filling a 2^order square
+ * (the classic rotate-and-flip formulation) */
+unsigned long long hilbert_index(unsigned int x, unsigned int y, int order) {
+    unsigned long long d = 0;
+    unsigned int n = 1u << order, s;
+
+    for (s = n / 2; s > 0; s /= 2) {
+        unsigned int rx = (x & s) > 0;
+        unsigned int ry = (y & s) > 0;
+        d += (unsigned long long) s * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            unsigned int swap = x;
+            x = y;
+            y = swap;
+        }
+    }
+    return d;
+}
+
+/* Days since 1970-01-01 of a civil date, and back (Hinnant's algorithms) */
+long days_from_civil(long y, long m, long d) {
+    y -= m <= 2;
+    long era = (y >= 0 ? y : y - 399) / 400;
+    long yoe = y - era * 400;
+    long doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+void civil_from_days(long z, int *year, int *month, int *day) {
+    z += 719468;
+    long era = (z >= 0 ? z : z - 146096) / 146097;
+    long doe = z - era * 146097;
+    long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    long mp = (5 * doy + 2) / 153;
+    *day = (int) (doy - (153 * mp + 2) / 5 + 1);
+    *month = (int) (mp < 10 ? mp + 3 : mp - 9);
+    *year = (int) (yoe + era * 400 + (*month <= 2));
+}
+
+/* Reads "2015-06-01", "2015-06-01T06:30" or plain epoch seconds */
+int parse_time(const char *text, double *seconds) {
+    int year, month, day, hour = 0, minute = 0, second = 0;
+    char *end;
+
+    if (sscanf(text, "%4d-%2d-%2d", &year, &month, &day) == 3) {
+        const char *clock = strchr(text, 'T');
+        if (clock != NULL) {
+            sscanf(clock + 1, "%2d:%2d:%2d", &hour, &minute, &second);
+        }
+        *seconds = days_from_civil(year, month, day) * 86400.0
+            + hour * 3600 + minute * 60 + second;
+        return 1;
+    }
+    *seconds = strtod(text, &end);
+    return end != text && *end == '\0';
+}
+
+/* Splits query text into words and the symbols ( ) , * = != < <= > >= */
+int lex_query(const char *text, char tokens[][32], int max) {
+    int count = 0;
+
+    while (*text != '\0' && count < max) {
+        size_t length;
+        if (*text == ' ' || *text == '\t' || *text == '\r' || *text == '\n') {
+            text++;
+            continue;
+        }
+        if (strchr("(),*", *text) != NULL) {
+            length = 1;
+        } else if (strchr("=!<>", *text) != NULL) {
+            length = text[1] == '=' ? 2 : 1;
+        } else {
+            length = strcspn(text, " \t\r\n(),*=!<>");
+        }
+        if (length >= 32) {
+            length = 31;
+        }
+        memcpy(tokens[count], text, length);
+        tokens[count][length] = '\0';
+        count++;
+        text += length;
+    }
+    return count;
+}
+
+int find_column(const char *name) {
+    int c;
+    if (strcmp(name, "temperature") == 0) {
+        return COL_TEMP;
+    }
+    for (c = 0; c < NUM_COLUMNS + 2; ++c) {
+        if (strcmp(name, COLUMN_NAMES[c]) == 0) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+/* Parses a column or a window function of one at tokens[*t], moving *t
+ * past it. Returns the column, COL_WINDOW + i for the query's i-th window
+ * function, or -1 with a message in error. */
+int parse_operand(char tokens[][32], int n, int *t, struct query *query,
+        char *error, size_t error_sz) {
+    static const char *names[] = { "lag", "lead", "delta" };
+    struct window_fn window;
+    int k;
+
+    memset(&window, 0, sizeof window);
+    for (window.fn = WIN_LAG; window.fn <= WIN_DELTA; ++window.fn) {
+        if (*t < n && strcmp(tokens[*t], names[window.fn]) == 0) {
+            break;
+        }
+    }
+    if (window.fn > WIN_DELTA) {
+        if (*t >= n) {
+            snprintf(error, error_sz, "expected a column");
+            return -1;
+        }
+        int column = find_column(tokens[*t]);
+        if (column < 0) {
+            snprintf(error, error_sz, "unknown column '%s'", tokens[*t]);
+            return -1;
+        }
+        (*t)++;
+        return column;
+    }
+
+    /* name ( column [, arg] ) */
+    int i = *t + 1;
+    if (i + 2 >= n || strcmp(tokens[i], "(") != 0) {
+        snprintf(error, error_sz, "expected %s(COLUMN)", names[window.fn]);
+        return -1;
+    }
+    window.column = find_column(tokens[i + 1]);
+    if (window.column < 0 || window.column >= NUM_COLUMNS) {
+        snprintf(error, error_sz, "not a numeric column: '%s'", tokens[i + 1]);
+        return -1;
+    }
+    window.offset = 1;
+    i += 2;
+    const char *arg = NULL;
+    if (strcmp(tokens[i], ",") == 0 && i + 2 < n) {
+        arg = tokens[i + 1];
+        if (window.fn == WIN_DELTA) {
+            window.span = parse_duration(tokens[i + 1]);
+        } else {
+            window.offset = atol(tokens[i + 1]);
+        }
+        if (window.span < 0 || window.offset < 1) {
+            snprintf(error, error_sz, "bad argument '%s'", tokens[i + 1]);
+            return -1;
+        }
+        i += 2;
+    }
+    if (strcmp(tokens[i], ")") != 0) {
+        snprintf(error, error_sz, "expected ')' after %s(", names[window.fn]);
+        return -1;
+    }
+    if (window.fn == WIN_DELTA) {
+        window.offset = 0;
+    }
+    if (arg != NULL) {
+        snprintf(window.text, sizeof window.text, "%s(%s,%.8s)", names[window.fn],
+                COLUMN_NAMES[window.column], arg);
+    } else {
+        snprintf(window.text, sizeof window.text, "%s(%s)", names[window.fn],
+                COLUMN_NAMES[window.column]);
+    }
+    *t = i + 1;
+
+    for (k = 0; k < query->num_windows; ++k) {
+        if (strcmp(query->windows[k].text, window.text) == 0) {
+            return COL_WINDOW + k;
+        }
+    }
+    if (query->num_windows == MAX_WINDOWS) {
+        snprintf(error, error_sz, "at most %d window functions", MAX_WINDOWS);
+        return -1;
+    }
+    query->windows[query->num_windows] = window;
+    return COL_WINDOW + query->num_windows++;
+}
+
+/* Header name of a column or window function */
+const char *column_label(const struct query *query, int column) {
+    return column >= COL_WINDOW ? query->windows[column - COL_WINDOW].text
+        : COLUMN_NAMES[column];
+}
+
+/* Parses the query language described at the top of the file. Returns 0
+ * and a message in error if the text is not a valid query. */
+int parse_query(const char *text, struct query *query, char *error, size_t error_sz) {
+    char tokens[128][32];
+    int n = lex_query(text, tokens, 128);
+    int t = 0;
+
+    memset(query, 0, sizeof *query);
+    query->group_by = GROUP_NONE;
+    query->precision = 4;
+
+    if (t < n && strcmp(tokens[t], "select") == 0) {
+        t++;
+        if (t < n && strcmp(tokens[t], "*") == 0) {
+            query->list = 1;
+            t++;
+        } else {
+            for (;;) {
+                struct aggregate *agg = &query->select[query->num_select];
+                if (t >= n || query->num_select == MAX_AGGREGATES) {
+                    snprintf(error, error_sz, "expected an aggregate");
+                    return 0;
+                }
+                if (strcmp(tokens[t], "count") == 0) {
+                    agg->fn = AGG_COUNT;
+                    agg->column = COL_TEMP;
+                    t++;
+                    if (t + 1 < n && strcmp(tokens[t], "(") == 0) {
+                        t += strcmp(tokens[t + 1], ")") == 0 ? 2 : 3;
+                    }
+                } else {
+                    for (agg->fn = AGG_SUM; agg->fn <= AGG_MAX; ++agg->fn) {
+                        if (strcmp(tokens[t], AGG_NAMES[agg->fn]) == 0) {
+                            break;
+                        }
+                    }
+                    if (agg->fn > AGG_MAX || t + 3 >= n || strcmp(tokens[t + 1], "(") != 0) {
+                        snprintf(error, error_sz, "bad aggregate near '%s'", tokens[t]);
+                        return 0;
+                    }
+                    t += 2;
+                    agg->column = parse_operand(tokens, n, &t, query, error, error_sz);
+                    if (agg->column < 0) {
+                        return 0;
+                    }
+                    if (agg->column == COL_STATE || agg->column == COL_GEOHASH) {
+                        snprintf(error, error_sz, "not a numeric column: '%s'", tokens[t - 1]);
+                        return 0;
+                    }
+                    if (t >= n || strcmp(tokens[t], ")") != 0) {
+                        snprintf(error, error_sz, "bad aggregate near '%s'", tokens[t - 1]);
+                        return 0;
+                    }
+                    t++;
+                }
+                query->num_select++;
+                if (t < n && strcmp(tokens[t], ",") == 0) {
+                    t++;
+                    continue;
+                }
+                break;
+            }
+        }
+    }
+    if (!query->list && query->num_select == 0) {
+        query->select[0].fn = AGG_COUNT;
+        query->select[1].fn = AGG_AVG;
+        query->select[1].column = COL_TEMP;
+        query->select[2].fn = AGG_AVG;
+        query->select[2].column = COL_HUMIDITY;
+        query->num_select = 3;
+    }
+
+    if (t < n && strcmp(tokens[t], "where") == 0) {
+        t++;
+        for (;;) {
+            static const char *ops[] = { "=", "!=", "<", "<=", ">", ">=" };
+            struct predicate *pred = &query->where[query->num_where];
+            if (t + 9 < n && strcmp(tokens[t], "bbox") == 0) {
+                /* bbox(lat1, lon1, lat2, lon2) is shorthand for the four
+                 * bounds on lat and lon */
+                double box[4];
+                int k;
+                for (k = 0; k < 4; ++k) {
+                    char *end;
+                    box[k] = strtod(tokens[t + 2 + 2 * k], &end);
+                    if (*end != '\0' || strcmp(tokens[t + 1 + 2 * k], k ? "," : "(") != 0) {
+                        snprintf(error, error_sz, "expected bbox(lat1, lon1, lat2, lon2)");
+                        return 0;
+                    }
+                }
+                if (strcmp(tokens[t + 9], ")") != 0 || query->num_where + 4 > MAX_PREDICATES) {
+                    snprintf(error, error_sz, "expected bbox(lat1, lon1, lat2, lon2)");
+                    return 0;
+                }
+                for (k = 0; k < 4; ++k) {
+                    pred = &query->where[query->num_where++];
+                    pred->column = k % 2 == 0 ? COL_LAT : COL_LON;
+                    pred->op = k < 2 ? OP_GE : OP_LE;
+                    pred->value = k < 2 ? (box[k] < box[k + 2] ? box[k] : box[k + 2])
+                        : (box[k] > box[k - 2] ? box[k] : box[k - 2]);
+                    snprintf(pred->text, sizeof pred->text, "%g", pred->value);
+                }
+                t += 10;
+                if (t < n && strcmp(tokens[t], "and") == 0) {
+                    t++;
+                    continue;
+                }
+                break;
+            }
+            if (t + 2 >= n || query->num_where == MAX_PREDICATES) {
+                snprintf(error, error_sz, "expected a condition");
+                return 0;
+            }
+            pred->column = parse_operand(tokens, n, &t, query, error, error_sz);
+            if (pred->column < 0) {
+                return 0;
+            }
+            t--;                        /* on the operand's last token */
+            if (t + 2 >= n) {
+                snprintf(error, error_sz, "expected a condition");
+                return 0;
+            }
+            int is_text = pred->column == COL_STATE || pred->column == COL_GEOHASH;
+            for (pred->op = OP_EQ; pred->op <= OP_GE; ++pred->op) {
+                if (strcmp(tokens[t + 1], ops[pred->op]) == 0) {
+                    break;
+                }
+            }
+            if (pred->op > OP_GE || (is_text && pred->op > OP_NE)) {
+                snprintf(error, error_sz, "bad operator '%s'", tokens[t + 1]);
+                return 0;
+            }
+            snprintf(pred->text, sizeof pred->text, "%.*s", KEY_SZ - 1, tokens[t + 2]);
+            if (pred->column == COL_TIME) {
+                if (!parse_time(tokens[t + 2], &pred->value)) {
+                    snprintf(error, error_sz, "bad time '%s'", tokens[t + 2]);
+                    return 0;
+                }
+            } else if (!is_text) {
+                char *end;
+                pred->value = strtod(tokens[t + 2], &end);
+                if (*end != '\0') {
+                    snprintf(error, error_sz, "bad number '%s'", tokens[t + 2]);
+                    return 0;
+                }
+            }
+            query->num_where++;
+            t += 3;
+            if (t < n && strcmp(tokens[t], "and") == 0) {
+                t++;
+                continue;
+            }
+            break;
+        }
+    }
+
+    if (t + 1 < n && strcmp(tokens[t], "group") == 0 && strcmp(tokens[t + 1], "by") == 0) {
+        const char *key = t + 2 < n ? tokens[t + 2] : "";
+        if (strcmp(key, "state") == 0) {
+            query->group_by = GROUP_STATE;
+        } else if (strncmp(key, "cell", 4) == 0) {
+            query->group_by = GROUP_CELL;
+            if (key[4] != '\0') {
+                query->precision = atoi(key + 4);
+            }
+            if (query->precision < 1 || query->precision > 12) {
+                snprintf(error, error_sz, "cell precision must be 1 to 12");
+                return 0;
+            }
+        } else if (strcmp(key, "hour") == 0) {
+            query->group_by = GROUP_HOUR;
+        } else if (strcmp(key, "day") == 0) {
+            query->group_by = GROUP_DAY;
+        } else if (strcmp(key, "month") == 0) {
+            query->group_by = GROUP_MONTH;
+        } else if (strcmp(key, "none") != 0) {
+            snprintf(error, error_sz, "cannot group by '%s'", key);
+            return 0;
+        }
+        t += 3;
+    }
+
+    if (t + 1 < n && strcmp(tokens[t], "limit") == 0) {
+        query->limit = atol(tokens[t + 1]);
+        t += 2;
+    }
+    if (t < n) {
+        snprintf(error, error_sz, "unexpected '%s'", tokens[t]);
+        return 0;
+    }
+    return 1;
+}
+
+/* Narrows the rows of a store a query has to look at, using the state and
+ * geohash indexes of a sorted store */
+void query_plan_range(const struct query *query, const struct record_store *store,
+        size_t *begin, size_t *end) {
+    int p;
+
+    *begin = 0;
+    *end = store->count;
+    if (!store->sorted) {
+        return;
+    }
+    for (p = 0; p < query->num_where; ++p) {
+        const struct predicate *pred = &query->where[p];
+        int id;
+        if (pred->op != OP_EQ) {
+            continue;
+        }
+        if (pred->column == COL_STATE) {
+            id = key_table_lookup(&store->state_index, pred->text);
+            if (id < 0) {
+                *begin = *end = 0;
+                return;
+            }
+            if (store->state_end[id] > 0) {
+                *begin = store->state_begin[id];
+                *end = store->state_end[id];
+                return;
+            }
+        } else if (pred->column == COL_GEOHASH && strlen(pred->text) == 12) {
+            id = key_table_lookup(&store->cell_index, pred->text);
+            if (id < 0) {
+                *begin = *end = 0;
+                return;
+            }
+            if (store->cell_end[id] > 0) {
+                *begin = store->cell_begin[id];
+                *end = store->cell_end[id];
+                return;
+            }
+        }
+    }
+}
+
+/* Planned number of rows, used to tell short queries from long ones */
+size_t query_estimate(const struct query *query, struct record_store **stores, int num_stores) {
+    size_t total = 0, begin, end;
+    int s;
+    for (s = 0; s < num_stores; ++s) {
+        query_plan_range(query, stores[s], &begin, &end);
+        total += end - begin;
+    }
+    return total;
+}
+
+/* Whether a row passes one condition of a query, given the values of its
+ * window functions at the row */
+int predicate_matches(const struct predicate *pred, const struct record_store *store,
+        size_t row, const double *windows) {
+    int match;
+
+    if (pred->column == COL_STATE) {
+        match = strcmp(store->code[row], pred->text) == 0;
+        return pred->op == OP_EQ ? match : !match;
+    }
+    if (pred->column == COL_GEOHASH) {
+        /* A geohash prefix names the cell containing it */
+        match = strncmp(store->geohash[row], pred->text, strlen(pred->text)) == 0;
+        return pred->op == OP_EQ ? match : !match;
+    }
+
+    double value = pred->column >= COL_WINDOW ? windows[pred->column - COL_WINDOW]
+        : store->columns[pred->column][row];
+    if (isnan(value)) {
+        return 0;
+    }
+    switch (pred->op) {
+    case OP_EQ: return value == pred->value;
+    case OP_NE: return value != pred->value;
+    case OP_LT: return value < pred->value;
+    case OP_LE: return value <= pred->value;
+    case OP_GT: return value > pred->value;
+    default: return value >= pred->value;
+    }
+}
+
+/* Whether a row passes the conditions of a query */
+int row_matches(const struct query *query, const struct record_store *store, size_t row,
+        const double *windows) {
+    int p;
+    for (p = 0; p < query->num_where; ++p) {
+        if (!predicate_matches(&query->where[p], store, row, windows)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void group_key(const struct query *query, const struct record_store *store, size_t row,
+        char key[KEY_SZ]) {
+    int year, month, day;
+    long time = (long) store->columns[COL_TIME][row];
+
+    switch (query->group_by) {
+    case GROUP_STATE:
+        snprintf(key, KEY_SZ, "%s", store->code[row]);
+        break;
+    case GROUP_CELL:
+        snprintf(key, KEY_SZ, "%.*s", query->precision, store->geohash[row]);
+        break;
+    case GROUP_HOUR:
+    case GROUP_DAY:
+    case GROUP_MONTH:
+        civil_from_days(floor_div(time, 86400), &year, &month, &day);
+        if (query->group_by == GROUP_HOUR) {
+            snprintf(key, KEY_SZ, "%04d-%02d-%02dT%02ld", year, month, day,
+                    floor_div(time, 3600) - floor_div(time, 86400) * 24);
+        } else if (query->group_by == GROUP_DAY) {
+            snprintf(key, KEY_SZ, "%04d-%02d-%02d", year, month, day);
+        } else {
+            snprintf(key, KEY_SZ, "%04d-%02d", year, month);
+        }
+        break;
+    default:
+        strcpy(key, "all");
+    }
+}
+
+void query_run_init(struct query_run *run, const struct query *query,
+        struct record_store **stores, int num_stores, FILE *list_out) {
+    int s;
+
+    memset(run, 0, sizeof *run);
+    run->query = query;
+    run->stores = stores;
+    run->num_stores = num_stores;
+    run->store = -1;
+    key_table_init(&run->groups);
+    run->list_out = list_out;
+
+    /* A geohash's readings have to be one run for window functions, so
+     * segments are merged into a store of the run's own */
+    if (query->num_windows > 0 && num_stores > 1) {
+        run->merged = xrealloc(NULL, sizeof(struct record_store));
+        store_init(run->merged);
+        for (s = 0; s < num_stores; ++s) {
+            store_append_store(run->merged, stores[s]);
+        }
+        run->merged->layout = stores[0]->layout;
+        store_sort(run->merged);
+        run->stores = &run->merged;
+        run->num_stores = 1;
+    }
+}
+
+/* Computes the window functions of a query at a row into
+ * run->window_values. Rows come in increasing order within a store, so
+ * the current geohash's run and the start of each delta span only move
+ * forward: a streaming pass with amortized O(1) work per row. */
+void query_windows(struct query_run *run, const struct record_store *store, size_t row) {
+    const struct query *query = run->query;
+    const double *time = store->columns[COL_TIME];
+    int k;
+
+    if (row < run->part_begin || row >= run->part_end) {
+        size_t begin = row, end = row + 1;
+        while (begin > 0 && store->cell[begin - 1] == store->cell[row]) {
+            begin--;
+        }
+        while (end < store->count && store->cell[end] == store->cell[row]) {
+            end++;
+        }
+        run->part_begin = begin;
+        run->part_end = end;
+        for (k = 0; k < query->num_windows; ++k) {
+            run->window_first[k] = begin;
+        }
+    }
+
+    for (k = 0; k < query->num_windows; ++k) {
+        const struct window_fn *window = &query->windows[k];
+        const double *column = store->columns[window->column];
+        double value = NAN;
+
+        switch (window->fn) {
+        case WIN_LAG:
+            if (row >= run->part_begin + window->offset) {
+                value = column[row - window->offset];
+            }
+            break;
+        case WIN_LEAD:
+            if (row + window->offset < run->part_end) {
+                value = column[row + window->offset];
+            }
+            break;
+        default:
+            if (window->span == 0) {
+                if (row > run->part_begin) {
+                    value = column[row] - column[row - 1];
+                }
+                break;
+            }
+            while (run->window_first[k] < row
+                    && time[run->window_first[k]] < time[row] - window->span) {
+                run->window_first[k]++;
+            }
+            if (run->window_first[k] < row) {
+                value = column[row] - column[run->window_first[k]];
+            }
+        }
+        run->window_values[k] = value;
+    }
+}
+
+void print_row(FILE *out, const struct record_store *store, size_t row) {
+    char when[32];
+    format_utc((long) store->columns[COL_TIME][row], when, sizeof when);
+    fprintf(out, "%s\t%s\t%s\t%.1f\t%.0f\t%.1f\t%.0f\t%.1f\t%.1f\n", store->code[row],
+            when, store->geohash[row], store->columns[COL_HUMIDITY][row],
+            store->columns[COL_SNOW][row], store->columns[COL_CLOUD][row],
+            store->columns[COL_LIGHTNING][row], store->columns[COL_PRESSURE][row],
+            store->columns[COL_TEMP][row]);
+}
+
+/* Folds one matching row into its group. Cells are grouped through the
+ * dictionary ids of the rows, so each geohash is hashed once per query
+ * rather than once per row. */
+void query_accumulate(struct query_run *run, const struct record_store *store, size_t row) {
+    const struct query *query = run->query;
+    char key[KEY_SZ];
+    size_t before = run->groups.count;
+    int a, id;
+
+    if (query->group_by == GROUP_CELL) {
+        unsigned int cell = store->cell[row];
+        if (cell >= run->cell_groups_cap) {
+            size_t cap = run->cell_groups_cap ? run->cell_groups_cap : 1024;
+            while (cap <= cell) {
+                cap *= 2;
+            }
+            run->cell_groups = xrealloc(run->cell_groups, cap * sizeof(int));
+            memset(run->cell_groups + run->cell_groups_cap, 0,
+                    (cap - run->cell_groups_cap) * sizeof(int));
+            run->cell_groups_cap = cap;
+        }
+        if (run->cell_groups[cell] == 0) {
+            group_key(query, store, row, key);
+            run->cell_groups[cell] = key_table_intern(&run->groups, key) + 1;
+        }
+        id = run->cell_groups[cell] - 1;
+    } else {
+        group_key(query, store, row, key);
+        id = key_table_intern(&run->groups, key);
+    }
+    if (run->groups.count > run->accs_cap) {
+        run->accs_cap = run->groups.capacity;
+        run->accs = xrealloc(run->accs, run->accs_cap * sizeof(struct group_acc));
+    }
+
+    struct group_acc *acc = &run->accs[id];
+    if (run->groups.count > before) {
+        group_acc_init(query, acc);
+    }
+    acc->count++;
+    for (a = 0; a < query->num_select; ++a) {
+        int column = query->select[a].column;
+        double value = column >= COL_WINDOW ? run->window_values[column - COL_WINDOW]
+            : store->columns[column][row];
+        if (isnan(value)) {
+            continue;
+        }
+        acc->counts[a]++;
+        switch (query->select[a].fn) {
+        case AGG_SUM:
+        case AGG_AVG:
+            acc->values[a] += value;
+            break;
+        case AGG_MIN:
+            if (value < acc->values[a]) {
+                acc->values[a] = value;
+            }
+            break;
+        case AGG_MAX:
+            if (value > acc->values[a]) {
+                acc->values[a] = value;
+            }
+            break;
+        }
+    }
+}
+
+/* Whether the zone map rules out every row of the zone */
+int zone_excludes(const struct query *query, const struct zone *zone, int layout) {
+    int p;
+    for (p = 0; p < query->num_where; ++p) {
+        const struct predicate *pred = &query->where[p];
+        if (pred->column == COL_STATE) {
+            /* Rows are sorted by state, so the zone covers first..last */
+            if (pred->op == OP_EQ && layout == LAYOUT_STATE
+                    && (strcmp(pred->text, zone->first_code) < 0
+                        || strcmp(pred->text, zone->last_code) > 0)) {
+                return 1;
+            }
+            continue;
+        }
+        if (pred->column >= NUM_COLUMNS) {
+            continue;
+        }
+
+        double min = zone->min[pred->column], max = zone->max[pred->column];
+        int excluded;
+        switch (pred->op) {
+        case OP_EQ: excluded = pred->value < min || pred->value > max; break;
+        case OP_NE: excluded = min == max && min == pred->value; break;
+        case OP_LT: excluded = min >= pred->value; break;
+        case OP_LE: excluded = min > pred->value; break;
+        case OP_GT: excluded = max <= pred->value; break;
+        default: excluded = max < pred->value; break;
+        }
+        if (excluded) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Scans at most max_rows more rows. Returns 1 once the query is done. */
+int query_run_step(struct query_run *run, size_t max_rows) {
+    const struct query *query = run->query;
+    size_t budget = max_rows;
+
+    for (;;) {
+        if (query->list && query->limit > 0 && (long) run->rows_matched >= query->limit) {
+            return 1;
+        }
+        if (run->store < 0 || run->next_row >= run->end_row) {
+            if (++run->store >= run->num_stores) {
+                return 1;
+            }
+            query_plan_range(query, run->stores[run->store], &run->next_row, &run->end_row);
+            run->last_zone = -1;
+            run->part_begin = run->part_end = 0;
+            continue;
+        }
+        if (budget == 0) {
+            return 0;
+        }
+
+        const struct record_store *store = run->stores[run->store];
+        size_t end = run->end_row - run->next_row < budget
+            ? run->end_row : run->next_row + budget;
+        long mark = run->explain != NULL ? trace_now() : 0;
+        size_t row;
+
+        /* Go a zone at a time, passing over zones no row of which can match */
+        if (store->zones != NULL) {
+            size_t zone = run->next_row / ZONE_ROWS;
+            if ((zone + 1) * ZONE_ROWS < end) {
+                end = (zone + 1) * ZONE_ROWS;
+            }
+            if (zone_excludes(query, &store->zones[zone], store->layout)) {
+                if (run->explain != NULL) {
+                    explain_batch(&run->explain[QUERY_ZONES], mark, end - run->next_row, 0,
+                            sizeof(struct zone));
+                }
+                run->rows_skipped += end - run->next_row;
+                run->zones_skipped++;
+                run->next_row = end;
+                continue;
+            }
+            if ((long) zone != run->last_zone) {
+                run->zones_read++;
+                run->last_zone = (long) zone;
+            }
+        }
+        if (run->explain != NULL) {
+            explain_batch(&run->explain[QUERY_ZONES], mark, end - run->next_row,
+                    end - run->next_row, store->zones != NULL ? sizeof(struct zone) : 0);
+            row = query_run_explained(run, store, run->next_row, end);
+        } else if (run->kernel != NULL) {
+            row = query_run_compiled(run, store, run->next_row, end);
+        } else {
+            for (row = run->next_row; row < end; ++row) {
+                if (query->num_windows > 0) {
+                    query_windows(run, store, row);
+                }
+                if (!row_matches(query, store, row, run->window_values)) {
+                    continue;
+                }
+                run->rows_matched++;
+                if (query->list) {
+                    print_row(run->list_out, store, row);
+                    if (query->limit > 0 && (long) run->rows_matched >= query->limit) {
+                        row++;
+                        break;
+                    }
+                } else {
+                    query_accumulate(run, store, row);
+                }
+            }
+        }
+        run->rows_scanned += row - run->next_row;
+        budget -= row - run->next_row;
+        run->next_row = row;
+    }
+}
+
+/* The groups of a run, for sorting them by key */
+const struct key_table *sort_groups;
+
+int compare_groups(const void *a, const void *b) {
+    return strcmp(sort_groups->keys[*(const int *) a], sort_groups->keys[*(const int *) b]);
+}
+
+/* Prints the aggregates of a finished run, one line per group in key order */
+void query_run_output(struct query_run *run, FILE *out) {
+    const struct query *query = run->query;
+    int *order = xrealloc(NULL, (run->groups.count + 1) * sizeof(int));
+    size_t g;
+    int a;
+
+    if (query->list) {
+        free(order);
+        return;
+    }
+
+    fprintf(out, "# group");
+    for (a = 0; a < query->num_select; ++a) {
+        if (query->select[a].fn == AGG_COUNT) {
+            fprintf(out, "\tcount");
+        } else {
+            fprintf(out, "\t%s(%s)", AGG_NAMES[query->select[a].fn],
+                    column_label(query, query->select[a].column));
+        }
+    }
+    fprintf(out, "\n");
+
+    for (g = 0; g < run->groups.count; ++g) {
+        order[g] = (int) g;
+    }
+    sort_groups = &run->groups;
+    qsort(order, run->groups.count, sizeof(int), compare_groups);
+
+    size_t shown = run->groups.count;
+    if (query->limit > 0 && (size_t) query->limit < shown) {
+        shown = (size_t) query->limit;
+    }
+    for (g = 0; g < shown; ++g) {
+        const struct group_acc *acc = &run->accs[order[g]];
+        fprintf(out, "%s", run->groups.keys[order[g]]);
+        for (a = 0; a < query->num_select; ++a) {
+            if (query->select[a].fn != AGG_COUNT && acc->counts[a] == 0) {
+                fprintf(out, "\t-");
+                continue;
+            }
+            switch (query->select[a].fn) {
+            case AGG_COUNT:
+                fprintf(out, "\t%lu", acc->count);
+                break;
+            case AGG_AVG:
+                fprintf(out, "\t%.2f", acc->values[a] / acc->counts[a]);
+                break;
+            default:
+                fprintf(out, "\t%.2f", acc->values[a]);
+            }
+        }
+        fprintf(out, "\n");
+    }
+    free(order);
+}
+
+void group_acc_init(const struct query *query, struct group_acc *acc) {
+    int a;
+    acc->count = 0;
+    for (a = 0; a < query->num_select; ++a) {
+        acc->counts[a] = 0;
+        acc->values[a] = query->select[a].fn == AGG_MIN ? DBL_MAX
+            : query->select[a].fn == AGG_MAX ? -DBL_MAX : 0;
+    }
+}
+
+/* Runs the compiled kernel over rows [begin, end) of a store, the same as
+ * the row loop of query_run_step. Returns the row it stopped at. */
+size_t query_run_compiled(struct query_run *run, const struct record_store *store,
+        size_t begin, size_t end) {
+    const struct query *query = run->query;
+    size_t n, k;
+
+    if (end - begin > run->matches_cap) {
+        run->matches_cap = end - begin;
+        run->matches = xrealloc(run->matches, run->matches_cap * sizeof(size_t));
+    }
+    if (query->group_by == GROUP_NONE && !query->list) {
+        /* The one group only exists once a row has matched */
+        struct group_acc first, *acc = run->groups.count > 0 ? &run->accs[0] : &first;
+        group_acc_init(query, &first);
+        n = run->kernel(begin, end, store->columns, store->code,
+                store->geohash, run->matches, acc);
+        if (acc == &first && n > 0) {
+            key_table_intern(&run->groups, "all");
+            run->accs_cap = run->groups.capacity;
+            run->accs = xrealloc(run->accs, run->accs_cap * sizeof(struct group_acc));
+            run->accs[0] = first;
+        }
+        run->rows_matched += n;
+        return end;
+    }
+
+    n = run->kernel(begin, end, store->columns, store->code,
+            store->geohash, run->matches, NULL);
+    for (k = 0; k < n; ++k) {
+        run->rows_matched++;
+        if (!query->list) {
+            query_accumulate(run, store, run->matches[k]);
+        } else {
+            print_row(run->list_out, store, run->matches[k]);
+            if (query->limit > 0 && (long) run->rows_matched >= query->limit) {
+                return run->matches[k] + 1;
+            }
+        }
+    }
+    return end;
+}
+
+/* The row loop of query_run_step for --explain-analyze. The chunk goes
+ * through one operator at a time (window functions, each condition over
+ * the rows the ones before left, then the aggregates or the listing) so
+ * that each is timed once per chunk; the results are those of the fused
+ * loop. Returns the row it stopped at. */
+size_t query_run_explained(struct query_run *run, const struct record_store *store,
+        size_t begin, size_t end) {
+    const struct query *query = run->query;
+    struct operator_stats *explain = run->explain;
+    size_t n = end - begin, count = n, kept, i, row;
+    long mark = trace_now();
+    int p;
+
+    if (n > run->matches_cap || run->window_rows == NULL) {
+        run->matches_cap = n > run->matches_cap ? n : run->matches_cap;
+        run->matches = xrealloc(run->matches, run->matches_cap * sizeof(size_t));
+        run->window_rows = xrealloc(run->window_rows,
+                run->matches_cap * MAX_WINDOWS * sizeof(double));
+    }
+    for (i = 0; i < n; ++i) {
+        run->matches[i] = begin + i;
+    }
+    if (query->num_windows > 0) {
+        for (i = 0; i < n; ++i) {
+            query_windows(run, store, begin + i);
+            memcpy(&run->window_rows[i * MAX_WINDOWS], run->window_values,
+                    sizeof run->window_values);
+        }
+        mark = explain_batch(&explain[QUERY_WINDOWS], mark, n, n,
+                n * (1 + query->num_windows) * sizeof(double));
+    }
+    for (p = 0; p < query->num_where; ++p) {
+        const struct predicate *pred = &query->where[p];
+        for (i = 0, kept = 0; i < count; ++i) {
+            row = run->matches[i];
+            if (predicate_matches(pred, store, row, &run->window_rows[(row - begin) * MAX_WINDOWS])) {
+                run->matches[kept++] = row;
+            }
+        }
+        mark = explain_batch(&explain[QUERY_FILTERS + p], mark, count, kept, count
+                * (pred->column == COL_STATE ? 3 : pred->column == COL_GEOHASH ? 13 : 8));
+        count = kept;
+    }
+
+    for (i = 0; i < count; ++i) {
+        row = run->matches[i];
+        run->rows_matched++;
+        if (query->list) {
+            print_row(run->list_out, store, row);
+            if (query->limit > 0 && (long) run->rows_matched >= query->limit) {
+                explain_batch(&explain[QUERY_OUTPUT], mark, i + 1, i + 1,
+                        (i + 1) * query_row_bytes(query));
+                return row + 1;
+            }
+        } else {
+            memcpy(run->window_values, &run->window_rows[(row - begin) * MAX_WINDOWS],
+                    sizeof run->window_values);
+            query_accumulate(run, store, row);
+        }
+    }
+    explain_batch(&explain[QUERY_OUTPUT], mark, count, query->list ? count : 0,
+            count * query_row_bytes(query));
+    return end;
+}
+
+/* Prints the operators of a query that ran with --explain-analyze, the
+ * last one first */
+void print_query_explain(const struct query_run *run) {
+    static const char *ops[] = { "=", "!=", "<", "<=", ">", ">=" };
+    static const char *groups[] = { "", " by state", " by cell", " by hour", " by day",
+        " by month" };
+    const struct query *query = run->query;
+    struct operator_stats output = run->explain[QUERY_OUTPUT];
+    char name[96];
+    int depth = 0, p, k;
+
+    fprintf(stderr, "-- Explain analyze --\n");
+    fprintf(stderr, "%-36s %6s %10s %10s %9s %10s %10s\n", "Operator", "Thread", "Rows in",
+            "Rows out", "Selected", "Bytes", "Time");
+    if (query->list) {
+        snprintf(name, sizeof name, "List");
+    } else {
+        output.rows_out = run->groups.count;
+        snprintf(name, sizeof name, "Aggregate%s", groups[query->group_by]);
+    }
+    print_operator(name, depth++, "1", &output);
+    for (p = query->num_where - 1; p >= 0; --p) {
+        const struct predicate *pred = &query->where[p];
+        if (pred->column == COL_STATE || pred->column == COL_GEOHASH) {
+            snprintf(name, sizeof name, "Filter %s %s %s", column_label(query, pred->column),
+                    ops[pred->op], pred->text);
+        } else {
+            snprintf(name, sizeof name, "Filter %s %s %g", column_label(query, pred->column),
+                    ops[pred->op], pred->value);
+        }
+        print_operator(name, depth++, "1", &run->explain[QUERY_FILTERS + p]);
+    }
+    if (query->num_windows > 0) {
+        snprintf(name, sizeof name, "Window");
+        for (k = 0; k < query->num_windows; ++k) {
+            snprintf(name + strlen(name), sizeof name - strlen(name), " %s",
+                    query->windows[k].text);
+        }
+        print_operator(name, depth++, "1", &run->explain[QUERY_WINDOWS]);
+    }
+    snprintf(name, sizeof name, "Zone maps (%lu read, %lu skipped)", run->zones_read,
+            run->zones_skipped);
+    print_operator(name, depth++, "1", &run->explain[QUERY_ZONES]);
+    print_operator("Load segments", depth++, "1", &run->explain[QUERY_LOAD]);
+}
+
+/* Generates the C source of a query's kernel: one loop over the rows with
+ * the predicates and aggregates written out for exactly the columns they
+ * use, so the compiler sees constants and no dispatch. NaN fails every
+ * comparison but != the same way as in row_matches. Returns NULL for
+ * queries the kernels do not cover (window functions) or constants that
+ * cannot be pasted into C as they are: odd strings, inf and nan. */
+char *kernel_source(const struct query *query) {
+    static const char *ops[] = { "==", "!=", "<", "<=", ">", ">=" };
+    char *text = NULL;
+    size_t text_sz = 0;
+    int used[NUM_COLUMNS + 2] = { 0 };
+    int p, a, c;
+    FILE *out;
+
+    if (query->num_windows > 0) {
+        return NULL;
+    }
+    for (p = 0; p < query->num_where; ++p) {
+        const char *value = query->where[p].text;
+        if ((query->where[p].column == COL_STATE || query->where[p].column == COL_GEOHASH)
+                && value[strspn(value, "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
+                        "abcdefghijklmnopqrstuvwxyz")] != '\0') {
+            return NULL;
+        }
+        if (query->where[p].column != COL_STATE && query->where[p].column != COL_GEOHASH
+                && !isfinite(query->where[p].value)) {
+            return NULL;
+        }
+        used[query->where[p].column] = 1;
+    }
+    for (a = 0; a < query->num_select; ++a) {
+        used[query->select[a].column] |= query->select[a].fn != AGG_COUNT
+            && query->group_by == GROUP_NONE && !query->list;
+    }
+
+    out = open_memstream(&text, &text_sz);
+    fprintf(out, "/* Generated by climate query --compile */\n");
+    fprintf(out, "#include <stddef.h>\n#include <string.h>\n\n");
+    fprintf(out, "struct group_acc {\n    unsigned long count;\n"
+            "    unsigned long counts[%d];\n    double values[%d];\n};\n\n",
+            MAX_AGGREGATES, MAX_AGGREGATES);
+    fprintf(out, "size_t climate_kernel(size_t begin, size_t end, double *const *columns,\n"
+            "        char (*code)[3], char (*geohash)[13], size_t *matches,\n"
+            "        struct group_acc *acc) {\n");
+    for (c = 0; c < NUM_COLUMNS; ++c) {
+        if (used[c]) {
+            fprintf(out, "    const double *c%d = columns[%d];\n", c, c);
+        }
+    }
+    fprintf(out, "    size_t row, n = 0;\n\n");
+    fprintf(out, "    (void) columns;\n    (void) code;\n    (void) geohash;\n"
+            "    (void) matches;\n    (void) acc;\n");
+    fprintf(out, "    for (row = begin; row < end; ++row) {\n");
+    for (p = 0; p < query->num_where; ++p) {
+        const struct predicate *pred = &query->where[p];
+        if (pred->column == COL_STATE) {
+            fprintf(out, "        if (strcmp(code[row], \"%s\") %s 0) {\n", pred->text,
+                    pred->op == OP_EQ ? "!=" : "==");
+        } else if (pred->column == COL_GEOHASH) {
+            fprintf(out, "        if (strncmp(geohash[row], \"%s\", %d) %s 0) {\n", pred->text,
+                    (int) strlen(pred->text), pred->op == OP_EQ ? "!=" : "==");
+        } else if (pred->op == OP_NE) {
+            fprintf(out, "        if (c%d[row] != c%d[row] || c%d[row] == %.17g) {\n",
+                    pred->column, pred->column, pred->column, pred->value);
+        } else {
+            fprintf(out, "        if (!(c%d[row] %s %.17g)) {\n", pred->column, ops[pred->op],
+                    pred->value);
+        }
+        fprintf(out, "            continue;\n        }\n");
+    }
+    if (query->group_by != GROUP_NONE || query->list) {
+        fprintf(out, "        matches[n++] = row;\n");
+    } else {
+        fprintf(out, "        n++;\n        acc->count++;\n");
+        for (a = 0; a < query->num_select; ++a) {
+            const struct aggregate *agg = &query->select[a];
+            if (agg->fn == AGG_COUNT) {
+                continue;
+            }
+            fprintf(out, "        if (c%d[row] == c%d[row]) {\n", agg->column, agg->column);
+            fprintf(out, "            acc->counts[%d]++;\n", a);
+            if (agg->fn == AGG_SUM || agg->fn == AGG_AVG) {
+                fprintf(out, "            acc->values[%d] += c%d[row];\n", a, agg->column);
+            } else {
+                fprintf(out, "            if (c%d[row] %s acc->values[%d]) {\n"
+                        "                acc->values[%d] = c%d[row];\n            }\n",
+                        agg->column, agg->fn == AGG_MIN ? "<" : ">", a, a, agg->column);
+            }
+            fprintf(out, "        }\n");
+        }
+    }
+    fprintf(out, "    }\n    return n;\n}\n");
+    fclose(out);
+    return text;
+}
+
+/* Writes the source of a kernel and starts $CC (default cc) on it. Both
+ * files are named after our pid, so processes building the same query
+ * never write over each other. Returns why it could not start, or NULL. */
+const char *start_kernel_build(struct loaded_kernel *entry, const char *source) {
+    const char *cc = getenv("CC") != NULL ? getenv("CC") : "cc";
+    FILE *file = fopen(entry->source, "w");
+
+    if (file == NULL || fputs(source, file) < 0 || fclose(file) != 0) {
+        unlink(entry->source);
+        return "cannot write to the cache directory";
+    }
+    entry->child = fork();
+    if (entry->child == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execlp(cc, cc, "-O2", "-shared", "-fPIC", "-o", entry->object, entry->source,
+                (char *) NULL);
+        _exit(127);
+    }
+    if (entry->child < 0) {
+        entry->child = 0;
+        unlink(entry->source);
+        return "cannot start the compiler";
+    }
+    return NULL;
+}
+
+/* Collects the compiler of a kernel once it has exited (right away unless
+ * wait) and loads what it built. The object is renamed into place, so
+ * concurrent builds of one query never load a half-written one. */
+void finish_kernel_build(struct loaded_kernel *entry, int wait) {
+    const char *reason = NULL;
+    int status = 0;
+    pid_t done = waitpid(entry->child, &status, wait ? 0 : WNOHANG);
+
+    if (done == 0) {
+        return;
+    }
+    entry->child = 0;
+    unlink(entry->source);
+    if (done < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        reason = done > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 127
+            ? "no compiler" : "the compiler failed";
+    } else if (rename(entry->object, entry->path) != 0) {
+        reason = "cannot write to the cache directory";
+    }
+    if (reason != NULL) {
+        unlink(entry->object);
+        fprintf(stderr, "Interpreting the query: %s (%s)\n", reason, entry->path);
+        return;
+    }
+    load_kernel(entry);
+}
+
+void load_kernel(struct loaded_kernel *entry) {
+    void *handle = dlopen(entry->path, RTLD_NOW | RTLD_LOCAL);
+    void *symbol = handle != NULL ? dlsym(handle, "climate_kernel") : NULL;
+
+    if (symbol == NULL) {
+        fprintf(stderr, "Interpreting the query: cannot load the compiled query (%s)\n",
+                entry->path);
+    } else {
+        /* ISO C has no cast from object to function pointers */
+        memcpy(&entry->kernel, &symbol, sizeof symbol);
+    }
+}
+
+/* Returns the compiled kernel of a query, building it if need be. Kernels
+ * are shared objects in dir named by a hash of their source, so a query
+ * that comes back, in this process or a later one, is compiled once.
+ * Without wait the compiler runs in the background and NULL comes back
+ * until a later call finds it done, so serve is never held up by it.
+ * Returns NULL, after saying why, when the query is not covered or cannot
+ * be compiled; it is interpreted then. */
+query_kernel compile_query(const struct query *query, const char *dir, int wait) {
+    static struct loaded_kernel *loaded = NULL;
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    char *source = kernel_source(query);
+    unsigned long long hash = 14695981039346656037ULL;
+    struct loaded_kernel *entry;
+    const char *reason = NULL;
+    size_t k;
+
+    if (source == NULL) {
+        return NULL;
+    }
+    for (k = 0; source[k] != '\0'; ++k) {
+        hash = (hash ^ (unsigned char) source[k]) * 1099511628211ULL;
+    }
+    pthread_mutex_lock(&lock);
+
+    /* Pick up any build that finished since, this query's or not */
+    for (entry = loaded; entry != NULL; entry = entry->next) {
+        if (entry->child != 0) {
+            finish_kernel_build(entry, wait && entry->hash == hash);
+        }
+    }
+    for (entry = loaded; entry != NULL && entry->hash != hash; entry = entry->next) {
+    }
+    if (entry != NULL) {
+        pthread_mutex_unlock(&lock);
+        free(source);
+        return entry->kernel;
+    }
+
+    entry = xrealloc(NULL, sizeof(struct loaded_kernel));
+    memset(entry, 0, sizeof *entry);
+    entry->hash = hash;
+    snprintf(entry->path, sizeof entry->path, "%s/kernel-%016llx.so", dir, hash);
+    if (access(entry->path, R_OK) == 0) {
+        load_kernel(entry);
+    } else {
+        mkdir(dir, 0755);
+        snprintf(entry->source, sizeof entry->source, "%s/kernel-%016llx-%ld.c",
+                dir, hash, (long) getpid());
+        snprintf(entry->object, sizeof entry->object, "%s.%ld",
+                entry->path, (long) getpid());
+        reason = start_kernel_build(entry, source);
+        if (reason != NULL) {
+            fprintf(stderr, "Interpreting the query: %s (%s)\n", reason, entry->path);
+        } else if (wait) {
+            finish_kernel_build(entry, 1);
+        }
+    }
+    entry->next = loaded;
+    loaded = entry;
+    pthread_mutex_unlock(&lock);
+    free(source);
+    return entry->kernel;
+}
+
+void query_run_free(struct query_run *run) {
+    key_table_free(&run->groups);
+    free(run->accs);
+    run->accs = NULL;
+    free(run->matches);
+    run->matches = NULL;
+    free(run->window_rows);
+    run->window_rows = NULL;
+    free(run->cell_groups);
+    run->cell_groups = NULL;
+    if (run->merged != NULL) {
+        store_free(run->merged);
+        free(run->merged);
+        run->merged = NULL;
+    }
+}
+
+/* Bucket of a value: exact below 2^HDR_SUB_BITS, then the top HDR_SUB_BITS
+ * bits of the value within its power of two */
+void hdr_record(struct hdr_histogram *histogram, long micros) {
+    unsigned long value = micros < 0 ? 0 : (unsigned long) micros;
+    int magnitude = 0;
+
+    while ((value >> magnitude) >= (1UL << HDR_SUB_BITS)) {
+        magnitude++;
+    }
+    if (magnitude >= HDR_MAGNITUDES) {
+        magnitude = HDR_MAGNITUDES - 1;
+    }
+    histogram->counts[magnitude][(value >> magnitude) & ((1UL << HDR_SUB_BITS) - 1)]++;
+    histogram->total++;
+    if (micros > histogram->max) {
+        histogram->max = micros;
+    }
+}
+
+/* Smallest recorded value (bucket upper end) with percent of the samples
+ * at or below it */
+long hdr_percentile(const struct hdr_histogram *histogram, double percent) {
+    unsigned long target = (unsigned long) (percent / 100.0 * histogram->total + 0.999999);
+    unsigned long seen = 0;
+    int magnitude, sub;
+
+    if (target == 0) {
+        target = 1;
+    }
+    for (magnitude = 0; magnitude < HDR_MAGNITUDES; ++magnitude) {
+        for (sub = 0; sub < (1 << HDR_SUB_BITS); ++sub) {
+            seen += histogram->counts[magnitude][sub];
+            if (seen >= target && histogram->total > 0) {
+                long upper = (((long) sub + 1) << magnitude) - 1;
+                return upper < histogram->max ? upper : histogram->max;
+            }
+        }
+    }
+    return histogram->max;
+}
+
+/* Scan callback that appends the records of a range to a store */
+void load_range(void *state, struct range_reader *reader) {
+    struct store_loader *loader = state;
+    struct record_batch *batch = xrealloc(NULL, sizeof(struct record_batch));
+
+    while (read_lines(reader, batch) > 0) {
+        long begin = trace_now();
+        tokenize_batch(batch);
+        parse_batch(batch);
+        long parsed = trace_now();
+        store_append_batch(&loader->store, batch, &loader->cache);
+        if (loader->metrics != NULL) {
+            metrics_observe(&loader->metrics->stages[1], parsed - begin);
+            metrics_observe(&loader->metrics->stages[2], trace_now() - parsed);
+            metrics_add(&loader->metrics->rows, batch->count);
+        }
+    }
+    free(batch);
+}
+
+/* Loads TDV files into a store with num_threads loaders, each filling a
+ * store of its own that is then appended to the result. The geohashes get
+ * their ids from dict while the threads scan. metrics, if not NULL, must
+ * come with a single thread. Returns 0 if an input cannot be read. */
+int load_store(struct record_store *store, char *paths[], int num_paths,
+        struct ingest_metrics *metrics, int num_threads, struct geohash_dict *dict) {
+    struct parallel_scan scan;
+    struct store_loader *loaders = xrealloc(NULL, num_threads * sizeof(struct store_loader));
+    void **scan_states = xrealloc(NULL, num_threads * sizeof(void *));
+    int t, ok = 0;
+
+    for (t = 0; t < num_threads; ++t) {
+        store_init(&loaders[t].store);
+        dict_cache_init(&loaders[t].cache, dict);
+        loaders[t].metrics = metrics;
+        scan_states[t] = &loaders[t];
+    }
+    scan.scan = load_range;
+    if (plan_ranges(&scan, paths, num_paths, num_threads)) {
+        ok = run_parallel_scan(&scan, scan_states, num_threads);
+        free(scan.ranges);
+    }
+    for (t = 0; t < num_threads; ++t) {
+        if (ok) {
+            store_append_store(store, &loaders[t].store);
+        }
+        store_free(&loaders[t].store);
+        dict_cache_free(&loaders[t].cache);
+    }
+    free(loaders);
+    free(scan_states);
+    return ok;
+}
+
+/* Adds the rows of one state among rows [begin, end) of a store to a
+ * summary */
+void store_summarize(const struct record_store *store, size_t begin, size_t end,
+        const char *code, struct climate_info *info) {
+    size_t row;
+    for (row = begin; row < end; ++row) {
+        double temperature = store->columns[COL_TEMP][row];
+        long time = (long) store->columns[COL_TIME][row];
+
+        if (strcmp(store->code[row], code) != 0) {
+            continue;
+        }
+        if (info->num_records == 0) {
+            memcpy(info->code, store->code[row], sizeof info->code);
+            info->max_temp = -DBL_MAX;
+            info->min_temp = DBL_MAX;
+        }
+        info->num_records++;
+        info->sum_of_temperature += temperature;
+        info->sum_of_humidity += store->columns[COL_HUMIDITY][row];
+        info->sum_of_cloud_cover += store->columns[COL_CLOUD][row];
+        info->num_lightning_strikes += store->columns[COL_LIGHTNING][row] != 0;
+        info->num_snow += store->columns[COL_SNOW][row] != 0;
+        if (temperature > info->max_temp) {
+            info->max_temp = temperature;
+            info->max_temp_time = time;
+        }
+        if (temperature < info->min_temp) {
+            info->min_temp = temperature;
+            info->min_temp_time = time;
+        }
+    }
+}
+
+/* Queues text for a client; it goes out as the socket accepts it */
+void client_send(struct client *client, const char *text, size_t length) {
+    if (client->fd < 0) {
+        return;
+    }
+    if (client->out_len + length > client->out_cap) {
+        client->out_cap = (client->out_len + length) * 2;
+        client->out = xrealloc(client->out, client->out_cap);
+    }
+    memcpy(client->out + client->out_len, text, length);
+    client->out_len += length;
+}
+
+void client_printf(struct client *client, const char *format, ...) {
+    char line[LINE_SZ];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof line, format, args);
+    va_end(args);
+    if (length >= (int) sizeof line) {
+        length = sizeof line - 1;
+    }
+    client_send(client, line, (size_t) length);
+}
+
+/* Drops a connection. Its tasks are cancelled rather than freed here, so
+ * the scheduler sees them finish. */
+void client_close(struct server *server, int c) {
+    struct task *task;
+    close(server->clients[c].fd);
+    server->clients[c].fd = -1;
+    server->clients[c].in_len = 0;
+    server->clients[c].out_len = 0;
+    for (task = server->tasks; task != NULL; task = task->next) {
+        if (task->client == c && task->connection == server->clients[c].connection
+                && !task->token.cancelled) {
+            task->token.cancelled = 1;
+            task->token.reason = "disconnected";
+        }
+    }
+}
+
+/* Parses one command line of a client into a new task. Commands that need
+ * no scan (cancel, stats, errors) are answered right away. */
+void serve_command(struct server *server, int c, char *line) {
+    struct client *client = &server->clients[c];
+    struct task *task;
+    char error[128];
+    long deadline = 0;
+    int priority = -1;
+
+    for (;;) {
+        while (*line == ' ') {
+            line++;
+        }
+        if (strncmp(line, "deadline=", 9) == 0) {
+            deadline = atol(line + 9);
+        } else if (strncmp(line, "priority=", 9) == 0) {
+            priority = strncmp(line + 9, "high", 4) == 0 ? 0 : 1;
+        } else {
+            break;
+        }
+        line += strcspn(line, " ");
+    }
+    if (*line == '\0') {
+        return;
+    }
+
+    task = xrealloc(NULL, sizeof(struct task));
+    memset(task, 0, sizeof *task);
+    task->id = ++server->next_id;
+    task->client = c;
+    task->connection = client->connection;
+    task->submitted = trace_now();
+    task->deadline = deadline > 0 ? task->submitted + deadline * 1000 : 0;
+
+    if (strncmp(line, "cancel ", 7) == 0) {
+        long id = atol(line + 7);
+        struct task *other;
+        int found = 0;
+        for (other = server->tasks; other != NULL; other = other->next) {
+            if (other->id == id && !other->token.cancelled) {
+                other->token.cancelled = 1;
+                other->token.reason = "cancelled";
+                found = 1;
+            }
+        }
+        client_printf(client, "ACCEPTED %ld\n%s %ld\nEND %ld ok 0\n", task->id,
+                found ? "cancelling" : "no such task", id, task->id);
+        free(task);
+        return;
+    }
+    if (strcmp(line, "stats") == 0) {
+        static const char *classes[2] = { "short", "long" };
+        int k;
+        client_printf(client, "ACCEPTED %ld\n", task->id);
+        for (k = 0; k < 2; ++k) {
+            client_printf(client, "%s\tcount %lu\tp50 %ldus\tp99 %ldus\tp999 %ldus\tmax %ldus\n",
+                    classes[k], server->latency[k].total,
+                    hdr_percentile(&server->latency[k], 50),
+                    hdr_percentile(&server->latency[k], 99),
+                    hdr_percentile(&server->latency[k], 99.9), server->latency[k].max);
+        }
+        client_printf(client, "cancelled\t%lu\nEND %ld ok 0\n", server->cancelled, task->id);
+        free(task);
+        return;
+    }
+
+    if (strncmp(line, "report ", 7) == 0) {
+        task->kind = TASK_REPORT;
+        snprintf(task->arg, sizeof task->arg, "%s", line + 7);
+    } else if (strncmp(line, "lookup", 6) == 0 && (line[6] == ' ' || line[6] == '\0')) {
+        char text[LINE_SZ];
+        const char *key = line + 6 + strspn(line + 6, " ");
+        int ok = 1;
+        if (*key == '\0') {
+            snprintf(error, sizeof error, "lookup needs a geohash");
+            ok = 0;
+        } else {
+            snprintf(text, sizeof text, "select * where geohash = %.*s", KEY_SZ - 1, key);
+            ok = parse_query(text, &task->query, error, sizeof error);
+        }
+        task->kind = TASK_QUERY;
+        if (!ok) {
+            client_printf(client, "ACCEPTED %ld\nerror: %s\nEND %ld error 0\n",
+                    task->id, error, task->id);
+            free(task);
+            return;
+        }
+    } else if (strncmp(line, "query", 5) == 0 && (line[5] == ' ' || line[5] == '\0')) {
+        task->kind = TASK_QUERY;
+        if (!parse_query(line + 5, &task->query, error, sizeof error)) {
+            client_printf(client, "ACCEPTED %ld\nerror: %s\nEND %ld error 0\n",
+                    task->id, error, task->id);
+            free(task);
+            return;
+        }
+    } else {
+        client_printf(client, "ACCEPTED %ld\nerror: unknown command\nEND %ld error 0\n",
+                task->id, task->id);
+        free(task);
+        return;
+    }
+
+    /* The task sees the segments as they are now until it finishes */
+    task->view = acquire_view(&server->set);
+
+    /* Without an explicit priority, small plans go first */
+    if (priority < 0) {
+        priority = task->kind == TASK_REPORT || query_estimate(&task->query,
+                task->view->stores, task->view->num_segments) <= SHORT_ROWS ? 0 : 1;
+    }
+    task->priority = priority;
+    task->next = server->tasks;
+    server->tasks = task;
+    client_printf(client, "ACCEPTED %ld\n", task->id);
+}
+
+/* Next task to get a chunk: higher priority, then earlier deadline, then
+ * arrival order */
+struct task *pick_task(struct server *server) {
+    struct task *task, *best = NULL;
+    for (task = server->tasks; task != NULL; task = task->next) {
+        if (best == NULL || task->priority < best->priority
+                || (task->priority == best->priority
+                    && (task->deadline ? task->deadline : LONG_MAX)
+                        < (best->deadline ? best->deadline : LONG_MAX))
+                || (task->priority == best->priority && task->deadline == best->deadline
+                    && task->id < best->id)) {
+            best = task;
+        }
+    }
+    return best;
+}
+
+/* Runs one chunk of a task. Returns 1 once it has finished, in which case
+ * its result has been queued for the client. */
+int task_step(struct server *server, struct task *task) {
+    int done = 0;
+
+    if (!task->started) {
+        task->out = open_memstream(&task->output, &task->output_sz);
+        if (task->kind == TASK_QUERY) {
+            query_run_init(&task->run, &task->query, task->view->stores,
+                    task->view->num_segments, task->out);
+            if (server->compile_dir != NULL) {
+                task->run.kernel = compile_query(&task->query, server->compile_dir, 0);
+            }
+        }
+        task->started = 1;
+    }
+    if (task->deadline > 0 && trace_now() > task->deadline && !task->token.cancelled) {
+        task->token.cancelled = 1;
+        task->token.reason = "deadline";
+    }
+
+    /* The token is only looked at between chunks */
+    if (!task->token.cancelled) {
+        if (task->kind == TASK_REPORT) {
+            struct climate_info info;
+            int s;
+            memset(&info, 0, sizeof info);
+            for (s = 0; s < task->view->num_segments; ++s) {
+                const struct record_store *store = task->view->stores[s];
+                int id = key_table_lookup(&store->state_index, task->arg);
+                if (id >= 0 && store->state_end[id] > 0) {
+                    store_summarize(store, store->state_begin[id], store->state_end[id],
+                            task->arg, &info);
+                } else if (id >= 0) {
+                    /* Not one run of rows in this layout */
+                    store_summarize(store, 0, store->count, task->arg, &info);
+                }
+            }
+            if (info.num_records > 0) {
+                print_state(task->out, &info, NULL);
+            }
+            done = 1;
+        } else {
+            done = query_run_step(&task->run, CHUNK_ROWS);
+            if (done) {
+                query_run_output(&task->run, task->out);
+            }
+        }
+    }
+    if (!done && !task->token.cancelled) {
+        return 0;
+    }
+
+    fclose(task->out);
+    long micros = trace_now() - task->submitted;
+    struct client *client = &server->clients[task->client];
+    if (task->token.cancelled) {
+        server->cancelled++;
+        /* A client that went away may have left its slot to a new one */
+        if (client->connection == task->connection) {
+            client_printf(client, "END %ld %s %ld\n", task->id, task->token.reason, micros);
+        }
+    } else if (client->connection == task->connection) {
+        hdr_record(&server->latency[task->priority], micros);
+        client_send(client, task->output, task->output_sz);
+        client_printf(client, "END %ld ok %ld\n", task->id, micros);
+    }
+    free(task->output);
+    if (task->kind == TASK_QUERY) {
+        query_run_free(&task->run);
+    }
+    release_view(&server->set, task->view);
+    return 1;
+}
+
+void remove_task(struct server *server, struct task *task) {
+    struct task **link = &server->tasks;
+    while (*link != task) {
+        link = &(*link)->next;
+    }
+    *link = task->next;
+    free(task);
+}
+
+int accept_client(struct server *server) {
+    int fd = accept(server->listen_fd, NULL, NULL);
+    int c;
+
+    if (fd < 0) {
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    for (c = 0; c < server->num_clients && server->clients[c].fd >= 0; ++c) {
+    }
+    if (c == server->num_clients) {
+        server->clients = xrealloc(server->clients,
+                ++server->num_clients * sizeof(struct client));
+        server->clients[c].out = NULL;
+        server->clients[c].out_cap = 0;
+    }
+    server->clients[c].fd = fd;
+    server->clients[c].connection = ++server->next_connection;
+    server->clients[c].in_len = 0;
+    server->clients[c].out_len = 0;
+    return c;
+}
+
+/* Reads what a client has sent and turns each complete line into a task */
+void client_read(struct server *server, int c) {
+    struct client *client = &server->clients[c];
+    ssize_t n = read(client->fd, client->in + client->in_len,
+            sizeof client->in - client->in_len - 1);
+    char *line, *newline;
+
+    if (n <= 0) {
+        client_close(server, c);
+        return;
+    }
+    client->in_len += (size_t) n;
+    client->in[client->in_len] = '\0';
+
+    line = client->in;
+    while ((newline = strchr(line, '\n')) != NULL) {
+        *newline = '\0';
+        if (newline > line && newline[-1] == '\r') {
+            newline[-1] = '\0';
+        }
+        serve_command(server, c, line);
+        line = newline + 1;
+    }
+    client->in_len -= (size_t) (line - client->in);
+    memmove(client->in, line, client->in_len);
+
+    /* A line longer than the buffer can never complete */
+    if (client->in_len == sizeof client->in - 1) {
+        client_close(server, c);
+    }
+}
+
+void client_write(struct server *server, int c) {
+    struct client *client = &server->clients[c];
+    ssize_t n = write(client->fd, client->out, client->out_len);
+    if (n < 0) {
+        client_close(server, c);
+        return;
+    }
+    client->out_len -= (size_t) n;
+    memmove(client->out, client->out + n, client->out_len);
+}
+
+/* Waits for sockets (without blocking when there is work queued), then runs
+ * one chunk of the most urgent task */
+void serve_loop(struct server *server) {
+    struct pollfd *fds = NULL;
+    int c;
+
+    while (!stop_requested) {
+        int num_fds = 1;
+        fds = xrealloc(fds, (server->num_clients + 1) * sizeof(struct pollfd));
+        fds[0].fd = server->listen_fd;
+        fds[0].events = POLLIN;
+        for (c = 0; c < server->num_clients; ++c) {
+            fds[num_fds].fd = server->clients[c].fd;
+            fds[num_fds].events = POLLIN | (server->clients[c].out_len > 0 ? POLLOUT : 0);
+            fds[num_fds].revents = 0;
+            num_fds++;
+        }
+        if (poll(fds, num_fds, server->tasks != NULL ? 0 : 1000) < 0) {
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            accept_client(server);
+        }
+        for (c = 0; c + 1 < num_fds; ++c) {
+            short events = fds[c + 1].revents;
+            if (server->clients[c].fd < 0 || fds[c + 1].fd < 0) {
+                continue;
+            }
+            if (events & POLLOUT) {
+                client_write(server, c);
+            }
+            if (server->clients[c].fd >= 0 && (events & (POLLIN | POLLHUP | POLLERR))) {
+                client_read(server, c);
+            }
+        }
+
+        struct task *task = pick_task(server);
+        if (task != NULL && task_step(server, task)) {
+            remove_task(server, task);
+        }
+    }
+    free(fds);
+}
+
+void serve_usage(const char *name) {
+    printf("Usage: %s serve --listen PORT|SOCKET_PATH [--metrics PORT|SOCKET_PATH] "
+            "[--compile CACHE_DIR] [--store DIR [--fanout N]] [tdv_file1 ... tdv_fileN]\n", name);
+}
+
+/* Entry point of `climate serve` */
+int serve_main(int argc, char *argv[]) {
+    const char *listen_address = NULL, *metrics_address = NULL;
+    struct server *server = xrealloc(NULL, sizeof(struct server));
+    struct metrics_server metrics_server;
+    struct ingest_metrics *blocks[1];
+    pthread_t compactor;
+    int i, k;
+
+    memset(server, 0, sizeof *server);
+    server->set.fanout = DEFAULT_FANOUT;
+    pthread_mutex_init(&server->set.lock, NULL);
+    dict_init(&server->set.dict);
+    for (i = 1; i + 1 < argc && strncmp(argv[i], "--", 2) == 0; i += 2) {
+        if (strcmp(argv[i], "--listen") == 0) {
+            listen_address = argv[i + 1];
+        } else if (strcmp(argv[i], "--metrics") == 0) {
+            metrics_address = argv[i + 1];
+        } else if (strcmp(argv[i], "--store") == 0) {
+            server->set.dir = argv[i + 1];
+        } else if (strcmp(argv[i], "--fanout") == 0 && atoi(argv[i + 1]) >= 2) {
+            server->set.fanout = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--compile") == 0) {
+            server->compile_dir = argv[i + 1];
+        } else {
+            serve_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (listen_address == NULL || (i >= argc) == (server->set.dir == NULL)) {
+        serve_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    blocks[0] = &server->metrics;
+    if (metrics_address != NULL
+            && !start_metrics_server(&metrics_server, metrics_address, "serve", blocks, 1)) {
+        return EXIT_FAILURE;
+    }
+
+    if (server->set.dir != NULL) {
+        /* New segments are picked up and merged by the compaction thread */
+        if (!refresh_view(&server->set, NULL)) {
+            return EXIT_FAILURE;
+        }
+        pthread_create(&compactor, NULL, compaction_thread, &server->set);
+        pthread_detach(compactor);
+    } else {
+        /* Plain files make a single segment that never changes */
+        struct segment *segment = xrealloc(NULL, sizeof(struct segment));
+        memset(segment, 0, sizeof *segment);
+        store_init(&segment->store);
+        if (!load_store(&segment->store, argv + i, argc - i, &server->metrics, 1,
+                    &server->set.dict)) {
+            return EXIT_FAILURE;
+        }
+        store_sort(&segment->store);
+        segment->refs = 1;
+        server->set.current = xrealloc(NULL, sizeof(struct store_view));
+        server->set.current->refs = 1;
+        server->set.current->num_segments = 1;
+        server->set.current->segments = xrealloc(NULL, sizeof(struct segment *));
+        server->set.current->stores = xrealloc(NULL, sizeof(struct record_store *));
+        server->set.current->segments[0] = segment;
+        server->set.current->stores[0] = &segment->store;
+    }
+
+    server->listen_fd = open_listener(listen_address);
+    if (server->listen_fd < 0) {
+        fprintf(stderr, "Could not listen on %s\n", listen_address);
+        return EXIT_FAILURE;
+    }
+    struct store_view *view = acquire_view(&server->set);
+    unsigned long records = 0;
+    for (k = 0; k < view->num_segments; ++k) {
+        records += view->stores[k]->count;
+    }
+    fprintf(stderr, "Serving %lu records in %d segments on %s\n", records,
+            view->num_segments, listen_address);
+    release_view(&server->set, view);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    serve_loop(server);
+
+    for (k = 0; k < 2; ++k) {
+        fprintf(stderr, "%s queries: %lu, p50 %ldus, p99 %ldus, p999 %ldus\n",
+                k == 0 ? "Short" : "Long", server->latency[k].total,
+                hdr_percentile(&server->latency[k], 50),
+                hdr_percentile(&server->latency[k], 99),
+                hdr_percentile(&server->latency[k], 99.9));
+    }
+    close(server->listen_fd);
+    return 0;
+}
+
+void store_free(struct record_store *store) {
+    int c;
+    free(store->code);
+    free(store->geohash);
+    free(store->cell);
+    for (c = 0; c < NUM_COLUMNS; ++c) {
+        free(store->columns[c]);
+    }
+    key_table_free(&store->state_index);
+    key_table_free(&store->cell_index);
+    free(store->state_begin);
+    free(store->state_end);
+    free(store->cell_begin);
+    free(store->cell_end);
+    free(store->zones);
+    store_init(store);
+}
+
+const char SEGMENT_MAGIC[] = "climate-segment 3\n";
+
+void segment_path(const char *dir, long id, char *path, size_t path_sz) {
+    snprintf(path, path_sz, "%s/segment-%06ld.seg", dir, id);
+}
+
+/* Writes a sorted store as a segment file: the magic line, the row count,
+ * zone count and layout, then each column and the zone map as raw arrays.
+ * Geohashes are written as their dictionary ids. The file appears under
+ * its name only once complete. */
+int write_segment(const char *path, const struct record_store *store, unsigned long *bytes) {
+    char temp[PATH_MAX];
+    unsigned long long counts[3];
+    int c, ok;
+
+    snprintf(temp, sizeof temp, "%s.tmp", path);
+    FILE *file = fopen(temp, "wb");
+    if (file == NULL) {
+        return 0;
+    }
+    counts[0] = store->count;
+    counts[1] = store->num_zones;
+    counts[2] = (unsigned long long) store->layout;
+    fwrite(SEGMENT_MAGIC, 1, sizeof SEGMENT_MAGIC - 1, file);
+    fwrite(counts, sizeof counts, 1, file);
+    fwrite(store->code, sizeof(*store->code), store->count, file);
+    fwrite(store->cell, sizeof(unsigned int), store->count, file);
+    for (c = 0; c < NUM_COLUMNS; ++c) {
+        fwrite(store->columns[c], sizeof(double), store->count, file);
+    }
+    fwrite(store->zones, sizeof(struct zone), store->num_zones, file);
+
+    ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    *bytes = (unsigned long) ftell(file);
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temp, path) != 0) {
+        unlink(temp);
+        return 0;
+    }
+    return 1;
+}
+
+/* Reads a segment file back into an empty store, taking the geohashes
+ * from the dictionary of its directory */
+int read_segment(const char *path, struct record_store *store,
+        const struct geohash_dict *dict) {
+    char magic[sizeof SEGMENT_MAGIC];
+    unsigned long long counts[3];
+    size_t row;
+    int c, ok;
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    ok = fread(magic, 1, sizeof SEGMENT_MAGIC - 1, file) == sizeof SEGMENT_MAGIC - 1
+        && memcmp(magic, SEGMENT_MAGIC, sizeof SEGMENT_MAGIC - 1) == 0
+        && fread(counts, sizeof counts, 1, file) == 1;
+    if (ok) {
+        store_reserve(store, (size_t) counts[0] + 1);
+        store->count = (size_t) counts[0];
+        store->num_zones = (size_t) counts[1];
+        store->layout = (int) counts[2];
+        store->zones = xrealloc(NULL, (store->num_zones + 1) * sizeof(struct zone));
+        ok = fread(store->code, sizeof(*store->code), store->count, file) == store->count
+            && fread(store->cell, sizeof(unsigned int), store->count, file) == store->count;
+        for (row = 0; ok && row < store->count; ++row) {
+            ok = store->cell[row] < dict->ids.count;
+            if (ok) {
+                memcpy(store->geohash[row], dict->ids.keys[store->cell[row]],
+                        sizeof store->geohash[row]);
+            }
+        }
+        for (c = 0; ok && c < NUM_COLUMNS; ++c) {
+            ok = fread(store->columns[c], sizeof(double), store->count, file) == store->count;
+        }
+        ok = ok && fread(store->zones, sizeof(struct zone), store->num_zones, file)
+            == store->num_zones;
+    }
+    fclose(file);
+    if (!ok) {
+        fprintf(stderr, "Not a segment file: %s\n", path);
+        return 0;
+    }
+
+    /* Segments are written sorted; only the indexes need rebuilding */
+    store_index(&store->state_index, &store->state_begin, &store->state_end,
+            (const char *) store->code, sizeof(*store->code), store->count);
+    store_index(&store->cell_index, &store->cell_begin, &store->cell_end,
+            (const char *) store->geohash, sizeof(*store->geohash), store->count);
+    store->sorted = 1;
+    return 1;
+}
+
+/* Reads DIR/MANIFEST. A directory without one is an empty store. */
+int read_manifest(const char *dir, struct manifest *manifest) {
+    char path[PATH_MAX], line[LINE_SZ];
+    int cap = 0;
+
+    memset(manifest, 0, sizeof *manifest);
+    manifest->next_id = 1;
+    snprintf(path, sizeof path, "%s/MANIFEST", dir);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return 1;
+    }
+    if (fgets(line, sizeof line, file) == NULL || strcmp(line, "climate-manifest 1\n") != 0) {
+        fprintf(stderr, "Not a manifest: %s\n", path);
+        fclose(file);
+        return 0;
+    }
+    while (fgets(line, sizeof line, file) != NULL) {
+        struct manifest_entry entry;
+        if (strcmp(line, "layout hilbert\n") == 0) {
+            manifest->layout = LAYOUT_HILBERT;
+            continue;
+        }
+        if (sscanf(line, "next %ld", &manifest->next_id) == 1
+                || sscanf(line, "ingested %lu", &manifest->bytes_ingested) == 1
+                || sscanf(line, "written %lu", &manifest->bytes_written) == 1) {
+            continue;
+        }
+        if (sscanf(line, "segment %ld %d %lu %lu", &entry.id, &entry.level,
+                    &entry.rows, &entry.bytes) == 4) {
+            if (manifest->num_entries == cap) {
+                cap = cap ? cap * 2 : 16;
+                manifest->entries = xrealloc(manifest->entries,
+                        cap * sizeof(struct manifest_entry));
+            }
+            manifest->entries[manifest->num_entries++] = entry;
+        }
+    }
+    fclose(file);
+    return 1;
+}
+
+/* Replaces DIR/MANIFEST through a synced temporary file and a rename, so
+ * readers see either the old list of segments or the new one */
+int write_manifest(const char *dir, const struct manifest *manifest) {
+    char path[PATH_MAX], temp[PATH_MAX];
+    int e, ok;
+
+    snprintf(path, sizeof path, "%s/MANIFEST", dir);
+    snprintf(temp, sizeof temp, "%s/MANIFEST.tmp", dir);
+    FILE *file = fopen(temp, "w");
+    if (file == NULL) {
+        return 0;
+    }
+    fprintf(file, "climate-manifest 1\n");
+    fprintf(file, "next %ld\n", manifest->next_id);
+    fprintf(file, "layout %s\n", LAYOUT_NAMES[manifest->layout]);
+    fprintf(file, "ingested %lu\n", manifest->bytes_ingested);
+    fprintf(file, "written %lu\n", manifest->bytes_written);
+    for (e = 0; e < manifest->num_entries; ++e) {
+        const struct manifest_entry *entry = &manifest->entries[e];
+        fprintf(file, "segment %ld %d %lu %lu\n", entry->id, entry->level,
+                entry->rows, entry->bytes);
+    }
+    ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    return ok && rename(temp, path) == 0;
+}
+
+/* Takes the lock that serializes changes to a store directory between
+ * processes (ingest, compact, serve). Returns the descriptor to close. */
+int lock_store(const char *dir) {
+    char path[PATH_MAX];
+    struct flock lock;
+
+    snprintf(path, sizeof path, "%s/LOCK", dir);
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return -1;
+    }
+    memset(&lock, 0, sizeof lock);
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    /* Only a signal is worth waiting again for; a deadlock or a filesystem
+     * without locks would never let us in */
+    while (fcntl(fd, F_SETLKW, &lock) != 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "Could not lock %s: %s\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+struct store_view *acquire_view(struct segment_set *set) {
+    pthread_mutex_lock(&set->lock);
+    struct store_view *view = set->current;
+    view->refs++;
+    pthread_mutex_unlock(&set->lock);
+    return view;
+}
+
+void release_segment(struct segment_set *set, struct segment *segment) {
+    pthread_mutex_lock(&set->lock);
+    int unused = --segment->refs == 0;
+    pthread_mutex_unlock(&set->lock);
+    if (unused) {
+        store_free(&segment->store);
+        free(segment);
+    }
+}
+
+/* Drops a reference to a view, freeing it and any segments no other view
+ * holds */
+void release_view(struct segment_set *set, struct store_view *view) {
+    int s;
+
+    pthread_mutex_lock(&set->lock);
+    int unused = --view->refs == 0;
+    pthread_mutex_unlock(&set->lock);
+    if (!unused) {
+        return;
+    }
+    for (s = 0; s < view->num_segments; ++s) {
+        if (view->segments[s] != NULL) {
+            release_segment(set, view->segments[s]);
+        }
+    }
+    free(view->segments);
+    free(view->stores);
+    free(view);
+}
+
+/* Makes the segments listed in the manifest the current view, reusing
+ * the segments already in memory and fresh (just written, may be NULL),
+ * and reading the others. Must be called with the directory locked or
+ * from a process that owns it. Returns 0 if a segment cannot be read. */
+int refresh_view_locked(struct segment_set *set, const struct manifest *manifest,
+        struct segment *fresh) {
+    struct store_view *old = set->current;
+    struct store_view *view = xrealloc(NULL, sizeof(struct store_view));
+    int e, s;
+
+    view->refs = 1;
+    view->num_segments = manifest->num_entries;
+    view->segments = xrealloc(NULL, (manifest->num_entries + 1) * sizeof(struct segment *));
+    view->stores = xrealloc(NULL, (manifest->num_entries + 1) * sizeof(struct record_store *));
+
+    /* Segments refer to ids added to the dictionary since we last read it */
+    if (!dict_load(set->dir, &set->dict)) {
+        free(view->segments);
+        free(view->stores);
+        free(view);
+        return 0;
+    }
+
+    pthread_mutex_lock(&set->lock);
+    for (e = 0; e < manifest->num_entries; ++e) {
+        struct segment *segment = NULL;
+        if (fresh != NULL && fresh->id == manifest->entries[e].id) {
+            segment = fresh;
+        }
+        for (s = 0; segment == NULL && old != NULL && s < old->num_segments; ++s) {
+            if (old->segments[s]->id == manifest->entries[e].id) {
+                segment = old->segments[s];
+            }
+        }
+        if (segment != NULL) {
+            segment->refs++;
+        }
+        view->segments[e] = segment;
+    }
+    pthread_mutex_unlock(&set->lock);
+
+    /* The reads happen outside the set lock, queries keep running */
+    for (e = 0; e < manifest->num_entries; ++e) {
+        if (view->segments[e] == NULL) {
+            char path[PATH_MAX];
+            struct segment *segment = xrealloc(NULL, sizeof(struct segment));
+            memset(segment, 0, sizeof *segment);
+            store_init(&segment->store);
+            segment_path(set->dir, manifest->entries[e].id, path, sizeof path);
+            if (!read_segment(path, &segment->store, &set->dict)) {
+                store_free(&segment->store);
+                free(segment);
+                release_view(set, view);
+                return 0;
+            }
+            segment->refs = 1;
+            view->segments[e] = segment;
+        }
+        view->segments[e]->id = manifest->entries[e].id;
+        view->segments[e]->level = manifest->entries[e].level;
+        view->segments[e]->bytes = manifest->entries[e].bytes;
+        view->stores[e] = &view->segments[e]->store;
+    }
+
+    pthread_mutex_lock(&set->lock);
+    set->current = view;
+    pthread_mutex_unlock(&set->lock);
+    if (old != NULL) {
+        release_view(set, old);
+    }
+    return 1;
+}
+
+int refresh_view(struct segment_set *set, struct segment *fresh) {
+    struct manifest manifest;
+    int fd = lock_store(set->dir);
+    int ok = fd >= 0 && read_manifest(set->dir, &manifest);
+
+    if (ok) {
+        ok = refresh_view_locked(set, &manifest, fresh);
+        free(manifest.entries);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return ok;
+}
+
+/* Merges the fanout oldest segments of the lowest level that has that many
+ * into one segment of the next level. A higher fanout rewrites each record
+ * fewer times (less write amplification) but leaves more segments for a
+ * query to visit. Returns 1 if it merged something, 0 if there was
+ * nothing to do, -1 on error. */
+int compact_store(struct segment_set *set) {
+    struct manifest manifest;
+    int fd = lock_store(set->dir);
+    int level, e, picked = 0, result = 0;
+
+    if (fd < 0 || !read_manifest(set->dir, &manifest) || !dict_load(set->dir, &set->dict)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    /* Entries are in id order, so the first fanout of a level are oldest */
+    for (level = 0; level < 64 && picked < set->fanout; ++level) {
+        picked = 0;
+        for (e = 0; e < manifest.num_entries; ++e) {
+            picked += manifest.entries[e].level == level;
+        }
+    }
+    level--;
+
+    if (picked >= set->fanout) {
+        struct segment *merged = xrealloc(NULL, sizeof(struct segment));
+        struct store_view *view = set->current != NULL ? acquire_view(set) : NULL;
+        char path[PATH_MAX];
+        int kept = 0, taken = 0, s;
+
+        memset(merged, 0, sizeof *merged);
+        store_init(&merged->store);
+        merged->refs = 1;               /* ours until a view takes it */
+        result = 1;
+        for (e = 0; e < manifest.num_entries && result == 1; ++e) {
+            struct manifest_entry *entry = &manifest.entries[e];
+            if (entry->level != level || taken == set->fanout) {
+                continue;
+            }
+            taken++;
+
+            /* Use the copy in memory when the view has one */
+            struct record_store loaded, *source = NULL;
+            for (s = 0; view != NULL && s < view->num_segments; ++s) {
+                if (view->segments[s]->id == entry->id) {
+                    source = view->stores[s];
+                }
+            }
+            if (source == NULL) {
+                store_init(&loaded);
+                segment_path(set->dir, entry->id, path, sizeof path);
+                if (!read_segment(path, &loaded, &set->dict)) {
+                    result = -1;
+                    break;
+                }
+                source = &loaded;
+            }
+            store_append_store(&merged->store, source);
+            if (source == &loaded) {
+                store_free(&loaded);
+            }
+        }
+        if (view != NULL) {
+            release_view(set, view);
+        }
+
+        if (result == 1) {
+            merged->store.layout = manifest.layout;
+            store_sort(&merged->store);
+            merged->id = manifest.next_id++;
+            merged->level = level + 1;
+            segment_path(set->dir, merged->id, path, sizeof path);
+            if (!write_segment(path, &merged->store, &merged->bytes)) {
+                fprintf(stderr, "Could not write %s\n", path);
+                result = -1;
+            }
+        }
+
+        if (result == 1) {
+            long *removed = xrealloc(NULL, set->fanout * sizeof(long));
+            taken = 0;
+            for (e = 0; e < manifest.num_entries; ++e) {
+                if (manifest.entries[e].level == level && taken < set->fanout) {
+                    removed[taken++] = manifest.entries[e].id;
+                } else {
+                    manifest.entries[kept++] = manifest.entries[e];
+                }
+            }
+            manifest.num_entries = kept;
+            manifest.entries[manifest.num_entries].id = merged->id;
+            manifest.entries[manifest.num_entries].level = merged->level;
+            manifest.entries[manifest.num_entries].rows = merged->store.count;
+            manifest.entries[manifest.num_entries].bytes = merged->bytes;
+            manifest.num_entries++;
+            manifest.bytes_written += merged->bytes;
+
+            /* The old files go only once the manifest no longer names them;
+             * views still using them have their rows in memory */
+            if (write_manifest(set->dir, &manifest)) {
+                for (e = 0; e < taken; ++e) {
+                    segment_path(set->dir, removed[e], path, sizeof path);
+                    unlink(path);
+                }
+                if (set->current != NULL) {
+                    refresh_view_locked(set, &manifest, merged);
+                }
+            } else {
+                segment_path(set->dir, merged->id, path, sizeof path);
+                unlink(path);
+                result = -1;
+            }
+            free(removed);
+        }
+        release_segment(set, merged);
+    }
+
+    free(manifest.entries);
+    close(fd);
+    return result;
+}
+
+/* Background work of `climate serve --store`: picks up segments written by
+ * `climate ingest` and compacts, publishing a new view after each step */
+void *compaction_thread(void *arg) {
+    struct segment_set *set = arg;
+
+    while (!stop_requested) {
+        refresh_view(set, NULL);
+        while (!stop_requested && compact_store(set) == 1) {
+        }
+        poll(NULL, 0, 1000);
+    }
+    return NULL;
+}
+
+/* Appends all rows of one store to another */
+void store_append_store(struct record_store *store, const struct record_store *from) {
+    int c;
+
+    store_reserve(store, store->count + from->count);
+    memcpy(store->code + store->count, from->code, from->count * sizeof(*from->code));
+    memcpy(store->geohash + store->count, from->geohash, from->count * sizeof(*from->geohash));
+    memcpy(store->cell + store->count, from->cell, from->count * sizeof(unsigned int));
+    for (c = 0; c < NUM_COLUMNS; ++c) {
+        memcpy(store->columns[c] + store->count, from->columns[c], from->count * sizeof(double));
+    }
+    store->count += from->count;
+    store->sorted = 0;
+}
+
+int find_layout(const char *name) {
+    int layout;
+    for (layout = LAYOUT_STATE; layout <= LAYOUT_HILBERT; ++layout) {
+        if (strcmp(name, LAYOUT_NAMES[layout]) == 0) {
+            return layout;
+        }
+    }
+    return -1;
+}
+
+void ingest_usage(const char *name) {
+    printf("Usage: %s ingest --store DIR [--layout state|hilbert] [-j threads] "
+            "tdv_file1 ... tdv_fileN\n", name);
+}
+
+/* Entry point of `climate ingest`: adds the inputs to a store directory as
+ * one new level 0 segment, leaving the existing segments untouched */
+int ingest_main(int argc, char *argv[]) {
+    const char *dir = NULL;
+    struct record_store store;
+    struct manifest manifest;
+    struct manifest_entry *entry;
+    struct geohash_dict local, dict;
+    unsigned int *ids;
+    char path[PATH_MAX];
+    unsigned long bytes;
+    size_t row, g;
+    int layout = -1, num_threads = 1;
+    int i;
+
+    for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (strcmp(argv[i], "--store") == 0) {
+            dir = argv[i + 1];
+        } else if (strcmp(argv[i], "--layout") == 0 && find_layout(argv[i + 1]) >= 0) {
+            layout = find_layout(argv[i + 1]);
+        } else if (strcmp(argv[i], "-j") == 0 && atoi(argv[i + 1]) > 0) {
+            num_threads = atoi(argv[i + 1]);
+        } else {
+            ingest_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (dir == NULL || i >= argc) {
+        ingest_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* A new store takes the layout asked for; an existing one keeps its own */
+    if (!read_manifest(dir, &manifest)) {
+        return EXIT_FAILURE;
+    }
+    if (layout >= 0 && manifest.num_entries > 0 && layout != manifest.layout) {
+        fprintf(stderr, "%s uses the %s layout; change it with compact --layout\n",
+                dir, LAYOUT_NAMES[manifest.layout]);
+        return EXIT_FAILURE;
+    }
+    free(manifest.entries);
+
+    /* The ids handed out while loading are our own until we hold the lock */
+    store_init(&store);
+    dict_init(&local);
+    if (!load_store(&store, argv + i, argc - i, NULL, num_threads, &local)) {
+        return EXIT_FAILURE;
+    }
+    store.layout = layout >= 0 ? layout : manifest.layout;
+    store_sort(&store);
+
+    mkdir(dir, 0777);
+    int fd = lock_store(dir);
+    dict_init(&dict);
+    if (fd < 0 || !read_manifest(dir, &manifest) || !dict_load(dir, &dict)) {
+        return EXIT_FAILURE;
+    }
+    ids = xrealloc(NULL, (local.ids.count + 1) * sizeof(unsigned int));
+    for (g = 0; g < local.ids.count; ++g) {
+        ids[g] = dict_intern(&dict, local.ids.keys[g]);
+    }
+    for (row = 0; row < store.count; ++row) {
+        store.cell[row] = ids[store.cell[row]];
+    }
+    free(ids);
+    if (!dict_save(dir, &dict)) {
+        fprintf(stderr, "Could not update %s/DICTIONARY\n", dir);
+        return EXIT_FAILURE;
+    }
+    if (manifest.num_entries == 0) {
+        manifest.layout = store.layout;
+    } else if (manifest.layout != store.layout) {
+        /* Converted while we were loading */
+        store.layout = manifest.layout;
+        store_sort(&store);
+    }
+    long id = manifest.next_id++;
+    segment_path(dir, id, path, sizeof path);
+    if (!write_segment(path, &store, &bytes)) {
+        fprintf(stderr, "Could not write %s\n", path);
+        return EXIT_FAILURE;
+    }
+    manifest.entries = xrealloc(manifest.entries,
+            (manifest.num_entries + 1) * sizeof(struct manifest_entry));
+    entry = &manifest.entries[manifest.num_entries++];
+    entry->id = id;
+    entry->level = 0;
+    entry->rows = store.count;
+    entry->bytes = bytes;
+    manifest.bytes_ingested += bytes;
+    manifest.bytes_written += bytes;
+    if (!write_manifest(dir, &manifest)) {
+        fprintf(stderr, "Could not update %s/MANIFEST\n", dir);
+        unlink(path);
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    printf("Added %lu records as segment %ld (%lu bytes, %lu geohashes in the dictionary)\n",
+            (unsigned long) store.count, id, bytes, (unsigned long) dict.ids.count);
+    return 0;
+}
+
+void compact_usage(const char *name) {
+    printf("Usage: %s compact --store DIR [--fanout N] [--layout state|hilbert]\n", name);
+}
+
+/* Rewrites every segment of a store in another row order, keeping its
+ * level. Returns 0 on error. */
+int relayout_store(const char *dir, int layout) {
+    struct manifest manifest;
+    struct geohash_dict dict;
+    char path[PATH_MAX];
+    int fd = lock_store(dir);
+    int e, ok = 1;
+
+    dict_init(&dict);
+    if (fd < 0 || !read_manifest(dir, &manifest) || !dict_load(dir, &dict)) {
+        return 0;
+    }
+    long first_new = manifest.next_id;
+    for (e = 0; e < manifest.num_entries && ok && manifest.layout != layout; ++e) {
+        struct record_store store;
+        store_init(&store);
+        segment_path(dir, manifest.entries[e].id, path, sizeof path);
+        ok = read_segment(path, &store, &dict);
+        if (ok) {
+            store.layout = layout;
+            store_sort(&store);
+            manifest.entries[e].id = manifest.next_id++;
+            segment_path(dir, manifest.entries[e].id, path, sizeof path);
+            ok = write_segment(path, &store, &manifest.entries[e].bytes);
+            manifest.bytes_written += manifest.entries[e].bytes;
+        }
+        store_free(&store);
+    }
+
+    if (ok && manifest.layout != layout) {
+        struct manifest old;
+        ok = read_manifest(dir, &old);
+        manifest.layout = layout;
+        ok = ok && write_manifest(dir, &manifest);
+        for (e = 0; ok && e < old.num_entries; ++e) {
+            segment_path(dir, old.entries[e].id, path, sizeof path);
+            unlink(path);
+        }
+        free(old.entries);
+    }
+    if (!ok) {
+        /* Leave the old segments; drop the half-done new ones */
+        long id;
+        for (id = first_new; id < manifest.next_id; ++id) {
+            segment_path(dir, id, path, sizeof path);
+            unlink(path);
+        }
+    }
+    free(manifest.entries);
+    key_table_free(&dict.ids);
+    close(fd);
+    return ok;
+}
+
+/* Entry point of `climate compact`: compacts a store directory until no
+ * level has fanout segments, then prints its segments */
+int compact_main(int argc, char *argv[]) {
+    struct segment_set set;
+    struct manifest manifest;
+    int i, e, merges = 0, result, layout = -1;
+
+    memset(&set, 0, sizeof set);
+    set.fanout = DEFAULT_FANOUT;
+    pthread_mutex_init(&set.lock, NULL);
+    dict_init(&set.dict);
+    for (i = 1; i + 1 < argc && strncmp(argv[i], "--", 2) == 0; i += 2) {
+        if (strcmp(argv[i], "--store") == 0) {
+            set.dir = argv[i + 1];
+        } else if (strcmp(argv[i], "--fanout") == 0 && atoi(argv[i + 1]) >= 2) {
+            set.fanout = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--layout") == 0 && find_layout(argv[i + 1]) >= 0) {
+            layout = find_layout(argv[i + 1]);
+        } else {
+            compact_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (set.dir == NULL || i != argc) {
+        compact_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (layout >= 0 && !relayout_store(set.dir, layout)) {
+        fprintf(stderr, "Could not change the layout of %s\n", set.dir);
+        return EXIT_FAILURE;
+    }
+
+    while ((result = compact_store(&set)) == 1) {
+        merges++;
+    }
+    if (result < 0 || !read_manifest(set.dir, &manifest)) {
+        return EXIT_FAILURE;
+    }
+
+    printf("Merges: %d (%s layout)\n", merges, LAYOUT_NAMES[manifest.layout]);
+    for (e = 0; e < manifest.num_entries; ++e) {
+        printf("segment %ld: level %d, %lu records, %lu bytes\n", manifest.entries[e].id,
+                manifest.entries[e].level, manifest.entries[e].rows, manifest.entries[e].bytes);
+    }
+    if (manifest.bytes_ingested > 0) {
+        printf("Write amplification: %.2f\n",
+                (double) manifest.bytes_written / manifest.bytes_ingested);
+    }
+    return 0;
+}
+
+/* Bytes per row of the columns a query reads */
+unsigned long query_row_bytes(const struct query *query) {
+    int used[NUM_COLUMNS + 2] = { 0 };
+    unsigned long bytes = 0;
+    int i;
+
+    for (i = 0; i < query->num_where; ++i) {
+        if (query->where[i].column < COL_WINDOW) {
+            used[query->where[i].column] = 1;
+        }
+    }
+    for (i = 0; i < query->num_select && !query->list; ++i) {
+        if (query->select[i].column < COL_WINDOW) {
+            used[query->select[i].column] |= query->select[i].fn != AGG_COUNT;
+        }
+    }
+    for (i = 0; i < query->num_windows; ++i) {
+        used[query->windows[i].column] = 1;
+        used[COL_TIME] |= query->windows[i].span > 0;
+    }
+    used[COL_TIME] |= query->group_by >= GROUP_HOUR;
+    used[COL_STATE] |= query->group_by == GROUP_STATE;
+    used[COL_GEOHASH] |= query->group_by == GROUP_CELL;
+    if (query->list) {
+        for (i = 0; i < NUM_COLUMNS + 2; ++i) {
+            used[i] = 1;
+        }
+    }
+    for (i = 0; i < NUM_COLUMNS; ++i) {
+        bytes += used[i] * sizeof(double);
+    }
+    bytes += used[COL_STATE] * 3 + used[COL_GEOHASH] * 13;
+    return bytes > 0 ? bytes : 1;
+}
+
+void query_usage(const char *name) {
+    printf("Usage: %s query --store DIR [--compile CACHE_DIR] [--explain-analyze] \"QUERY\"\n",
+            name);
+}
+
+/* Entry point of `climate query`: one query over all segments of a store
+ * directory */
+int query_main(int argc, char *argv[]) {
+    struct segment_set set;
+    struct query query;
+    struct query_run run;
+    const char *compile_dir = NULL;
+    struct operator_stats explain[NUM_QUERY_OPERATORS];
+    int use_explain = 0;
+    char error[128];
+    int i;
+
+    memset(&set, 0, sizeof set);
+    pthread_mutex_init(&set.lock, NULL);
+    dict_init(&set.dict);
+    for (i = 1; i + 1 < argc && strncmp(argv[i], "--", 2) == 0; i += 2) {
+        if (strcmp(argv[i], "--store") == 0) {
+            set.dir = argv[i + 1];
+        } else if (strcmp(argv[i], "--compile") == 0) {
+            compile_dir = argv[i + 1];
+        } else if (strcmp(argv[i], "--explain-analyze") == 0) {
+            use_explain = 1;
+            i--;
+        } else {
+            query_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (set.dir == NULL || i + 1 != argc) {
+        query_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (!parse_query(argv[i], &query, error, sizeof error)) {
+        fprintf(stderr, "Bad query: %s\n", error);
+        return EXIT_FAILURE;
+    }
+    memset(explain, 0, sizeof explain);
+    long begin = trace_now();
+    if (!refresh_view(&set, NULL)) {
+        return EXIT_FAILURE;
+    }
+
+    struct store_view *view = acquire_view(&set);
+    query_run_init(&run, &query, view->stores, view->num_segments, stdout);
+    if (use_explain) {
+        /* Loading is counted as the operator under the scan */
+        for (i = 0; i < view->num_segments; ++i) {
+            explain[QUERY_LOAD].rows_in += view->stores[i]->count;
+            explain[QUERY_LOAD].bytes += view->segments[i]->bytes;
+        }
+        explain[QUERY_LOAD].rows_out = explain[QUERY_LOAD].rows_in;
+        explain[QUERY_LOAD].micros = trace_now() - begin;
+        run.explain = explain;
+        if (compile_dir != NULL) {
+            fprintf(stderr, "Interpreting the query, as --explain-analyze times its operators\n");
+            compile_dir = NULL;
+        }
+    }
+    if (compile_dir != NULL) {
+        run.kernel = compile_query(&query, compile_dir, 1);
+    }
+    begin = trace_now();
+    while (!query_run_step(&run, CHUNK_ROWS)) {
+    }
+    long micros = trace_now() - begin;
+    query_run_output(&run, stdout);
+    unsigned long row_bytes = query_row_bytes(&query);
+    fprintf(stderr, "%d segments, %lu rows scanned, %lu skipped by zone maps, %s in %ld us\n",
+            view->num_segments, run.rows_scanned, run.rows_skipped,
+            run.kernel != NULL ? "compiled" : "interpreted", micros);
+    if (use_explain) {
+        print_query_explain(&run);
+    }
+    fprintf(stderr, "%lu zones read, %lu skipped: %lu of %lu pages of the columns used\n",
+            run.zones_read, run.zones_skipped,
+            (run.rows_scanned * row_bytes + PAGE_SZ - 1) / PAGE_SZ,
+            ((run.rows_scanned + run.rows_skipped) * row_bytes + PAGE_SZ - 1) / PAGE_SZ);
+    query_run_free(&run);
+    release_view(&set, view);
+    return 0;
+}
+
+/* Writes the lines ingested since the last commit as one log record,
+ * together with the offset each input has been consumed to */
+int wal_commit(struct wal *wal, const struct follower *followers, int num_followers) {
+    struct wal_header header;
+    size_t offsets_sz = num_followers * sizeof(long long);
+    int f;
+
+    if (wal->lines_len == 0) {
+        return 1;
+    }
+
+    char *record = xrealloc(NULL, sizeof header + offsets_sz + wal->lines_len);
+    long long *offsets = (long long *) (record + sizeof header);
+    for (f = 0; f < num_followers; ++f) {
+        /* A partial line is not in the log, so it has to be read again */
+        offsets[f] = followers[f].offset - (long long) followers[f].pending_len;
+    }
+    memcpy(record + sizeof header + offsets_sz, wal->lines, wal->lines_len);
+
+    memset(&header, 0, sizeof header);
+    header.magic = WAL_MAGIC;
+    header.length = (unsigned int) (offsets_sz + wal->lines_len);
+    header.seq = ++wal->seq;
+    header.checksum = hash64(record + sizeof header, header.length, 14695981039346656037ULL);
+    memcpy(record, &header, sizeof header);
+
+    size_t total = sizeof header + header.length;
+    ssize_t written = write(wal->fd, record, total);
+    free(record);
+    if (written != (ssize_t) total) {
+        fprintf(stderr, "Could not write the WAL in %s\n", wal->dir);
+        return 0;
+    }
+    wal->size += (long) total;
+    wal->lines_len = 0;
+
+    /* Group commit: several rounds can share one fsync */
+    if (wal->sync_every > 0 && ++wal->unsynced >= wal->sync_every) {
+        fsync(wal->fd);
+        wal->unsynced = 0;
+    }
+    return 1;
+}
+
+/* Saves the accumulators and input offsets as of the last record, then
+ * empties the log. A crash between the two is harmless: replay skips the
+ * records the checkpoint already covers. */
+int wal_checkpoint(struct wal *wal, const struct follower *followers, int num_followers,
+        struct climate_info **states) {
+    char path[PATH_MAX], temp[PATH_MAX];
+    int f, ok;
+
+    if (!wal_commit(wal, followers, num_followers)) {
+        return 0;
+    }
+    snprintf(path, sizeof path, "%s/checkpoint", wal->dir);
+    snprintf(temp, sizeof temp, "%s/checkpoint.tmp", wal->dir);
+    FILE *file = fopen(temp, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write %s\n", temp);
+        return 0;
+    }
+    fprintf(file, "climate-checkpoint 1\t%lld\t%d\n", wal->seq, num_followers);
+    for (f = 0; f < num_followers; ++f) {
+        fprintf(file, "%ld\t%s\n", followers[f].offset - (long) followers[f].pending_len,
+                followers[f].path);
+    }
+    write_snapshot(file, states, NUM_STATES);
+    ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temp, path) != 0) {
+        fprintf(stderr, "Could not write %s\n", path);
+        return 0;
+    }
+
+    /* The descriptor is not O_APPEND: without the seek the next record
+     * would land at the old offset, past a hole of zeros */
+    if (ftruncate(wal->fd, 0) != 0 || lseek(wal->fd, 0, SEEK_SET) < 0) {
+        fprintf(stderr, "Could not truncate %s/wal\n", wal->dir);
+        return 0;
+    }
+    fsync(wal->fd);
+    wal->size = 0;
+    wal->unsynced = 0;
+    return 1;
+}
+
+/* Loads the checkpoint of a WAL directory, if there is one. Returns the
+ * sequence number it covers, 0 without a checkpoint, -1 on error. */
+long long read_checkpoint(const char *dir, long long *offsets, struct follower *followers,
+        int num_followers, struct climate_info **states) {
+    char path[PATH_MAX], line[PATH_MAX + 32];
+    long long seq;
+    int count, f;
+
+    snprintf(path, sizeof path, "%s/checkpoint", dir);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+    if (fgets(line, sizeof line, file) == NULL
+            || sscanf(line, "climate-checkpoint 1\t%lld\t%d", &seq, &count) != 2
+            || count != num_followers) {
+        fprintf(stderr, "%s was written for other inputs\n", path);
+        fclose(file);
+        return -1;
+    }
+    for (f = 0; f < num_followers; ++f) {
+        char *data[2];
+        if (fgets(line, sizeof line, file) == NULL || split_fields(line, data, 2) < 2
+                || strcmp(data[1], followers[f].path) != 0) {
+            fprintf(stderr, "%s was written for other inputs\n", path);
+            fclose(file);
+            return -1;
+        }
+        offsets[f] = atoll(data[0]);
+    }
+    if (read_snapshot(file, states, NUM_STATES) < 0) {
+        fprintf(stderr, "Bad checkpoint: %s\n", path);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    return seq;
+}
+
+/* Restores the state of the last run from DIR: the checkpoint, then every
+ * later log record. A record cut short by a crash ends the log. Then each
+ * input is positioned at the offset the state corresponds to. */
+int wal_open(struct wal *wal, struct follower *followers, int num_followers,
+        struct climate_info **states, struct record_batch *batch,
+        struct ingest_metrics *metrics) {
+    char path[PATH_MAX];
+    long long *offsets = xrealloc(NULL, num_followers * sizeof(long long));
+    size_t offsets_sz = num_followers * sizeof(long long);
+    char *payload = NULL;
+    size_t payload_cap = 0;
+    unsigned long replayed = 0;
+    int f;
+
+    long begin = trace_now();
+    mkdir(wal->dir, 0777);
+    for (f = 0; f < num_followers; ++f) {
+        offsets[f] = 0;
+    }
+    long long covered = read_checkpoint(wal->dir, offsets, followers, num_followers, states);
+    if (covered < 0) {
+        return 0;
+    }
+    wal->seq = covered;
+
+    snprintf(path, sizeof path, "%s/wal", wal->dir);
+    wal->fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (wal->fd < 0) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return 0;
+    }
+
+    for (;;) {
+        struct wal_header header;
+        if (read(wal->fd, &header, sizeof header) != (ssize_t) sizeof header
+                || header.magic != WAL_MAGIC || header.length < offsets_sz) {
+            break;
+        }
+        if (header.length > payload_cap) {
+            payload_cap = header.length;
+            payload = xrealloc(payload, payload_cap);
+        }
+        if (read(wal->fd, payload, header.length) != (ssize_t) header.length
+                || hash64(payload, header.length, 14695981039346656037ULL) != header.checksum) {
+            break;
+        }
+        wal->size += (long) (sizeof header + header.length);
+        if (header.seq <= covered) {
+            continue;
+        }
+
+        /* Feed the logged lines through the normal batch path */
+        char *line = payload + offsets_sz, *end = payload + header.length;
+        while (line < end) {
+            char *newline = memchr(line, '\n', end - line);
+            size_t length = (newline != NULL ? newline : end) - line;
+            if (length >= LINE_SZ) {
+                length = LINE_SZ - 1;
+            }
+            memcpy(batch->text[batch->count], line, length);
+            batch->text[batch->count][length] = '\0';
+            replayed++;
+            if (++batch->count == BATCH_SZ) {
+                process_batch(batch, states, metrics);
+            }
+            line = newline != NULL ? newline + 1 : end;
+        }
+        memcpy(offsets, payload, offsets_sz);
+        wal->seq = header.seq;
+    }
+    if (batch->count > 0) {
+        process_batch(batch, states, metrics);
+    }
+    free(payload);
+
+    /* Drop a torn tail so new records follow the last good one */
+    if (ftruncate(wal->fd, wal->size) != 0 || lseek(wal->fd, wal->size, SEEK_SET) < 0) {
+        return 0;
+    }
+
+    for (f = 0; f < num_followers; ++f) {
+        if (!followers[f].is_pipe && offsets[f] > 0) {
+            lseek(followers[f].fd, offsets[f], SEEK_SET);
+            followers[f].offset = (long) offsets[f];
+        }
+    }
+    free(offsets);
+    if (covered > 0 || replayed > 0) {
+        fprintf(stderr, "Recovered from %s: %lu logged records replayed in %.1f ms\n",
+                wal->dir, replayed, (trace_now() - begin) / 1000.0);
+    }
+    return 1;
+}
+
+void generate_usage(const char *name) {
+    printf("Usage: %s generate --rows N [--cells 5000] [--seed 1]\n", name);
+}
+
+/* Entry point of `climate generate`: writes synthetic TDV records for
+ * testing at sizes beyond the sample data. Cells cluster around one
+ * random center per state across the contiguous US; readings are 6-hourly
+ * through 2015 in random order, with temperatures following the season
+ * and the latitude. */
+int generate_main(int argc, char *argv[]) {
+    long rows = 0, num_cells = 5000, r;
+    unsigned long long seed = 1;
+    struct rng rng;
+    int i, s;
+
+    for (i = 1; i + 1 < argc && strncmp(argv[i], "--", 2) == 0; i += 2) {
+        if (strcmp(argv[i], "--rows") == 0) {
+            rows = atol(argv[i + 1]);
+        } else if (strcmp(argv[i], "--cells") == 0) {
+            num_cells = atol(argv[i + 1]);
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            seed = strtoull(argv[i + 1], NULL, 10);
+        } else {
+            generate_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (rows <= 0 || num_cells <= 0 || i != argc) {
+        generate_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int num_codes = (int) (strlen(STATE_CODES) + 1) / 3;
+    double *center_lat = xrealloc(NULL, num_codes * sizeof(double));
+    double *center_lon = xrealloc(NULL, num_codes * sizeof(double));
+    char (*cells)[13] = xrealloc(NULL, num_cells * sizeof(*cells));
+    int *cell_state = xrealloc(NULL, num_cells * sizeof(int));
+    double *cell_lat = xrealloc(NULL, num_cells * sizeof(double));
+
+    rng_seed(&rng, seed);
+    for (s = 0; s < num_codes; ++s) {
+        center_lat[s] = 27 + rng_uniform(&rng) * 20;
+        center_lon[s] = -122 + rng_uniform(&rng) * 50;
+    }
+    for (r = 0; r < num_cells; ++r) {
+        s = (int) rng_below(&rng, num_codes);
+        double lat = center_lat[s] + (rng_uniform(&rng) + rng_uniform(&rng) - 1) * 2;
+        double lon = center_lon[s] + (rng_uniform(&rng) + rng_uniform(&rng) - 1) * 3;
+        geohash_encode(lat, lon, 12, cells[r]);
+        cell_state[r] = s;
+        cell_lat[r] = lat;
+    }
+
+    long start = days_from_civil(2015, 1, 1) * 86400L;
+    for (r = 0; r < rows; ++r) {
+        long cell = (long) rng_below(&rng, num_cells);
+        long slot = (long) rng_below(&rng, 365 * 4);
+        double day = slot / 4.0;
+        double season = 1 - (day > 196 ? day - 196 : 196 - day) / 182;
+        double kelvin = 262 + 32 * season - (cell_lat[cell] - 25) * 0.6
+            + (rng_uniform(&rng) - 0.5) * 12;
+        int snow = kelvin < 272 && rng_below(&rng, 4) == 0;
+        int lightning = kelvin > 290 && rng_below(&rng, 20) == 0;
+
+        printf("%.2s\t%ld000\t%s\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.5f\n",
+                STATE_CODES + 3 * cell_state[cell], start + slot * 21600, cells[cell],
+                (double) rng_below(&rng, 101), (double) snow, (double) rng_below(&rng, 101),
+                (double) lightning, 95000.0 + rng_below(&rng, 8000), kelvin);
+    }
+
+    free(center_lat);
+    free(center_lon);
+    free(cells);
+    free(cell_state);
+    free(cell_lat);
+    return 0;
+}
+
+/* Starts `gzip -LEVEL` writing to fd and returns the write end of its
+ * input. Our end is not inherited by the other gzip processes, or none of
+ * them would see its input end before all were closed. */
+int spawn_compressor(int fd, int level, pid_t *child) {
+    char flag[8];
+    int fds[2];
+
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    snprintf(flag, sizeof flag, "-%d", level);
+    *child = fork();
+    if (*child < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (*child == 0) {
+        dup2(fds[0], STDIN_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        close(fds[0]);
+        close(fd);
+        execlp("gzip", "gzip", flag, "-c", (char *) NULL);
+        _exit(127);
+    }
+    close(fds[0]);
+    return fds[1];
+}
+
+/* Opens OUTDIR/KEY.tdv for appending, through gzip when level > 0.
+ * Appending gzip output makes a multi-member file, which gzip -d reads as
+ * one stream. */
+int open_partition(struct partition *partition, const char *dir, int level) {
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof path, "%s/%s.tdv%s", dir, partition->key, level > 0 ? ".gz" : "");
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return 0;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    partition->child = 0;
+    partition->fd = fd;
+    if (level > 0) {
+        partition->fd = spawn_compressor(fd, level, &partition->child);
+        close(fd);
+        if (partition->fd < 0) {
+            fprintf(stderr, "Could not start gzip for %s\n", path);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        data += n;
+        len -= (size_t) n;
+    }
+    return 1;
+}
+
+void *partition_writer_run(void *arg) {
+    struct partition_writer *writer = arg;
+
+    pthread_mutex_lock(&writer->lock);
+    for (;;) {
+        while (writer->head == NULL && !writer->closing) {
+            pthread_cond_wait(&writer->cond, &writer->lock);
+        }
+        struct write_job *job = writer->head;
+        if (job == NULL) {
+            break;
+        }
+        writer->head = job->next;
+        if (writer->head == NULL) {
+            writer->tail = NULL;
+        }
+        pthread_mutex_unlock(&writer->lock);
+
+        int ok = write_all(job->fd, job->data, job->len);
+
+        pthread_mutex_lock(&writer->lock);
+        writer->failed |= !ok;
+        writer->queued--;
+        job->next = writer->spare;
+        writer->spare = job;
+        pthread_cond_broadcast(&writer->cond);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+/* Hands the buffer of a partition to its writer, waiting while the writer
+ * is PARTITION_QUEUE buffers behind, and gives the partition an empty
+ * buffer, reused when the writer has one */
+void partition_flush(struct partition *partition, struct partition_writer *writers) {
+    struct partition_writer *writer = &writers[partition->writer];
+    struct write_job *job;
+
+    if (partition->len == 0) {
+        return;
+    }
+    pthread_mutex_lock(&writer->lock);
+    while (writer->queued >= PARTITION_QUEUE) {
+        pthread_cond_wait(&writer->cond, &writer->lock);
+    }
+    job = writer->spare;
+    if (job != NULL) {
+        writer->spare = job->next;
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    char *empty;
+    if (job != NULL) {
+        empty = job->data;
+    } else {
+        job = xrealloc(NULL, sizeof(struct write_job));
+        empty = xrealloc(NULL, PARTITION_BUFFER_SZ);
+    }
+    job->fd = partition->fd;
+    job->data = partition->buffer;
+    job->len = partition->len;
+    job->next = NULL;
+    partition->buffer = empty;
+    partition->len = 0;
+
+    pthread_mutex_lock(&writer->lock);
+    if (writer->tail != NULL) {
+        writer->tail->next = job;
+    } else {
+        writer->head = job;
+    }
+    writer->tail = job;
+    writer->queued++;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+/* Partition key of a line: its state, or the UTC month of its time.
+ * Returns 0 for a line that has no usable key. */
+int partition_key(const char *line, size_t len, int by_month, char key[KEY_SZ]) {
+    const char *tab = memchr(line, '\t', len);
+    size_t i;
+
+    if (tab == NULL || tab == line) {
+        return 0;
+    }
+    if (by_month) {
+        int year, month, day;
+        char *end;
+        long long millis = strtoll(tab + 1, &end, 10);
+        if (end == tab + 1 || *end != '\t') {
+            return 0;
+        }
+        civil_from_days(floor_div((long) (millis / 1000), 86400), &year, &month, &day);
+        snprintf(key, KEY_SZ, "%04d-%02d", year, month);
+        return 1;
+    }
+    if ((size_t) (tab - line) >= KEY_SZ) {
+        return 0;
+    }
+    /* The key becomes a file name */
+    for (i = 0; line + i < tab; ++i) {
+        if (!isalnum((unsigned char) line[i])) {
+            return 0;
+        }
+        key[i] = line[i];
+    }
+    key[i] = '\0';
+    return 1;
+}
+
+void partition_usage(const char *name) {
+    printf("Usage: %s partition --by state|month [--gzip LEVEL] [-j threads] "
+            "OUTDIR tdv_file1 ... tdv_fileN\n", name);
+}
+
+/* Entry point of `climate partition`: one pass over the inputs, each line
+ * copied into the buffer of its partition. Lines of the same key usually
+ * come in runs, so the last key is checked before the table. */
+int partition_main(int argc, char *argv[]) {
+    struct key_table keys;
+    struct partition *partitions = NULL;
+    struct partition_writer *writers;
+    size_t partitions_cap = 0, p;
+    char last_key[KEY_SZ] = "", key[KEY_SZ];
+    int by_month = -1, level = 0, num_writers = online_cpus();
+    int last = -1, ok = 1;
+    unsigned long lines = 0, bad_lines = 0, bytes = 0;
+    int i, w;
+
+    for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (strcmp(argv[i], "--by") == 0 && strcmp(argv[i + 1], "state") == 0) {
+            by_month = 0;
+        } else if (strcmp(argv[i], "--by") == 0 && strcmp(argv[i + 1], "month") == 0) {
+            by_month = 1;
+        } else if (strcmp(argv[i], "--gzip") == 0 && atoi(argv[i + 1]) >= 1
+                && atoi(argv[i + 1]) <= 9) {
+            level = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-j") == 0 && atoi(argv[i + 1]) > 0) {
+            num_writers = atoi(argv[i + 1]);
+        } else {
+            partition_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (by_month < 0 || i + 1 >= argc) {
+        partition_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *dir = argv[i++];
+    mkdir(dir, 0777);
+    signal(SIGPIPE, SIG_IGN);
+
+    writers = xrealloc(NULL, num_writers * sizeof(struct partition_writer));
+    memset(writers, 0, num_writers * sizeof(struct partition_writer));
+    for (w = 0; w < num_writers; ++w) {
+        pthread_mutex_init(&writers[w].lock, NULL);
+        pthread_cond_init(&writers[w].cond, NULL);
+        pthread_create(&writers[w].thread, NULL, partition_writer_run, &writers[w]);
+    }
+    key_table_init(&keys);
+    char *block = xrealloc(NULL, INPUT_BUFFER_SZ + LINE_SZ);
+    long started = trace_now();
+
+    for (; i < argc && ok; ++i) {
+        struct input input;
+        size_t have = 0, got;
+
+        if (!open_input(&input, argv[i])) {
+            fprintf(stderr, "Could not read %s\n", argv[i]);
+            ok = 0;
+            break;
+        }
+        /* Whole lines from large blocks; a partial line moves to the front */
+        while (ok && (got = fread(block + have, 1, INPUT_BUFFER_SZ + LINE_SZ - have,
+                        input.file)) + have > 0) {
+            size_t end = have + got, pos = 0;
+            int at_eof = got == 0;
+
+            for (;;) {
+                char *newline = memchr(block + pos, '\n', end - pos);
+                size_t len;
+                if (newline != NULL) {
+                    len = (size_t) (newline - (block + pos)) + 1;
+                } else if (at_eof || end - pos == INPUT_BUFFER_SZ + LINE_SZ) {
+                    len = end - pos;        /* unterminated or overlong */
+                } else {
+                    break;
+                }
+                if (len == 0) {
+                    break;
+                }
+
+                const char *line = block + pos;
+                pos += len;
+                lines++;
+                if (!partition_key(line, len, by_month, key)) {
+                    bad_lines++;
+                    continue;
+                }
+                if (last < 0 || strcmp(key, last_key) != 0) {
+                    size_t before = keys.count;
+                    last = key_table_intern(&keys, key);
+                    strcpy(last_key, key);
+                    if (keys.count > before) {
+                        if (keys.count > partitions_cap) {
+                            partitions_cap = keys.capacity;
+                            partitions = xrealloc(partitions,
+                                    partitions_cap * sizeof(struct partition));
+                        }
+                        struct partition *partition = &partitions[last];
+                        memset(partition, 0, sizeof *partition);
+                        strcpy(partition->key, key);
+                        partition->writer = last % num_writers;
+                        partition->buffer = xrealloc(NULL, PARTITION_BUFFER_SZ);
+                        if (!open_partition(partition, dir, level)) {
+                            partition->fd = -1;
+                            ok = 0;
+                            break;
+                        }
+                    }
+                }
+
+                /* A last line without its newline gets one, or the next run
+                 * would append to it */
+                struct partition *partition = &partitions[last];
+                int terminated = line[len - 1] == '\n';
+                if (partition->len + len + !terminated > PARTITION_BUFFER_SZ) {
+                    partition_flush(partition, writers);
+                }
+                memcpy(partition->buffer + partition->len, line, len);
+                partition->len += len;
+                if (!terminated) {
+                    partition->buffer[partition->len++] = '\n';
+                }
+                partition->lines++;
+                partition->bytes += len + !terminated;
+                bytes += len;
+            }
+            memmove(block, block + pos, end - pos);
+            have = end - pos;
+            if (at_eof) {
+                break;
+            }
+        }
+        ok = close_input(&input) && ok;
+    }
+
+    /* The last buffers, then every writer drains its queue and stops */
+    for (p = 0; p < keys.count; ++p) {
+        if (partitions[p].fd >= 0) {
+            partition_flush(&partitions[p], writers);
+        }
+    }
+    for (w = 0; w < num_writers; ++w) {
+        pthread_mutex_lock(&writers[w].lock);
+        writers[w].closing = 1;
+        pthread_cond_broadcast(&writers[w].cond);
+        pthread_mutex_unlock(&writers[w].lock);
+        pthread_join(writers[w].thread, NULL);
+        ok = ok && !writers[w].failed;
+        while (writers[w].spare != NULL) {
+            struct write_job *job = writers[w].spare;
+            writers[w].spare = job->next;
+            free(job->data);
+            free(job);
+        }
+    }
+    for (p = 0; p < keys.count; ++p) {
+        int status = 0;
+        if (partitions[p].fd >= 0) {
+            close(partitions[p].fd);
+        }
+        if (partitions[p].child > 0) {
+            waitpid(partitions[p].child, &status, 0);
+            ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        }
+        free(partitions[p].buffer);
+    }
+    double seconds = (trace_now() - started) / 1e6;
+
+    if (!ok) {
+        fprintf(stderr, "Could not write all partitions to %s\n", dir);
+    }
+    for (p = 0; p < keys.count; ++p) {
+        printf("%s: %lu lines, %lu bytes\n", partitions[p].key, partitions[p].lines,
+                partitions[p].bytes);
+    }
+    printf("Partitioned %lu lines (%lu without a key) into %lu files in %.2fs, %.1f MB/s\n",
+            lines, bad_lines, (unsigned long) keys.count, seconds,
+            seconds > 0 ? bytes / seconds / 1e6 : 0.0);
+
+    free(block);
+    free(partitions);
+    free(writers);
+    key_table_free(&keys);
+    return ok ? 0 : EXIT_FAILURE;
+}
+
+void deque_push(struct extreme_deque *deque, long time, double value) {
+    size_t mask, i;
+
+    /* Readings no better than the new one can never be the extreme again */
+    while (deque->len > 0) {
+        double back = deque->values[(deque->head + deque->len - 1) & (deque->cap - 1)];
+        if (deque->is_max ? back > value : back < value) {
+            break;
+        }
+        deque->len--;
+    }
+    if (deque->len == deque->cap) {
+        size_t cap = deque->cap ? deque->cap * 2 : 64;
+        long *times = xrealloc(NULL, cap * sizeof(long));
+        double *values = xrealloc(NULL, cap * sizeof(double));
+        for (i = 0; i < deque->len; ++i) {
+            times[i] = deque->times[(deque->head + i) & (deque->cap - 1)];
+            values[i] = deque->values[(deque->head + i) & (deque->cap - 1)];
+        }
+        free(deque->times);
+        free(deque->values);
+        deque->times = times;
+        deque->values = values;
+        deque->cap = cap;
+        deque->head = 0;
+    }
+    mask = deque->cap - 1;
+    deque->times[(deque->head + deque->len) & mask] = time;
+    deque->values[(deque->head + deque->len) & mask] = value;
+    deque->len++;
+}
+
+/* Drops the readings at or before cutoff from the front */
+void deque_expire(struct extreme_deque *deque, long cutoff) {
+    while (deque->len > 0 && deque->times[deque->head] <= cutoff) {
+        deque->head = (deque->head + 1) & (deque->cap - 1);
+        deque->len--;
+    }
+}
+
+void rolling_usage(const char *name) {
+    printf("Usage: %s rolling [--size 24h] [--output FILE] [-j threads] "
+            "tdv_file1 ... tdv_fileN\n", name);
+}
+
+/* Entry point of `climate rolling`. The store sorts the records into one
+ * time-ordered run per location; each run is a stream through a max and
+ * a min deque, which never hold more than the readings of one window. */
+int rolling_main(int argc, char *argv[]) {
+    struct record_store store;
+    struct geohash_dict dict;
+    struct extreme_deque high, low;
+    const char *output = NULL, *size_text = "24h";
+    FILE *out = NULL;
+    long size = 86400;
+    int num_threads = 1;
+    size_t row, begin, end;
+    int i;
+
+    for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (strcmp(argv[i], "--size") == 0) {
+            size = parse_duration(argv[i + 1]);
+            size_text = argv[i + 1];
+        } else if (strcmp(argv[i], "--output") == 0) {
+            output = argv[i + 1];
+        } else if (strcmp(argv[i], "-j") == 0 && atoi(argv[i + 1]) > 0) {
+            num_threads = atoi(argv[i + 1]);
+        } else {
+            rolling_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (i >= argc || size <= 0) {
+        rolling_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    store_init(&store);
+    dict_init(&dict);
+    if (!load_store(&store, argv + i, argc - i, NULL, num_threads, &dict)) {
+        return EXIT_FAILURE;
+    }
+    store_sort(&store);
+    if (output != NULL) {
+        out = fopen(output, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Could not write %s\n", output);
+            return EXIT_FAILURE;
+        }
+        fprintf(out, "# state\ttime\tgeohash\ttemp\tlow\thigh\n");
+    }
+
+    memset(&high, 0, sizeof high);
+    memset(&low, 0, sizeof low);
+    high.is_max = 1;
+
+    /* Per state: locations, records, sums of highs and lows, largest range */
+    unsigned long locations = 0, records = 0;
+    double sum_high = 0, sum_low = 0, max_range = -1;
+    size_t max_range_row = 0;
+    size_t most_held = 0;
+
+    for (begin = 0; begin < store.count; begin = end) {
+        end = begin + 1;
+        while (end < store.count && store.cell[end] == store.cell[begin]
+                && strcmp(store.code[end], store.code[begin]) == 0) {
+            end++;
+        }
+        high.len = 0;
+        low.len = 0;
+        locations++;
+        for (row = begin; row < end; ++row) {
+            long time = (long) store.columns[COL_TIME][row];
+            double temperature = store.columns[COL_TEMP][row];
+
+            deque_push(&high, time, temperature);
+            deque_push(&low, time, temperature);
+            deque_expire(&high, time - size);
+            deque_expire(&low, time - size);
+
+            double max = high.values[high.head], min = low.values[low.head];
+            records++;
+            sum_high += max;
+            sum_low += min;
+            if (max - min > max_range) {
+                max_range = max - min;
+                max_range_row = row;
+            }
+            most_held = high.len > most_held ? high.len : most_held;
+            most_held = low.len > most_held ? low.len : most_held;
+            if (out != NULL) {
+                char when[32];
+                format_utc(time, when, sizeof when);
+                fprintf(out, "%s\t%s\t%s\t%.1f\t%.1f\t%.1f\n", store.code[row], when,
+                        store.geohash[row], temperature, min, max);
+            }
+        }
+
+        /* States are runs too; report one when the next row leaves it */
+        if (end == store.count || strcmp(store.code[end], store.code[begin]) != 0) {
+            char when[32];
+            format_utc((long) store.columns[COL_TIME][max_range_row], when, sizeof when);
+            printf("-- State: %s --\n", store.code[begin]);
+            printf("Locations: %lu\n", locations);
+            printf("Average %s high: %.1fF\n", size_text, sum_high / records);
+            printf("Average %s low: %.1fF\n", size_text, sum_low / records);
+            printf("Largest %s range: %.1fF at %s on %s\n", size_text, max_range,
+                    store.geohash[max_range_row], when);
+            locations = 0;
+            records = 0;
+            sum_high = 0;
+            sum_low = 0;
+            max_range = -1;
+        }
+    }
+    fprintf(stderr, "Window %lds: at most %lu readings held per deque\n", size,
+            (unsigned long) most_held);
+
+    if (out != NULL && fclose(out) != 0) {
+        fprintf(stderr, "Could not write %s\n", output);
+        return EXIT_FAILURE;
+    }
+    free(high.times);
+    free(high.values);
+    free(low.times);
+    free(low.values);
+    store_free(&store);
+    key_table_free(&dict.ids);
+    return 0;
+}
+
+/* Reads the next line of a join input that has a geohash and a time.
+ * Returns 0 at the end of the input. */
+int read_join_row(struct input *input, struct join_row *row, unsigned long *count) {
+    char line[LINE_SZ];
+    char *data[NUM_FIELDS];
+
+    while (fgets(line, sizeof line, input->file) != NULL) {
+        if (split_fields(line, data, NUM_FIELDS) < NUM_FIELDS || data[1][0] == '\0'
+                || data[2][0] == '\0') {
+            continue;
+        }
+        snprintf(row->code, sizeof row->code, "%s", data[0]);
+        snprintf(row->geohash, sizeof row->geohash, "%s", data[2]);
+        row->time = floor_div(atol(data[1]), 1000);
+        row->has = 0;
+        if (data[8][0] != '\0') {
+            row->values[0] = atof(data[8]) * 1.8 - 459.67;
+            row->has |= 1;
+        }
+        if (data[3][0] != '\0') {
+            row->values[1] = atof(data[3]);
+            row->has |= 2;
+        }
+        (*count)++;
+        return 1;
+    }
+    return 0;
+}
+
+/* Orders rows by geohash, then time */
+int join_compare(const struct join_row *a, const struct join_row *b) {
+    int c = strcmp(a->geohash, b->geohash);
+    if (c != 0) {
+        return c;
+    }
+    return a->time < b->time ? -1 : a->time > b->time;
+}
+
+struct join_errors *join_errors_of(struct key_table *table, struct join_errors **errors,
+        size_t *cap, const char *key, const char *code) {
+    size_t before = table->count;
+    int id = key_table_intern(table, key);
+    if (table->count > *cap) {
+        *cap = table->capacity;
+        *errors = xrealloc(*errors, *cap * sizeof(struct join_errors));
+    }
+    if (table->count > before) {
+        memset(&(*errors)[id], 0, sizeof(struct join_errors));
+        memcpy((*errors)[id].code, code, sizeof (*errors)[id].code);
+    }
+    return &(*errors)[id];
+}
+
+void join_pair(struct join_context *ctx, const struct join_row *observed,
+        const struct join_row *forecast) {
+    struct join_errors *errors[2];
+    int num_errors = 1, e, v;
+
+    errors[0] = join_errors_of(&ctx->states, &ctx->state_errors, &ctx->states_cap,
+            observed->code, observed->code);
+    if (ctx->by_cell) {
+        char cell[KEY_SZ];
+        snprintf(cell, sizeof cell, "%.*s", ctx->precision, observed->geohash);
+        errors[num_errors++] = join_errors_of(&ctx->cells, &ctx->cell_errors,
+                &ctx->cells_cap, cell, observed->code);
+    }
+    ctx->pairs++;
+    for (e = 0; e < num_errors; ++e) {
+        errors[e]->pairs++;
+        for (v = 0; v < 2; ++v) {
+            if (observed->has & forecast->has & (1 << v)) {
+                double error = forecast->values[v] - observed->values[v];
+                errors[e]->n[v]++;
+                errors[e]->sum[v] += error;
+                errors[e]->sum_abs[v] += error < 0 ? -error : error;
+                errors[e]->sum_sq[v] += error * error;
+            }
+        }
+    }
+}
+
+/* Streams both sorted inputs side by side. A forecast stays current until
+ * an observation passes it, so repeated observations of one key all pair
+ * with it; later forecasts for the same key are skipped. Returns 0 if
+ * either input turns out not to be sorted. */
+int merge_join(struct join_context *ctx, struct input *observed, struct input *forecast,
+        char *paths[]) {
+    struct join_row o, f, next;
+    int have_o = read_join_row(observed, &o, &ctx->observations);
+    int have_f = read_join_row(forecast, &f, &ctx->forecasts);
+
+    while (have_o) {
+        int c = have_f ? join_compare(&o, &f) : -1;
+        if (c == 0) {
+            join_pair(ctx, &o, &f);
+        }
+        if (c <= 0) {
+            have_o = read_join_row(observed, &next, &ctx->observations);
+            if (have_o && join_compare(&next, &o) < 0) {
+                fprintf(stderr, "%s is not sorted at %s %ld; leave out --sorted to "
+                        "hash-join it\n", paths[0], next.geohash, next.time);
+                return 0;
+            }
+            o = next;
+            continue;
+        }
+        while ((have_f = read_join_row(forecast, &next, &ctx->forecasts))) {
+            c = join_compare(&next, &f);
+            if (c < 0) {
+                fprintf(stderr, "%s is not sorted at %s %ld; leave out --sorted to "
+                        "hash-join it\n", paths[1], next.geohash, next.time);
+                return 0;
+            }
+            if (c > 0) {
+                break;
+            }
+            ctx->duplicates++;
+        }
+        f = next;
+    }
+
+    /* The rest of the forecasts only count */
+    while (have_f && read_join_row(forecast, &next, &ctx->forecasts)) {
+    }
+    return 1;
+}
+
+/* Splits both inputs by geohash into temporary files of binary rows, then
+ * joins one partition at a time: its forecasts go into an open-addressing
+ * table on (geohash, time) and its observations probe it. Only one
+ * partition of forecasts is ever in memory. Returns 0 on an I/O error. */
+int hash_join(struct join_context *ctx, struct input *observed, struct input *forecast,
+        int num_partitions) {
+    FILE **parts = xrealloc(NULL, 2 * num_partitions * sizeof(FILE *));
+    struct join_row row, *rows = NULL;
+    size_t rows_cap = 0, most_rows = 0, num_rows, slot, mask = 0;
+    size_t *table = NULL;
+    int p, side, ok = 1;
+
+    for (p = 0; p < 2 * num_partitions; ++p) {
+        parts[p] = tmpfile();
+        if (parts[p] == NULL) {
+            fprintf(stderr, "Could not create a temporary file\n");
+            while (p-- > 0) {
+                fclose(parts[p]);
+            }
+            free(parts);
+            return 0;
+        }
+    }
+    for (side = 0; side < 2; ++side) {
+        struct input *input = side == 0 ? observed : forecast;
+        unsigned long *count = side == 0 ? &ctx->observations : &ctx->forecasts;
+        while (read_join_row(input, &row, count)) {
+            p = side * num_partitions + (int) (hash_key(row.geohash) % num_partitions);
+            ok = ok && fwrite(&row, sizeof row, 1, parts[p]) == 1;
+        }
+    }
+
+    for (p = 0; ok && p < num_partitions; ++p) {
+        FILE *observations = parts[p], *forecasts = parts[num_partitions + p];
+
+        rewind(forecasts);
+        num_rows = 0;
+        while (fread(&row, sizeof row, 1, forecasts) == 1) {
+            if (num_rows == rows_cap) {
+                rows_cap = rows_cap ? rows_cap * 2 : 4096;
+                rows = xrealloc(rows, rows_cap * sizeof(struct join_row));
+            }
+            rows[num_rows++] = row;
+        }
+        most_rows = num_rows > most_rows ? num_rows : most_rows;
+
+        /* Load factor at most one half; slots hold row + 1, or 0. The table
+         * exists even for a partition without forecasts, for the probes. */
+        if (table == NULL || num_rows * 2 > mask) {
+            for (mask = 1; mask < num_rows * 2; mask <<= 1) {
+            }
+            free(table);
+            table = xrealloc(NULL, mask * sizeof(size_t));
+            mask--;
+        }
+        memset(table, 0, (mask + 1) * sizeof(size_t));
+        size_t r;
+        for (r = 0; r < num_rows; ++r) {
+            slot = (hash_key(rows[r].geohash) ^ (unsigned long) rows[r].time * 2654435761UL) & mask;
+            while (table[slot] != 0 && join_compare(&rows[table[slot] - 1], &rows[r]) != 0) {
+                slot = (slot + 1) & mask;
+            }
+            if (table[slot] != 0) {
+                ctx->duplicates++;
+            } else {
+                table[slot] = r + 1;
+            }
+        }
+
+        rewind(observations);
+        while (fread(&row, sizeof row, 1, observations) == 1) {
+            slot = (hash_key(row.geohash) ^ (unsigned long) row.time * 2654435761UL) & mask;
+            while (table[slot] != 0) {
+                if (join_compare(&rows[table[slot] - 1], &row) == 0) {
+                    join_pair(ctx, &row, &rows[table[slot] - 1]);
+                    break;
+                }
+                slot = (slot + 1) & mask;
+            }
+        }
+        ok = ok && !ferror(observations) && !ferror(forecasts);
+    }
+    if (!ok) {
+        fprintf(stderr, "Could not read or write a temporary file\n");
+    }
+    fprintf(stderr, "Hash join over %d partitions, at most %lu forecasts in memory\n",
+            num_partitions, (unsigned long) most_rows);
+
+    for (p = 0; p < 2 * num_partitions; ++p) {
+        fclose(parts[p]);
+    }
+    free(parts);
+    free(rows);
+    free(table);
+    return ok;
+}
+
+/* Prints the errors of one state, or one line of the --cells file */
+void print_join_errors(FILE *out, const struct join_errors *errors, int as_tdv) {
+    const char *names[2] = { "Temperature", "Humidity" };
+    const char *units[2] = { "F", "%" };
+    int v;
+
+    if (!as_tdv) {
+        fprintf(out, "Pairs: %lu\n", errors->pairs);
+    }
+    for (v = 0; v < 2; ++v) {
+        double n = (double) errors->n[v];
+        if (as_tdv && errors->n[v] == 0) {
+            fprintf(out, "\t-\t-\t-");
+        } else if (as_tdv) {
+            fprintf(out, "\t%.3f\t%.3f\t%.3f", errors->sum[v] / n, errors->sum_abs[v] / n,
+                    math_sqrt(errors->sum_sq[v] / n));
+        } else if (errors->n[v] == 0) {
+            fprintf(out, "%s: no pairs with both values\n", names[v]);
+        } else {
+            fprintf(out, "%s bias: %+.2f%s, MAE: %.2f%s, RMSE: %.2f%s\n", names[v],
+                    errors->sum[v] / n, units[v], errors->sum_abs[v] / n, units[v],
+                    math_sqrt(errors->sum_sq[v] / n), units[v]);
+        }
+    }
+    if (as_tdv) {
+        fprintf(out, "\n");
+    }
+}
+
+void join_usage(const char *name) {
+    printf("Usage: %s join [--sorted] [--partitions 64] [--cells FILE [--precision N]] "
+            "observed.tdv forecast.tdv\n", name);
+}
+
+/* Entry point of `climate join` */
+int join_main(int argc, char *argv[]) {
+    struct join_context ctx;
+    struct input observed, forecast;
+    const char *cells = NULL;
+    int sorted = 0, num_partitions = 64;
+    size_t id, a, b;
+    int i, ok;
+
+    memset(&ctx, 0, sizeof ctx);
+    key_table_init(&ctx.states);
+    key_table_init(&ctx.cells);
+    ctx.precision = 12;
+    for (i = 1; i < argc && strncmp(argv[i], "--", 2) == 0; i += 2) {
+        if (strcmp(argv[i], "--sorted") == 0) {
+            sorted = 1;
+            i--;
+        } else if (i + 1 >= argc) {
+            break;
+        } else if (strcmp(argv[i], "--partitions") == 0) {
+            num_partitions = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--cells") == 0) {
+            cells = argv[i + 1];
+            ctx.by_cell = 1;
+        } else if (strcmp(argv[i], "--precision") == 0) {
+            ctx.precision = atoi(argv[i + 1]);
+        } else {
+            join_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - i != 2 || num_partitions < 1 || num_partitions > 512 || ctx.precision < 1
+            || ctx.precision > 12) {
+        join_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (!open_input(&observed, argv[i])) {
+        fprintf(stderr, "File does not exist: %s\n", argv[i]);
+        return EXIT_FAILURE;
+    }
+    if (!open_input(&forecast, argv[i + 1])) {
+        fprintf(stderr, "File does not exist: %s\n", argv[i + 1]);
+        return EXIT_FAILURE;
+    }
+
+    if (sorted) {
+        ok = merge_join(&ctx, &observed, &forecast, argv + i);
+    } else {
+        ok = hash_join(&ctx, &observed, &forecast, num_partitions);
+    }
+    ok = close_input(&observed) && ok;
+    ok = close_input(&forecast) && ok;
+    if (!ok) {
+        return EXIT_FAILURE;
+    }
+
+    printf("Observations: %lu, forecasts: %lu, pairs: %lu (%.1f%% of observations)\n",
+            ctx.observations, ctx.forecasts, ctx.pairs,
+            ctx.observations ? 100.0 * ctx.pairs / ctx.observations : 0.0);
+    if (ctx.duplicates > 0) {
+        printf("Skipped %lu repeated forecasts for the same geohash and time\n",
+                ctx.duplicates);
+    }
+
+    /* The two joins meet the states in different orders; print them sorted */
+    size_t *order = xrealloc(NULL, (ctx.states.count + 1) * sizeof(size_t));
+    for (a = 0; a < ctx.states.count; ++a) {
+        for (b = a; b > 0 && strcmp(ctx.states.keys[order[b - 1]], ctx.states.keys[a]) > 0; --b) {
+            order[b] = order[b - 1];
+        }
+        order[b] = a;
+    }
+    for (a = 0; a < ctx.states.count; ++a) {
+        printf("-- State: %s --\n", ctx.states.keys[order[a]]);
+        print_join_errors(stdout, &ctx.state_errors[order[a]], 0);
+    }
+    free(order);
+
+    if (cells != NULL) {
+        FILE *out = fopen(cells, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Could not write %s\n", cells);
+            return EXIT_FAILURE;
+        }
+        fprintf(out, "# cell\tstate\tpairs\ttemp_bias\ttemp_mae\ttemp_rmse"
+                "\thumidity_bias\thumidity_mae\thumidity_rmse\n");
+        for (id = 0; id < ctx.cells.count; ++id) {
+            fprintf(out, "%s\t%s\t%lu", ctx.cells.keys[id], ctx.cell_errors[id].code,
+                    ctx.cell_errors[id].pairs);
+            print_join_errors(out, &ctx.cell_errors[id], 1);
+        }
+        if (fclose(out) != 0) {
+            fprintf(stderr, "Could not write %s\n", cells);
+            return EXIT_FAILURE;
+        }
+    }
+
+    key_table_free(&ctx.states);
+    key_table_free(&ctx.cells);
+    free(ctx.state_errors);
+    free(ctx.cell_errors);
+    return 0;
+}
+
+/* Folds a reading into the extremes of one block, growing the slots to
+ * reach it */
+void block_add(struct cell_blocks *cell, long block, float high, float low) {
+    if (cell->num_blocks == 0 || block < cell->first_block
+            || block >= cell->first_block + (long) cell->num_blocks) {
+        long first = cell->num_blocks == 0 || block < cell->first_block ? block : cell->first_block;
+        long last = cell->num_blocks == 0 ? block : cell->first_block + (long) cell->num_blocks - 1;
+        last = block > last ? block : last;
+        size_t num = (size_t) (last - first + 1), b;
+        float *highs = xrealloc(NULL, num * sizeof(float));
+        float *lows = xrealloc(NULL, num * sizeof(float));
+        for (b = 0; b < num; ++b) {
+            highs[b] = NAN;
+            lows[b] = NAN;
+        }
+        if (cell->num_blocks > 0) {
+            memcpy(highs + (cell->first_block - first), cell->highs, cell->num_blocks * sizeof(float));
+            memcpy(lows + (cell->first_block - first), cell->lows, cell->num_blocks * sizeof(float));
+        }
+        free(cell->highs);
+        free(cell->lows);
+        cell->highs = highs;
+        cell->lows = lows;
+        cell->first_block = first;
+        cell->num_blocks = num;
+    }
+    size_t b = (size_t) (block - cell->first_block);
+    if (isnan(cell->highs[b]) || high > cell->highs[b]) {
+        cell->highs[b] = high;
+    }
+    if (isnan(cell->lows[b]) || low < cell->lows[b]) {
+        cell->lows[b] = low;
+    }
+}
+
+void block_range(void *state, struct range_reader *reader) {
+    struct block_scan *scan = state;
+    struct record_batch *batch = xrealloc(NULL, sizeof(struct record_batch));
+    int row;
+
+    while (read_lines(reader, batch) > 0) {
+        tokenize_batch(batch);
+        parse_batch(batch);
+        for (row = 0; row < batch->count; ++row) {
+            char cell[KEY_SZ];
+            struct tm tm;
+            time_t time;
+
+            if ((batch->missing[row] & (1 << 1 | 1 << 2 | 1 << 8)) != 0) {
+                continue;
+            }
+            time = (time_t) floor_div(batch->timestamp[row], 1000);
+            gmtime_r(&time, &tm);
+            snprintf(cell, sizeof cell, "%.*s", scan->precision, batch->geohash[row]);
+
+            size_t before = scan->cells.count;
+            int id = key_table_intern(&scan->cells, cell);
+            if (scan->cells.count > scan->cap) {
+                scan->cap = scan->cells.capacity;
+                scan->blocks = xrealloc(scan->blocks, scan->cap * sizeof(struct cell_blocks));
+            }
+            if (scan->cells.count > before) {
+                memset(&scan->blocks[id], 0, sizeof(struct cell_blocks));
+                memcpy(scan->blocks[id].code, batch->code[row], 3);
+            }
+            float temperature = (float) (batch->temperature[row] * 1.8 - 459.67);
+            block_add(&scan->blocks[id], scan->by_month ? (tm.tm_year + 1900L) * 12 + tm.tm_mon
+                    : tm.tm_year + 1900L, temperature, temperature);
+        }
+    }
+    free(batch);
+}
+
+void merge_block_scan(struct block_scan *into, struct block_scan *from) {
+    size_t id, b;
+
+    for (id = 0; id < from->cells.count; ++id) {
+        struct cell_blocks *source = &from->blocks[id];
+        size_t before = into->cells.count;
+        int g = key_table_intern(&into->cells, from->cells.keys[id]);
+        if (into->cells.count > into->cap) {
+            into->cap = into->cells.capacity;
+            into->blocks = xrealloc(into->blocks, into->cap * sizeof(struct cell_blocks));
+        }
+        if (into->cells.count > before) {
+            into->blocks[g] = *source;
+            continue;
+        }
+        for (b = 0; b < source->num_blocks; ++b) {
+            if (!isnan(source->highs[b])) {
+                block_add(&into->blocks[g], source->first_block + (long) b, source->highs[b],
+                        source->lows[b]);
+            }
+        }
+        free(source->highs);
+        free(source->lows);
+    }
+    key_table_free(&from->cells);
+    free(from->blocks);
+}
+
+/* Gamma function by the Lanczos approximation (g = 7), for x > 0 */
+double math_gamma(double x) {
+    static const double c[9] = {
+        0.99999999999980993, 676.5203681218851, -1259.1392167224028,
+        771.32342877765313, -176.61502916214059, 12.507343278686905,
+        -0.13857109526572012, 9.9843695780195716e-6, 1.5056327351493116e-7
+    };
+    double sum = c[0], t;
+    int i;
+
+    if (x < 0.5) {
+        /* Gamma(x) = Gamma(x + 1) / x keeps the series where it is accurate */
+        return math_gamma(x + 1) / x;
+    }
+    x -= 1;
+    for (i = 1; i < 9; ++i) {
+        sum += c[i] / (x + i);
+    }
+    t = x + 7.5;
+    return math_sqrt(2 * M_PI) * math_exp((x + 0.5) * math_log(t) - t) * sum;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Fits block maxima by their first three L-moments (Hosking, 1990): the
+ * Gumbel from l1 and l2, the GEV shape from the L-skewness by Hosking's
+ * rational approximation. Return levels are the quantiles exceeded once
+ * in T years, i.e. by one block in T * blocks_per_year. */
+void fit_extremes(double *values, int n, int gumbel, int blocks_per_year,
+        struct extreme_fit *fit) {
+    const double periods[3] = { 10, 50, 100 };
+    double b0 = 0, b1 = 0, b2 = 0;
+    int i;
+
+    qsort(values, n, sizeof(double), compare_doubles);
+    for (i = 0; i < n; ++i) {
+        b0 += values[i];
+        b1 += values[i] * i / (n - 1);
+        b2 += values[i] * i * (i - 1) / ((double) (n - 1) * (n - 2));
+    }
+    b0 /= n;
+    b1 /= n;
+    b2 /= n;
+    double l1 = b0, l2 = 2 * b1 - b0, l3 = 6 * b2 - 6 * b1 + b0;
+
+    fit->n = n;
+    fit->shape = 0;
+    if (!gumbel && l2 > 0) {
+        double c = 2 / (3 + l3 / l2) - LN2 / math_log(3);
+        double k = 7.8590 * c + 2.9554 * c * c;
+
+        /* Beyond these the moments do not exist or it is Gumbel anyway */
+        if (k > -0.9 && (k > 1e-6 || k < -1e-6)) {
+            double g = math_gamma(1 + k);
+            fit->shape = k;
+            fit->scale = l2 * k / ((1 - math_exp(-k * LN2)) * g);
+            fit->location = l1 - fit->scale * (1 - g) / k;
+        }
+    }
+    if (fit->shape == 0) {
+        fit->scale = l2 / LN2;
+        fit->location = l1 - 0.5772156649 * fit->scale;
+    }
+    for (i = 0; i < 3; ++i) {
+        double y = -math_log(1 - 1 / (periods[i] * blocks_per_year));
+        if (fit->shape == 0) {
+            fit->levels[i] = fit->location - fit->scale * math_log(y);
+        } else {
+            fit->levels[i] = fit->location
+                + fit->scale * (1 - math_exp(fit->shape * math_log(y))) / fit->shape;
+        }
+    }
+}
+
+void *fit_thread(void *arg) {
+    struct fit_worker *worker = arg;
+    const struct block_scan *scan = worker->scan;
+    size_t id, b, most = 0;
+    double *values = NULL;
+
+    for (id = worker->index; id < scan->cells.count; id += worker->num_workers) {
+        const struct cell_blocks *cell = &scan->blocks[id];
+        int n = 0, side;
+
+        if (cell->num_blocks > most) {
+            most = cell->num_blocks;
+            values = xrealloc(values, most * sizeof(double));
+        }
+        for (side = 0; side < 2; ++side) {
+            struct extreme_fit *fit = side == 0 ? &worker->highs[id] : &worker->lows[id];
+            n = 0;
+            for (b = 0; b < cell->num_blocks; ++b) {
+                if (!isnan(cell->highs[b])) {
+                    /* Minima are the maxima of the negated readings */
+                    values[n++] = side == 0 ? cell->highs[b] : -cell->lows[b];
+                }
+            }
+            fit->n = 0;
+            if (n >= worker->min_blocks) {
+                fit_extremes(values, n, worker->gumbel, scan->by_month ? 12 : 1, fit);
+            }
+        }
+    }
+    free(values);
+    return NULL;
+}
+
+void extremes_usage(const char *name) {
+    printf("Usage: %s extremes [--precision 4] [--block year|month] [--fit gev|gumbel] "
+            "[--min-blocks 5] [-j threads] tdv_file1 ... tdv_fileN\n", name);
+}
+
+/* Entry point of `climate extremes` */
+int extremes_main(int argc, char *argv[]) {
+    struct parallel_scan scan;
+    struct block_scan *scans;
+    struct fit_worker *workers;
+    struct extreme_fit *highs, *lows;
+    void **states;
+    int precision = 4, by_month = 0, gumbel = 0, min_blocks = 5, num_threads = 1;
+    unsigned long fitted = 0;
+    size_t id;
+    int i, t;
+
+    for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (strcmp(argv[i], "--precision") == 0) {
+            precision = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--block") == 0 && (strcmp(argv[i + 1], "year") == 0
+                    || strcmp(argv[i + 1], "month") == 0)) {
+            by_month = strcmp(argv[i + 1], "month") == 0;
+        } else if (strcmp(argv[i], "--fit") == 0 && (strcmp(argv[i + 1], "gev") == 0
+                    || strcmp(argv[i + 1], "gumbel") == 0)) {
+            gumbel = strcmp(argv[i + 1], "gumbel") == 0;
+        } else if (strcmp(argv[i], "--min-blocks") == 0) {
+            min_blocks = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-j") == 0 && atoi(argv[i + 1]) > 0) {
+            num_threads = atoi(argv[i + 1]);
+        } else {
+            extremes_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (i >= argc || precision < 1 || precision > 12 || min_blocks < 3) {
+        extremes_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    scans = xrealloc(NULL, num_threads * sizeof(struct block_scan));
+    states = xrealloc(NULL, num_threads * sizeof(void *));
+    for (t = 0; t < num_threads; ++t) {
+        memset(&scans[t], 0, sizeof(struct block_scan));
+        scans[t].precision = precision;
+        scans[t].by_month = by_month;
+        key_table_init(&scans[t].cells);
+        states[t] = &scans[t];
+    }
+    if (!plan_ranges(&scan, argv + i, argc - i, num_threads)) {
+        fprintf(stderr, "File does not exist\n");
+        return EXIT_FAILURE;
+    }
+    scan.scan = block_range;
+    if (!run_parallel_scan(&scan, states, num_threads)) {
+        return EXIT_FAILURE;
+    }
+    for (t = 1; t < num_threads; ++t) {
+        merge_block_scan(&scans[0], &scans[t]);
+    }
+
+    /* The fits are independent per cell */
+    size_t num_cells = scans[0].cells.count;
+    highs = xrealloc(NULL, (num_cells + 1) * sizeof(struct extreme_fit));
+    lows = xrealloc(NULL, (num_cells + 1) * sizeof(struct extreme_fit));
+    workers = xrealloc(NULL, num_threads * sizeof(struct fit_worker));
+    for (t = 0; t < num_threads; ++t) {
+        workers[t].scan = &scans[0];
+        workers[t].highs = highs;
+        workers[t].lows = lows;
+        workers[t].gumbel = gumbel;
+        workers[t].min_blocks = min_blocks;
+        workers[t].index = t;
+        workers[t].num_workers = num_threads;
+        if (t > 0) {
+            pthread_create(&workers[t].thread, NULL, fit_thread, &workers[t]);
+        }
+    }
+    fit_thread(&workers[0]);
+    for (t = 1; t < num_threads; ++t) {
+        pthread_join(workers[t].thread, NULL);
+    }
+
+    int *order = xrealloc(NULL, (num_cells + 1) * sizeof(int));
+    for (id = 0; id < num_cells; ++id) {
+        order[id] = (int) id;
+    }
+    sort_groups = &scans[0].cells;
+    qsort(order, num_cells, sizeof(int), compare_groups);
+
+    printf("# cell\tstate\tblocks\tlocation\tscale\tshape\thigh_10y\thigh_50y\thigh_100y"
+            "\tlow_10y\tlow_50y\tlow_100y\n");
+    for (id = 0; id < num_cells; ++id) {
+        const struct extreme_fit *high = &highs[order[id]], *low = &lows[order[id]];
+        if (high->n == 0) {
+            continue;
+        }
+        fitted++;
+        printf("%s\t%s\t%d\t%.2f\t%.3f\t%.3f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n",
+                scans[0].cells.keys[order[id]], scans[0].blocks[order[id]].code, high->n,
+                high->location, high->scale, high->shape, high->levels[0], high->levels[1],
+                high->levels[2], -low->levels[0], -low->levels[1], -low->levels[2]);
+    }
+    fprintf(stderr, "Fitted %lu of %lu cells (%s blocks, %s); the rest have fewer than %d "
+            "blocks\n", fitted, (unsigned long) num_cells, by_month ? "month" : "year",
+            gumbel ? "Gumbel" : "GEV", min_blocks);
+
+    for (id = 0; id < num_cells; ++id) {
+        free(scans[0].blocks[id].highs);
+        free(scans[0].blocks[id].lows);
+    }
+    key_table_free(&scans[0].cells);
+    free(scans[0].blocks);
+    free(scans);
+    free(states);
+    free(workers);
+    free(highs);
+    free(lows);
+    free(order);
+    return 0;
+}
+
+/* Orders the lines by event time, keeping the input order of ties */
+int compare_replay_rows(const void *a, const void *b) {
+    const struct replay_row *x = a, *y = b;
+    if (x->time != y->time) {
+        return x->time < y->time ? -1 : 1;
+    }
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/* When a row is due, in microseconds after the start: at row / rate, or at
+ * its event time since the first row over the speed-up, whichever is later */
+long replay_due(const struct replay_row *rows, size_t row, double rate, double speedup) {
+    double due = 0;
+    if (speedup > 0) {
+        due = (rows[row].time - rows[0].time) * 1000.0 / speedup;
+    }
+    if (rate > 0 && row * 1e6 / rate > due) {
+        due = row * 1e6 / rate;
+    }
+    return (long) due;
+}
+
+/* Reads climate_rows_ingested_total from a metrics endpoint, -1 on error */
+long scrape_ingested(const char *address) {
+    const char *request = "GET /metrics HTTP/1.0\r\n\r\n";
+    char response[8192];
+    size_t len = 0;
+    ssize_t n;
+    int fd = open_connection(address);
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (!write_all(fd, request, strlen(request))) {
+        close(fd);
+        return -1;
+    }
+    while (len + 1 < sizeof response
+            && (n = read(fd, response + len, sizeof response - 1 - len)) > 0) {
+        len += (size_t) n;
+    }
+    close(fd);
+    response[len] = '\0';
+
+    /* The counter comes first, so it is within the part read */
+    char *value = strstr(response, "climate_rows_ingested_total{");
+    if (value == NULL || (value = strchr(value, '}')) == NULL) {
+        return -1;
+    }
+    return strtol(value + 1, NULL, 10);
+}
+
+/* Scrapes the ingested count every 5 ms and times each newly ingested row
+ * since it was written, until every row is in or, once the replay is
+ * over, nothing more arrives for 10 seconds */
+void *lag_thread(void *arg) {
+    struct lag_watch *watch = arg;
+    unsigned long seen = 0;
+    long progress = trace_now();
+
+    for (;;) {
+        poll(NULL, 0, 5);
+        int done = __atomic_load_n(&watch->done, __ATOMIC_ACQUIRE);
+        unsigned long written = __atomic_load_n(&watch->written, __ATOMIC_ACQUIRE);
+        long count = scrape_ingested(watch->address);
+        long now = trace_now();
+        if (count < 0) {
+            watch->failed = 1;
+            break;
+        }
+
+        /* Rows are ingested in the order they were written */
+        unsigned long ingested = (unsigned long) count > watch->baseline
+            ? (unsigned long) count - watch->baseline : 0;
+        if (ingested > written) {
+            ingested = written;
+        }
+        if (ingested > seen) {
+            progress = now;
+        }
+        for (; seen < ingested; ++seen) {
+            hdr_record(&watch->lag, now - watch->written_at[seen]);
+        }
+        if (done && (seen >= watch->total || now - progress > 10000000L)) {
+            break;
+        }
+    }
+    watch->ingested = seen;
+    return NULL;
+}
+
+void replay_usage(const char *name) {
+    printf("Usage: %s replay [--rate rows_per_s | --speedup X] [--output FILE|-] "
+            "[--connect PORT|SOCKET_PATH] [--lag METRICS_ADDRESS] [--report-every 10s] "
+            "tdv_file1 ... tdv_fileN\n", name);
+}
+
+/* Entry point of `climate replay` */
+int replay_main(int argc, char *argv[]) {
+    const char *output = "-", *connect_to = NULL;
+    struct lag_watch watch;
+    struct hdr_histogram jitter;
+    struct replay_row *rows = NULL;
+    char *text = NULL;
+    size_t num_rows = 0, rows_cap = 0, text_len = 0, text_cap = 0, next, row;
+    double rate = 0, speedup = 0;
+    long report_every = 0;
+    int ok = 1, fd, i;
+
+    memset(&watch, 0, sizeof watch);
+    memset(&jitter, 0, sizeof jitter);
+    for (i = 1; i + 1 < argc && strncmp(argv[i], "--", 2) == 0; i += 2) {
+        if (strcmp(argv[i], "--rate") == 0) {
+            rate = atof(argv[i + 1]);
+        } else if (strcmp(argv[i], "--speedup") == 0) {
+            speedup = atof(argv[i + 1]);
+        } else if (strcmp(argv[i], "--output") == 0) {
+            output = argv[i + 1];
+        } else if (strcmp(argv[i], "--connect") == 0) {
+            connect_to = argv[i + 1];
+        } else if (strcmp(argv[i], "--lag") == 0) {
+            watch.address = argv[i + 1];
+        } else if (strcmp(argv[i], "--report-every") == 0) {
+            report_every = parse_duration(argv[i + 1]);
+        } else {
+            replay_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (i >= argc || rate < 0 || speedup < 0 || report_every < 0) {
+        replay_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* Everything is read first, since the rows go out in time order */
+    for (; i < argc; ++i) {
+        struct input input;
+        char line[LINE_SZ];
+        if (!open_input(&input, argv[i])) {
+            fprintf(stderr, "File does not exist: %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        while (fgets(line, sizeof line, input.file) != NULL) {
+            char *tab = strchr(line, '\t');
+            size_t length = strlen(line);
+            if (tab == NULL || line[0] == '#') {
+                continue;
+            }
+            if (line[length - 1] != '\n') {
+                line[length++] = '\n';
+            }
+            if (num_rows == rows_cap) {
+                rows_cap = rows_cap == 0 ? 4096 : rows_cap * 2;
+                rows = xrealloc(rows, rows_cap * sizeof(struct replay_row));
+            }
+            if (text_len + length > text_cap) {
+                text_cap = text_cap == 0 ? INPUT_BUFFER_SZ : text_cap * 2;
+                text = xrealloc(text, text_cap);
+            }
+            rows[num_rows].time = strtol(tab + 1, NULL, 10);
+            rows[num_rows].offset = text_len;
+            rows[num_rows].length = length;
+            memcpy(text + text_len, line, length);
+            text_len += length;
+            num_rows++;
+        }
+        if (!close_input(&input)) {
+            return EXIT_FAILURE;
+        }
+    }
+    if (num_rows == 0) {
+        fprintf(stderr, "No records to replay\n");
+        return EXIT_FAILURE;
+    }
+    qsort(rows, num_rows, sizeof(struct replay_row), compare_replay_rows);
+
+    signal(SIGPIPE, SIG_IGN);
+    if (connect_to != NULL) {
+        output = connect_to;
+        fd = open_connection(connect_to);
+    } else if (strcmp(output, "-") == 0) {
+        fd = STDOUT_FILENO;
+    } else {
+        /* A named pipe blocks here until its reader opens it */
+        fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s\n", output);
+        return EXIT_FAILURE;
+    }
+
+    long *written_at = xrealloc(NULL, num_rows * sizeof(long));
+    if (watch.address != NULL) {
+        long baseline = scrape_ingested(watch.address);
+        if (baseline < 0) {
+            fprintf(stderr, "Could not read the metrics at %s\n", watch.address);
+            return EXIT_FAILURE;
+        }
+        watch.baseline = (unsigned long) baseline;
+        watch.written_at = written_at;
+        pthread_create(&watch.thread, NULL, lag_thread, &watch);
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    char *buffer = xrealloc(NULL, INPUT_BUFFER_SZ);
+    long start = trace_now(), last_report = start;
+    size_t last_rows = 0;
+    next = 0;
+    while (next < num_rows && !stop_requested) {
+        long now = trace_now() - start;
+        long due = replay_due(rows, next, rate, speedup);
+        if (due > now) {
+            struct timespec wait;
+            wait.tv_sec = (due - now) / 1000000L;
+            wait.tv_nsec = (due - now) % 1000000L * 1000L;
+            nanosleep(&wait, NULL);
+            continue;
+        }
+
+        /* Everything due by now goes out in one write */
+        size_t len = 0, first = next;
+        while (next < num_rows && len + rows[next].length <= INPUT_BUFFER_SZ
+                && replay_due(rows, next, rate, speedup) <= now) {
+            memcpy(buffer + len, text + rows[next].offset, rows[next].length);
+            len += rows[next].length;
+            next++;
+        }
+        if (!write_all(fd, buffer, len)) {
+            fprintf(stderr, "Could not write to %s: %s\n", output, strerror(errno));
+            next = first;
+            ok = 0;
+            break;
+        }
+
+        /* A row is late by however long after its due time the write
+         * returned, so a slow reader shows up here too */
+        long written = trace_now();
+        for (row = first; row < next; ++row) {
+            written_at[row] = written;
+            hdr_record(&jitter, written - start - replay_due(rows, row, rate, speedup));
+        }
+        __atomic_store_n(&watch.written, (unsigned long) next, __ATOMIC_RELEASE);
+
+        if (report_every > 0 && written - last_report >= report_every * 1000000L) {
+            fprintf(stderr, "%.1f s: %lu rows, %.0f rows/s, jitter p99 %ld us\n",
+                    (written - start) / 1e6, (unsigned long) next,
+                    (next - last_rows) * 1e6 / (written - last_report),
+                    hdr_percentile(&jitter, 99));
+            last_report = written;
+            last_rows = next;
+        }
+    }
+    long elapsed = trace_now() - start;
+    if (fd != STDOUT_FILENO) {
+        close(fd);
+    }
+
+    if (watch.address != NULL) {
+        watch.total = next;
+        __atomic_store_n(&watch.done, 1, __ATOMIC_RELEASE);
+        pthread_join(watch.thread, NULL);
+    }
+
+    char from[32] = "-", to[32] = "-";
+    if (next > 0) {
+        format_utc(rows[0].time / 1000, from, sizeof from);
+        format_utc(rows[next - 1].time / 1000, to, sizeof to);
+    }
+    fprintf(stderr, "Replayed %lu of %lu rows (%s to %s) in %.3f s\n", (unsigned long) next,
+            (unsigned long) num_rows, from, to, elapsed / 1e6);
+    fprintf(stderr, "Rate: %.0f rows/s", elapsed > 0 ? next * 1e6 / elapsed : 0.0);
+    if (rate > 0) {
+        fprintf(stderr, " (target %.0f)", rate);
+    }
+    if (speedup > 0 && next > 0 && elapsed > 0) {
+        fprintf(stderr, ", %.1fx event time (target %.1fx)",
+                (rows[next - 1].time - rows[0].time) * 1000.0 / elapsed, speedup);
+    }
+    fprintf(stderr, "\n");
+    if ((rate > 0 || speedup > 0) && jitter.total > 0) {
+        fprintf(stderr, "Jitter after schedule: p50 %ld us, p99 %ld us, p99.9 %ld us, "
+                "max %ld us\n", hdr_percentile(&jitter, 50), hdr_percentile(&jitter, 99),
+                hdr_percentile(&jitter, 99.9), jitter.max);
+    }
+    if (watch.address != NULL && watch.lag.total > 0) {
+        fprintf(stderr, "Ingestion lag: p50 %.1f ms, p99 %.1f ms, max %.1f ms "
+                "(%lu of %lu rows seen ingested%s)\n", hdr_percentile(&watch.lag, 50) / 1e3,
+                hdr_percentile(&watch.lag, 99) / 1e3, watch.lag.max / 1e3,
+                watch.ingested, (unsigned long) next,
+                watch.failed ? " before the metrics went away" : "");
+    } else if (watch.address != NULL) {
+        fprintf(stderr, "Ingestion lag: no rows seen ingested\n");
+    }
+
+    free(rows);
+    free(text);
+    free(written_at);
+    free(buffer);
+    return ok ? 0 : EXIT_FAILURE;
+}
+
+const char *LOAD_KIND_NAMES[NUM_LOAD_KINDS] = { "report", "lookup", "query" };
+
+/* Group-by queries loadgen sends without --queries; %s is a state */
+const char *QUERY_TEMPLATES[] = {
+    "query select count, avg(temp), max(temp) where state = %s group by month",
+    "query select avg(humidity), max(pressure) where state = %s group by day",
+    "query select count, min(temp) where state = %s group by cell3",
+    "query select count, avg(temp) where temp > 80 group by state"
+};
+
+/* Sends one command of a random kind, to be timed from start */
+int load_send(struct load_connection *conn, struct load_plan *plan, long start) {
+    double total = 0, pick;
+    char command[LINE_SZ * 2];
+    int kind;
+
+    for (kind = 0; kind < NUM_LOAD_KINDS; ++kind) {
+        total += plan->weights[kind];
+    }
+    pick = rng_uniform(&plan->rng) * total;
+    for (kind = 0; kind + 1 < NUM_LOAD_KINDS && pick >= plan->weights[kind]; ++kind) {
+        pick -= plan->weights[kind];
+    }
+
+    const char *state = plan->states.keys[rng_below(&plan->rng, plan->states.count)];
+    if (kind == 0) {
+        snprintf(command, sizeof command, "report %s\n", state);
+    } else if (kind == 1) {
+        snprintf(command, sizeof command, "lookup %s\n",
+                plan->geohashes.keys[rng_below(&plan->rng, plan->geohashes.count)]);
+    } else if (plan->queries != NULL) {
+        snprintf(command, sizeof command, "query %s\n",
+                plan->queries[rng_below(&plan->rng, plan->num_queries)]);
+    } else {
+        size_t num_templates = sizeof QUERY_TEMPLATES / sizeof QUERY_TEMPLATES[0];
+        snprintf(command, sizeof command,
+                QUERY_TEMPLATES[rng_below(&plan->rng, num_templates)], state);
+        strcat(command, "\n");
+    }
+
+    if (conn->num_pending == conn->pending_cap) {
+        conn->pending_cap = conn->pending_cap == 0 ? 16 : conn->pending_cap * 2;
+        conn->pending = xrealloc(conn->pending, conn->pending_cap * sizeof(struct load_request));
+    }
+    conn->pending[conn->num_pending].id = -1;
+    conn->pending[conn->num_pending].kind = kind;
+    conn->pending[conn->num_pending].start = start;
+    conn->num_pending++;
+    return write_all(conn->fd, command, strlen(command));
+}
+
+/* Reads what the server has sent. ACCEPTED lines come in the order the
+ * commands were sent and give them their ids; END lines may come in any
+ * order and end the request with that id. Returns 0 when the server has
+ * gone away. */
+int load_receive(struct load_connection *conn, struct load_result *result) {
+    char *line, *newline;
+    int r;
+
+    if (conn->in_cap - conn->in_len < 65536) {
+        conn->in_cap = conn->in_cap * 2 + 65536;
+        conn->in = xrealloc(conn->in, conn->in_cap);
+    }
+    ssize_t n = read(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len - 1);
+    if (n <= 0) {
+        return n < 0 && errno == EINTR;
+    }
+    long now = trace_now();
+    conn->in_len += (size_t) n;
+    conn->in[conn->in_len] = '\0';
+
+    line = conn->in;
+    while ((newline = strchr(line, '\n')) != NULL) {
+        *newline = '\0';
+        if (strncmp(line, "ACCEPTED ", 9) == 0) {
+            for (r = 0; r < conn->num_pending && conn->pending[r].id >= 0; ++r) {
+            }
+            if (r < conn->num_pending) {
+                conn->pending[r].id = atol(line + 9);
+            }
+        } else if (strncmp(line, "END ", 4) == 0) {
+            char *status = strchr(line + 4, ' ');
+            long id = atol(line + 4);
+            for (r = 0; r < conn->num_pending && conn->pending[r].id != id; ++r) {
+            }
+            if (r < conn->num_pending && status != NULL) {
+                int kind = conn->pending[r].kind;
+                if (strncmp(status + 1, "ok ", 3) == 0) {
+                    hdr_record(&result->latency[kind], now - conn->pending[r].start);
+                    hdr_record(&result->latency[NUM_LOAD_KINDS], now - conn->pending[r].start);
+                } else {
+                    result->errors[kind]++;
+                    result->errors[NUM_LOAD_KINDS]++;
+                }
+                memmove(&conn->pending[r], &conn->pending[r + 1],
+                        (conn->num_pending - r - 1) * sizeof(struct load_request));
+                conn->num_pending--;
+            }
+        }
+        line = newline + 1;
+    }
+    conn->in_len -= (size_t) (line - conn->in);
+    memmove(conn->in, line, conn->in_len);
+    return 1;
+}
+
+/* Runs the load on num_conns connections for duration microseconds, then
+ * waits up to 10 seconds for the answers still out. Closed loop when rate
+ * is 0, otherwise a command is due every 1 / rate seconds. */
+int run_load_level(struct load_plan *plan, struct load_connection *conns, int num_conns,
+        double rate, long duration, struct load_result *result) {
+    struct pollfd *fds = xrealloc(NULL, num_conns * sizeof(struct pollfd));
+    long start = trace_now(), stop = start + duration, next_due = start;
+    unsigned long sent = 0;
+    int c, ok = 1;
+
+    while (ok && !stop_requested) {
+        long now = trace_now();
+        int outstanding = 0, timeout = 100;
+
+        for (c = 0; c < num_conns; ++c) {
+            outstanding += conns[c].num_pending;
+        }
+        if (now >= stop && (outstanding == 0 || now >= stop + 10000000L)) {
+            result->unanswered += outstanding;
+            break;
+        }
+        if (now < stop && rate > 0) {
+            /* Catch up on every command due by now, late or not */
+            while (ok && next_due <= now && next_due < stop) {
+                ok = load_send(&conns[sent % num_conns], plan, next_due);
+                sent++;
+                next_due = start + (long) (sent * 1e6 / rate);
+            }
+            timeout = next_due > now ? (int) ((next_due - now) / 1000) : 0;
+        } else if (now < stop) {
+            for (c = 0; ok && c < num_conns; ++c) {
+                if (conns[c].num_pending == 0) {
+                    ok = load_send(&conns[c], plan, now);
+                }
+            }
+        }
+
+        for (c = 0; c < num_conns; ++c) {
+            fds[c].fd = conns[c].fd;
+            fds[c].events = POLLIN;
+            fds[c].revents = 0;
+        }
+        if (ok && poll(fds, num_conns, timeout) > 0) {
+            for (c = 0; ok && c < num_conns; ++c) {
+                if (fds[c].revents & (POLLIN | POLLHUP | POLLERR)) {
+                    ok = load_receive(&conns[c], result);
+                }
+            }
+        }
+    }
+    result->elapsed = trace_now() - start;
+    for (c = 0; c < num_conns; ++c) {
+        conns[c].num_pending = 0;
+    }
+    free(fds);
+    return ok;
+}
+
+void print_load_level(const struct load_result *result, int num_conns, double rate) {
+    int kind;
+    for (kind = 0; kind <= NUM_LOAD_KINDS; ++kind) {
+        const struct hdr_histogram *latency = &result->latency[kind];
+        if (latency->total == 0 && result->errors[kind] == 0) {
+            continue;
+        }
+        if (rate > 0) {
+            printf("%d\t%.0f", num_conns, rate);
+        } else {
+            printf("%d\tclosed", num_conns);
+        }
+        printf("\t%s\t%lu\t%lu\t%.1f\t%ld\t%ld\t%ld\t%ld\n",
+                kind < NUM_LOAD_KINDS ? LOAD_KIND_NAMES[kind] : "all", latency->total,
+                result->errors[kind], latency->total * 1e6 / result->elapsed,
+                hdr_percentile(latency, 50), hdr_percentile(latency, 99),
+                hdr_percentile(latency, 99.9), latency->max);
+    }
+    if (result->unanswered > 0) {
+        fprintf(stderr, "%d connections: %lu commands unanswered after 10 seconds\n",
+                num_conns, result->unanswered);
+    }
+    fflush(stdout);
+}
+
+void loadgen_usage(const char *name) {
+    printf("Usage: %s loadgen --connect PORT|SOCKET_PATH [--mix report=1,lookup=8,query=1] "
+            "[--connections 1,4,16] [--rate per_s] [--duration 10s] [--queries FILE] "
+            "[--seed 1] tdv_file1 ... tdv_fileN\n", name);
+}
+
+/* Entry point of `climate loadgen` */
+int loadgen_main(int argc, char *argv[]) {
+    const char *address = NULL, *queries_path = NULL;
+    const char *mix = "report=1,lookup=8,query=1", *levels = "1,4,16";
+    struct load_plan plan;
+    struct load_connection *conns = NULL;
+    struct load_result *result;
+    double rate = 0;
+    long duration = 10;
+    unsigned long long seed = 1;
+    int num_conns = 0, max_conns = 0, c, i, kind;
+    char *p;
+
+    memset(&plan, 0, sizeof plan);
+    for (i = 1; i + 1 < argc && strncmp(argv[i], "--", 2) == 0; i += 2) {
+        if (strcmp(argv[i], "--connect") == 0) {
+            address = argv[i + 1];
+        } else if (strcmp(argv[i], "--mix") == 0) {
+            mix = argv[i + 1];
+        } else if (strcmp(argv[i], "--connections") == 0) {
+            levels = argv[i + 1];
+        } else if (strcmp(argv[i], "--rate") == 0) {
+            rate = atof(argv[i + 1]);
+        } else if (strcmp(argv[i], "--duration") == 0) {
+            duration = parse_duration(argv[i + 1]);
+        } else if (strcmp(argv[i], "--queries") == 0) {
+            queries_path = argv[i + 1];
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            seed = strtoull(argv[i + 1], NULL, 10);
+        } else {
+            loadgen_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* --mix is name=weight pairs; kinds left out are not sent */
+    for (p = (char *) mix; *p != '\0'; p += strcspn(p, ",") + (p[strcspn(p, ",")] == ',')) {
+        size_t name_len = strcspn(p, "=,");
+        for (kind = 0; kind < NUM_LOAD_KINDS; ++kind) {
+            if (strlen(LOAD_KIND_NAMES[kind]) == name_len
+                    && strncmp(p, LOAD_KIND_NAMES[kind], name_len) == 0 && p[name_len] == '=') {
+                plan.weights[kind] = atof(p + name_len + 1);
+                break;
+            }
+        }
+        if (kind == NUM_LOAD_KINDS || plan.weights[kind] < 0) {
+            loadgen_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    for (p = (char *) levels; *p != '\0'; p += strcspn(p, ",") + (p[strcspn(p, ",")] == ',')) {
+        if (atoi(p) > max_conns) {
+            max_conns = atoi(p);
+        }
+    }
+    if (i >= argc || address == NULL || max_conns < 1 || rate < 0 || duration <= 0
+            || plan.weights[0] + plan.weights[1] + plan.weights[2] <= 0) {
+        loadgen_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* The keys to send come from the inputs */
+    key_table_init(&plan.states);
+    key_table_init(&plan.geohashes);
+    for (; i < argc; ++i) {
+        struct input input;
+        char line[LINE_SZ];
+        if (!open_input(&input, argv[i])) {
+            fprintf(stderr, "File does not exist: %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        while (fgets(line, sizeof line, input.file) != NULL) {
+            char *data[NUM_FIELDS];
+            if (split_fields(line, data, 3) == 3 && strlen(data[0]) < 3
+                    && strlen(data[2]) < 13) {
+                key_table_intern(&plan.states, data[0]);
+                key_table_intern(&plan.geohashes, data[2]);
+            }
+        }
+        if (!close_input(&input)) {
+            return EXIT_FAILURE;
+        }
+    }
+    if (plan.states.count == 0) {
+        fprintf(stderr, "No records to take keys from\n");
+        return EXIT_FAILURE;
+    }
+    if (queries_path != NULL) {
+        FILE *file = fopen(queries_path, "r");
+        char line[LINE_SZ];
+        if (file == NULL) {
+            fprintf(stderr, "File does not exist: %s\n", queries_path);
+            return EXIT_FAILURE;
+        }
+        while (fgets(line, sizeof line, file) != NULL) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] != '\0' && line[0] != '#') {
+                plan.queries = xrealloc(plan.queries, (plan.num_queries + 1) * sizeof(char *));
+                plan.queries[plan.num_queries++] = strdup(line);
+            }
+        }
+        fclose(file);
+        if (plan.num_queries == 0) {
+            plan.weights[2] = 0;
+        }
+    }
+    rng_seed(&plan.rng, seed);
+
+    conns = xrealloc(NULL, max_conns * sizeof(struct load_connection));
+    memset(conns, 0, max_conns * sizeof(struct load_connection));
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    printf("# connections\trate\tkind\trequests\terrors\tper_second\tp50_us\tp99_us"
+            "\tp999_us\tmax_us\n");
+    result = xrealloc(NULL, sizeof(struct load_result));
+    for (p = (char *) levels; *p != '\0' && !stop_requested;
+            p += strcspn(p, ",") + (p[strcspn(p, ",")] == ',')) {
+        int level = atoi(p);
+        if (level < 1) {
+            continue;
+        }
+
+        /* Connections stay open from one level to the next */
+        for (; num_conns < level; ++num_conns) {
+            conns[num_conns].fd = open_connection(address);
+            if (conns[num_conns].fd < 0) {
+                fprintf(stderr, "Could not connect to %s\n", address);
+                return EXIT_FAILURE;
+            }
+        }
+        memset(result, 0, sizeof(struct load_result));
+        if (!run_load_level(&plan, conns, level, rate, duration * 1000000L, result)) {
+            fprintf(stderr, "Lost the connection to %s\n", address);
+            return EXIT_FAILURE;
+        }
+        print_load_level(result, level, rate);
+
+        /* Late answers would be taken for the next level's */
+        if (result->unanswered > 0) {
+            for (c = 0; c < num_conns; ++c) {
+                close(conns[c].fd);
+                conns[c].in_len = 0;
+            }
+            num_conns = 0;
+        }
+    }
+
+    for (c = 0; c < num_conns; ++c) {
+        close(conns[c].fd);
+        free(conns[c].in);
+        free(conns[c].pending);
+    }
+    for (i = 0; i < (int) plan.num_queries; ++i) {
+        free(plan.queries[i]);
+    }
+    free(plan.queries);
+    key_table_free(&plan.states);
+    key_table_free(&plan.geohashes);
+    free(conns);
+    free(result);
+    return 0;
+}
+
+void shuffle_table_init(struct shuffle_table *table, int precision, long bucket) {
+    memset(table, 0, sizeof *table);
+    table->precision = precision;
+    table->bucket = bucket;
+}
+
+void shuffle_table_free(struct shuffle_table *table) {
+    free(table->partials);
+    free(table->slots);
+}
+
+unsigned long shuffle_hash(const char *geohash, long bucket) {
+    return hash_key(geohash) ^ (unsigned long) bucket * 2654435761UL;
+}
+
+/* Worker owning a key. The high bits of a multiplicative hash, so that the
+ * keys a worker owns still spread over the low bits its table uses. */
+int shuffle_owner(unsigned long hash, int num_workers) {
+    return (int) (((unsigned long long) hash * 0x9E3779B97F4A7C15ULL >> 40) % num_workers);
+}
+
+/* Finds the partial of a key, adding an empty one */
+struct shuffle_partial *shuffle_find(struct shuffle_table *table, const char *geohash,
+        const char *code, long bucket) {
+    struct shuffle_partial *partial;
+    size_t slot, id;
+
+    /* Load factor at most one half */
+    if ((table->count + 1) * 2 > table->mask + 1) {
+        size_t size = table->mask ? (table->mask + 1) * 2 : 1024;
+        free(table->slots);
+        table->slots = xrealloc(NULL, size * sizeof(size_t));
+        memset(table->slots, 0, size * sizeof(size_t));
+        table->mask = size - 1;
+        for (id = 0; id < table->count; ++id) {
+            partial = &table->partials[id];
+            slot = shuffle_hash(partial->geohash, partial->bucket) & table->mask;
+            while (table->slots[slot] != 0) {
+                slot = (slot + 1) & table->mask;
+            }
+            table->slots[slot] = id + 1;
+        }
+    }
+
+    slot = shuffle_hash(geohash, bucket) & table->mask;
+    while (table->slots[slot] != 0) {
+        partial = &table->partials[table->slots[slot] - 1];
+        if (partial->bucket == bucket && strcmp(partial->geohash, geohash) == 0) {
+            return partial;
+        }
+        slot = (slot + 1) & table->mask;
+    }
+
+    if (table->count == table->cap) {
+        table->cap = table->cap ? table->cap * 2 : 1024;
+        table->partials = xrealloc(table->partials, table->cap * sizeof(struct shuffle_partial));
+    }
+    partial = &table->partials[table->count];
+    memset(partial, 0, sizeof *partial);
+    snprintf(partial->geohash, sizeof partial->geohash, "%s", geohash);
+    memcpy(partial->code, code, 3);
+    partial->bucket = bucket;
+    partial->min_temp = DBL_MAX;
+    partial->max_temp = -DBL_MAX;
+    table->slots[slot] = ++table->count;
+    return partial;
+}
+
+void shuffle_merge(struct shuffle_table *table, const struct shuffle_partial *from) {
+    struct shuffle_partial *into = shuffle_find(table, from->geohash, from->code, from->bucket);
+    into->records += from->records;
+    into->humidity_records += from->humidity_records;
+    into->lightning += from->lightning;
+    into->sum_temp += from->sum_temp;
+    into->sum_humidity += from->sum_humidity;
+    if (from->min_temp < into->min_temp) {
+        into->min_temp = from->min_temp;
+    }
+    if (from->max_temp > into->max_temp) {
+        into->max_temp = from->max_temp;
+    }
+}
+
+/* Scan callback of a shuffle worker: partials of its own ranges */
+void shuffle_range(void *state, struct range_reader *reader) {
+    struct shuffle_table *table = state;
+    struct record_batch *batch = xrealloc(NULL, sizeof(struct record_batch));
+    int row;
+
+    while (read_lines(reader, batch) > 0) {
+        tokenize_batch(batch);
+        parse_batch(batch);
+        for (row = 0; row < batch->count; ++row) {
+            char cell[13];
+
+            if ((batch->missing[row] & (1 << 1 | 1 << 2 | 1 << 8)) != 0) {
+                continue;
+            }
+            snprintf(cell, sizeof cell, "%.*s", table->precision, batch->geohash[row]);
+            long bucket = floor_div(floor_div(batch->timestamp[row], 1000), table->bucket)
+                * table->bucket;
+            struct shuffle_partial *partial = shuffle_find(table, cell, batch->code[row], bucket);
+            double temperature = batch->temperature[row] * 1.8 - 459.67;
+
+            partial->records++;
+            partial->sum_temp += temperature;
+            if (temperature < partial->min_temp) {
+                partial->min_temp = temperature;
+            }
+            if (temperature > partial->max_temp) {
+                partial->max_temp = temperature;
+            }
+            if ((batch->missing[row] & 1 << 3) == 0) {
+                partial->humidity_records++;
+                partial->sum_humidity += batch->humidity[row];
+            }
+            if ((batch->missing[row] & 1 << 6) == 0 && batch->lightning[row] != 0) {
+                partial->lightning++;
+            }
+            table->rows++;
+        }
+    }
+    free(batch);
+}
+
+int compare_partials(const void *a, const void *b) {
+    const struct shuffle_partial *x = a, *y = b;
+    int order = strcmp(x->geohash, y->geohash);
+    if (order != 0) {
+        return order;
+    }
+    return x->bucket < y->bucket ? -1 : x->bucket > y->bucket;
+}
+
+/* Sends every partial of local to its owner and merges the ones this
+ * worker owns, its own and those other workers send, into owned. Sending
+ * and receiving go on together over nonblocking sockets, so two workers
+ * writing to each other never wait on each other; a sender closes its
+ * connection once everything is out. A peer that never shows up (it died
+ * before the exchange) fails it after SHUFFLE_IDLE_MS without progress. */
+int shuffle_exchange(struct shuffle_table *local, struct shuffle_table *owned, int self,
+        int num_workers, int listen_fd, char **addresses, struct shuffle_stats *stats) {
+    struct shuffle_partial **out = xrealloc(NULL, num_workers * sizeof(struct shuffle_partial *));
+    size_t *out_count = xrealloc(NULL, num_workers * sizeof(size_t));
+    size_t *out_cap = xrealloc(NULL, num_workers * sizeof(size_t));
+    size_t *out_sent = xrealloc(NULL, num_workers * sizeof(size_t));
+    int *out_fd = xrealloc(NULL, num_workers * sizeof(int));
+    struct shuffle_peer *peers = xrealloc(NULL, num_workers * sizeof(struct shuffle_peer));
+    struct pollfd *fds = xrealloc(NULL, 2 * num_workers * sizeof(struct pollfd));
+    int *slots = xrealloc(NULL, 2 * num_workers * sizeof(int));
+    char *buffer = xrealloc(NULL, INPUT_BUFFER_SZ);
+    int num_peers = 0, open_out = 0, open_in = 0, ok = 1, w, k;
+    size_t id;
+
+    for (w = 0; w < num_workers; ++w) {
+        out[w] = NULL;
+        out_count[w] = out_cap[w] = out_sent[w] = 0;
+        out_fd[w] = -1;
+    }
+    for (id = 0; id < local->count; ++id) {
+        struct shuffle_partial *partial = &local->partials[id];
+        w = shuffle_owner(shuffle_hash(partial->geohash, partial->bucket), num_workers);
+        if (w == self) {
+            shuffle_merge(owned, partial);
+            continue;
+        }
+        if (out_count[w] == out_cap[w]) {
+            out_cap[w] = out_cap[w] ? out_cap[w] * 2 : 1024;
+            out[w] = xrealloc(out[w], out_cap[w] * sizeof(struct shuffle_partial));
+        }
+        out[w][out_count[w]++] = *partial;
+        stats->sent++;
+    }
+
+    for (w = 0; ok && w < num_workers; ++w) {
+        if (w == self) {
+            continue;
+        }
+        out_fd[w] = open_connection(addresses[w]);
+        if (out_fd[w] < 0) {
+            fprintf(stderr, "Worker %d could not connect to %s\n", self, addresses[w]);
+            ok = 0;
+            break;
+        }
+        fcntl(out_fd[w], F_SETFL, fcntl(out_fd[w], F_GETFL) | O_NONBLOCK);
+        open_out++;
+    }
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+    while (ok && (open_out > 0 || open_in > 0 || num_peers < num_workers - 1)) {
+        int num_fds = 0;
+        for (w = 0; w < num_workers; ++w) {
+            if (out_fd[w] >= 0) {
+                fds[num_fds].fd = out_fd[w];
+                fds[num_fds].events = POLLOUT;
+                slots[num_fds++] = w;
+            }
+        }
+        if (num_peers < num_workers - 1) {
+            fds[num_fds].fd = listen_fd;
+            fds[num_fds].events = POLLIN;
+            slots[num_fds++] = -1;
+        }
+        for (k = 0; k < num_peers; ++k) {
+            if (peers[k].fd >= 0) {
+                fds[num_fds].fd = peers[k].fd;
+                fds[num_fds].events = POLLIN;
+                slots[num_fds++] = num_workers + k;
+            }
+        }
+        int ready = poll(fds, num_fds, SHUFFLE_IDLE_MS);
+        if (ready < 0) {
+            ok = errno == EINTR;
+            continue;
+        }
+        if (ready == 0) {
+            fprintf(stderr, "Worker %d gave up on the exchange: %d of %d peers connected\n",
+                    self, num_peers, num_workers - 1);
+            ok = 0;
+            break;
+        }
+
+        for (k = 0; ok && k < num_fds; ++k) {
+            if (fds[k].revents == 0) {
+                continue;
+            }
+            if (slots[k] < 0) {
+                int fd = accept(listen_fd, NULL, NULL);
+                if (fd >= 0) {
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                    peers[num_peers].fd = fd;
+                    peers[num_peers++].pending_len = 0;
+                    open_in++;
+                }
+            } else if (slots[k] < num_workers) {
+                w = slots[k];
+                size_t total = out_count[w] * sizeof(struct shuffle_partial);
+                ssize_t n = write(out_fd[w], (char *) out[w] + out_sent[w], total - out_sent[w]);
+                if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                    fprintf(stderr, "Worker %d could not send to %s: %s\n", self,
+                            addresses[w], strerror(errno));
+                    ok = 0;
+                    break;
+                }
+                out_sent[w] += n > 0 ? (size_t) n : 0;
+                if (out_sent[w] == total) {
+                    close(out_fd[w]);
+                    out_fd[w] = -1;
+                    open_out--;
+                }
+            } else {
+                struct shuffle_peer *peer = &peers[slots[k] - num_workers];
+                ssize_t n = read(peer->fd, buffer, INPUT_BUFFER_SZ);
+                if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                    continue;
+                }
+                if (n <= 0) {
+                    ok = n == 0 && peer->pending_len == 0;
+                    if (!ok) {
+                        fprintf(stderr, "Worker %d lost a connection mid-partial\n", self);
+                    }
+                    close(peer->fd);
+                    peer->fd = -1;
+                    open_in--;
+                    continue;
+                }
+
+                /* Partials can be split across reads */
+                char *p = buffer;
+                size_t left = (size_t) n;
+                while (left > 0) {
+                    size_t take = sizeof(struct shuffle_partial) - peer->pending_len;
+                    if (take > left) {
+                        take = left;
+                    }
+                    memcpy(peer->pending + peer->pending_len, p, take);
+                    peer->pending_len += take;
+                    p += take;
+                    left -= take;
+                    if (peer->pending_len == sizeof(struct shuffle_partial)) {
+                        struct shuffle_partial partial;
+                        memcpy(&partial, peer->pending, sizeof partial);
+                        shuffle_merge(owned, &partial);
+                        stats->received++;
+                        peer->pending_len = 0;
+                    }
+                }
+            }
+        }
+    }
+
+    for (w = 0; w < num_workers; ++w) {
+        if (out_fd[w] >= 0) {
+            close(out_fd[w]);
+        }
+        free(out[w]);
+    }
+    for (k = 0; k < num_peers; ++k) {
+        if (peers[k].fd >= 0) {
+            close(peers[k].fd);
+        }
+    }
+    free(out);
+    free(out_count);
+    free(out_cap);
+    free(out_sent);
+    free(out_fd);
+    free(peers);
+    free(fds);
+    free(slots);
+    free(buffer);
+    return ok;
+}
+
+/* Body of one worker process: scan ranges self, self + num_workers, ...
+ * of the plan, exchange, then write the keys it owns */
+int shuffle_worker(const struct parallel_scan *plan, int self, int num_workers,
+        int listen_fd, char **addresses, const char *dir, int precision, long bucket,
+        struct shuffle_stats *stats) {
+    struct shuffle_table local, owned;
+    struct parallel_scan mine;
+    void *state = &local;
+    char path[PATH_MAX];
+    size_t r, id;
+
+    shuffle_table_init(&local, precision, bucket);
+    shuffle_table_init(&owned, precision, bucket);
+    memset(&mine, 0, sizeof mine);
+    mine.ranges = xrealloc(NULL, (plan->num_ranges + 1) * sizeof(struct scan_range));
+    for (r = self; r < plan->num_ranges; r += num_workers) {
+        mine.ranges[mine.num_ranges++] = plan->ranges[r];
+    }
+    mine.scan = shuffle_range;
+
+    long begin = trace_now();
+    if (!run_parallel_scan(&mine, &state, 1)) {
+        return 0;
+    }
+    stats->rows = local.rows;
+    stats->local_keys = local.count;
+    long scanned = trace_now();
+    stats->scan_micros = scanned - begin;
+
+    if (!shuffle_exchange(&local, &owned, self, num_workers, listen_fd, addresses, stats)) {
+        return 0;
+    }
+    shuffle_table_free(&local);
+    long exchanged = trace_now();
+    stats->exchange_micros = exchanged - scanned;
+
+    /* The table is done with, so its partials can be sorted in place */
+    qsort(owned.partials, owned.count, sizeof(struct shuffle_partial), compare_partials);
+    snprintf(path, sizeof path, "%s/part-%03d.tdv", dir, self);
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not create %s\n", path);
+        return 0;
+    }
+    fprintf(file, "# cell\tstate\tstart\trecords\tavg_temp\tmin_temp\tmax_temp"
+            "\tavg_humidity\tlightning\n");
+    for (id = 0; id < owned.count; ++id) {
+        const struct shuffle_partial *partial = &owned.partials[id];
+        char start[32];
+        format_utc(partial->bucket, start, sizeof start);
+        fprintf(file, "%s\t%s\t%s\t%lu\t%.2f\t%.2f\t%.2f\t", partial->geohash, partial->code,
+                start, partial->records, partial->sum_temp / partial->records,
+                partial->min_temp, partial->max_temp);
+        if (partial->humidity_records > 0) {
+            fprintf(file, "%.2f", partial->sum_humidity / partial->humidity_records);
+        }
+        fprintf(file, "\t%lu\n", partial->lightning);
+    }
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Could not write %s\n", path);
+        return 0;
+    }
+    stats->owned_keys = owned.count;
+    stats->finalize_micros = trace_now() - exchanged;
+    shuffle_table_free(&owned);
+    free(mine.ranges);
+    return 1;
+}
+
+void shuffle_usage(const char *name) {
+    printf("Usage: %s shuffle [--workers 4] [--precision 5] [--bucket 1h] [--port N] "
+            "OUTDIR tdv_file1 ... tdv_fileN\n", name);
+}
+
+/* Entry point of `climate shuffle` */
+int shuffle_main(int argc, char *argv[]) {
+    struct parallel_scan plan;
+    struct shuffle_stats *stats, total;
+    char **addresses;
+    pid_t *children;
+    int *listen_fds;
+    int num_workers = 4, precision = 5, port = 0, ok = 1, w, i;
+    int stats_pipe[2];
+    long bucket = 3600;
+
+    for (i = 1; i + 1 < argc && strncmp(argv[i], "--", 2) == 0; i += 2) {
+        if (strcmp(argv[i], "--workers") == 0) {
+            num_workers = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--precision") == 0) {
+            precision = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--bucket") == 0) {
+            bucket = parse_duration(argv[i + 1]);
+        } else if (strcmp(argv[i], "--port") == 0) {
+            port = atoi(argv[i + 1]);
+        } else {
+            shuffle_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (i + 1 >= argc || num_workers < 1 || num_workers > 64 || precision < 1
+            || precision > 12 || bucket <= 0 || port < 0 || port + num_workers > 65536) {
+        shuffle_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *dir = argv[i++];
+    mkdir(dir, 0777);
+
+    if (!plan_ranges(&plan, argv + i, argc - i, num_workers)) {
+        return EXIT_FAILURE;
+    }
+
+    /* Every worker listens before any starts, so none connects too early */
+    addresses = xrealloc(NULL, num_workers * sizeof(char *));
+    listen_fds = xrealloc(NULL, num_workers * sizeof(int));
+    children = xrealloc(NULL, num_workers * sizeof(pid_t));
+    stats = xrealloc(NULL, num_workers * sizeof(struct shuffle_stats));
+    for (w = 0; w < num_workers; ++w) {
+        addresses[w] = xrealloc(NULL, PATH_MAX);
+        if (port > 0) {
+            snprintf(addresses[w], PATH_MAX, "%d", port + w);
+        } else {
+            snprintf(addresses[w], PATH_MAX, "%s/worker-%03d.sock", dir, w);
+        }
+        listen_fds[w] = open_listener(addresses[w]);
+        if (listen_fds[w] < 0) {
+            fprintf(stderr, "Could not listen on %s\n", addresses[w]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (pipe(stats_pipe) != 0) {
+        fprintf(stderr, "Could not create a pipe\n");
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    long begin = trace_now();
+    fflush(stdout);
+    fflush(stderr);
+    for (w = 0; w < num_workers; ++w) {
+        children[w] = fork();
+        if (children[w] == 0) {
+            struct shuffle_stats mine;
+            int other;
+            for (other = 0; other < num_workers; ++other) {
+                if (other != w) {
+                    close(listen_fds[other]);
+                }
+            }
+            close(stats_pipe[0]);
+            memset(&mine, 0, sizeof mine);
+            mine.worker = w;
+            mine.failed = !shuffle_worker(&plan, w, num_workers, listen_fds[w], addresses,
+                    dir, precision, bucket, &mine);
+
+            /* Smaller than PIPE_BUF, so the reports of workers never mix */
+            if (write(stats_pipe[1], &mine, sizeof mine) != sizeof mine) {
+                _exit(1);
+            }
+            _exit(mine.failed);
+        }
+        if (children[w] < 0) {
+            fprintf(stderr, "Could not start worker %d\n", w);
+            return EXIT_FAILURE;
+        }
+    }
+    close(stats_pipe[1]);
+    for (w = 0; w < num_workers; ++w) {
+        close(listen_fds[w]);
+    }
+
+    memset(stats, 0, num_workers * sizeof(struct shuffle_stats));
+    for (w = 0; w < num_workers; ++w) {
+        stats[w].failed = 1;
+    }
+
+    /* Collect reports and exits as they come. The others would wait in the
+     * exchange for a worker that failed, so they are stopped right away. */
+    int *exited_ok = xrealloc(NULL, num_workers * sizeof(int));
+    int running = num_workers, stopping = 0;
+    struct shuffle_stats report;
+    while (running > 0) {
+        struct pollfd ready;
+        ready.fd = stats_pipe[0];
+        ready.events = POLLIN;
+        if (poll(&ready, 1, 100) > 0
+                && read(stats_pipe[0], &report, sizeof report) == sizeof report
+                && report.worker >= 0 && report.worker < num_workers) {
+            stats[report.worker] = report;
+        }
+        for (w = 0; w < num_workers; ++w) {
+            int status = 0;
+            pid_t done = children[w] > 0 ? waitpid(children[w], &status, WNOHANG) : 0;
+            if (done == 0) {
+                continue;
+            }
+            exited_ok[w] = done > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            children[w] = 0;
+            running--;
+            if (!exited_ok[w] && !stopping) {
+                fprintf(stderr, "Worker %d failed, stopping the others\n", w);
+                stopping = 1;
+            }
+        }
+        for (w = 0; stopping && w < num_workers; ++w) {
+            if (children[w] > 0) {
+                kill(children[w], SIGKILL);
+            }
+        }
+    }
+    while (read(stats_pipe[0], &report, sizeof report) == sizeof report) {
+        if (report.worker >= 0 && report.worker < num_workers) {
+            stats[report.worker] = report;
+        }
+    }
+    close(stats_pipe[0]);
+    for (w = 0; w < num_workers; ++w) {
+        if (!exited_ok[w] || stats[w].failed) {
+            fprintf(stderr, "Worker %d failed\n", w);
+            ok = 0;
+        }
+        if (port == 0) {
+            unlink(addresses[w]);
+        }
+    }
+    free(exited_ok);
+    long elapsed = trace_now() - begin;
+
+    memset(&total, 0, sizeof total);
+    fprintf(stderr, "worker\trows\tlocal_keys\tsent\treceived\towned_keys\tscan_ms"
+            "\texchange_ms\tfinalize_ms\n");
+    for (w = 0; w < num_workers; ++w) {
+        fprintf(stderr, "%d\t%lu\t%lu\t%lu\t%lu\t%lu\t%.1f\t%.1f\t%.1f\n", w, stats[w].rows,
+                stats[w].local_keys, stats[w].sent, stats[w].received, stats[w].owned_keys,
+                stats[w].scan_micros / 1e3, stats[w].exchange_micros / 1e3,
+                stats[w].finalize_micros / 1e3);
+        total.rows += stats[w].rows;
+        total.sent += stats[w].sent;
+        total.owned_keys += stats[w].owned_keys;
+    }
+    fprintf(stderr, "%lu rows into %lu keys, %lu partials shuffled among %d workers "
+            "in %.1f ms\n", total.rows, total.owned_keys, total.sent, num_workers, elapsed / 1e3);
 
+    for (w = 0; w < num_workers; ++w) {
+        free(addresses[w]);
     }
+    free(addresses);
+    free(listen_fds);
+    free(children);
+    free(stats);
+    free(plan.ranges);
+    return ok ? 0 : EXIT_FAILURE;
 }